@@ -0,0 +1,827 @@
+//fallocate() and sync_file_range()
+#define _GNU_SOURCE
+
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "logerr.h"
+
+#define ROUND_UP(value, multiple) ((((value) + (multiple) - 1) / (multiple)) * (multiple))
+
+//Iovecs of a frame written by archive_append(), the record is the first
+#define ARCHIVE_IOVECS 64
+
+static uint32_t crc_table[256];
+
+static void crc_table_init(void)
+{
+    uint32_t i;
+    for(i=0; i<256; i++)
+    {
+        uint32_t crc = i;
+
+        unsigned bit;
+        for(bit=0; bit<8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+
+        crc_table[i] = crc;
+    }
+}
+
+uint32_t archive_crc32(uint32_t crc, const void* data, size_t length)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, crc_table_init);
+
+    const uint8_t* byte = data;
+
+    crc = ~crc;
+
+    while(length--)
+        crc = crc_table[(crc ^ *byte++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static WARN_UNUSED
+enum error_code segment_paths(const char* base, unsigned segment, char* path, char* index_path)
+{
+    if(snprintf(path,       PATH_MAX, "%s.%06u.seg", base, segment) >= PATH_MAX ||
+       snprintf(index_path, PATH_MAX, "%s.%06u.idx", base, segment) >= PATH_MAX)
+    {
+        LOG_ERROR("archive: name of segment %u of %s too long", segment, base);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code pwrite_all(int fd, const void* data, size_t length, off_t offset, const char* path)
+{
+    const uint8_t* bytes = data;
+
+    while(length)
+    {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            LOG_ERRNO("pwrite %s %zu", path, length);
+            return ERROR;
+        }
+
+        bytes  += written;
+        length -= written;
+        offset += written;
+    }
+
+    return OK;
+}
+
+//Writes all the vector at *offset, which is moved past it. The vector is
+//modified by the short writes
+static WARN_UNUSED
+enum error_code pwritev_all(int fd, struct iovec* iov, unsigned count, off_t* offset, const char* path)
+{
+    while(count)
+    {
+        ssize_t written = pwritev(fd, iov, count, *offset);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            LOG_ERRNO("pwritev %s", path);
+            return ERROR;
+        }
+
+        *offset += written;
+
+        while(count && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if(count)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return OK;
+}
+
+//Syncs the range as the mode says
+static WARN_UNUSED
+enum error_code sync_range(int fd, off_t offset, off_t length, file_sync_mode sync, const char* path)
+{
+    switch(sync)
+    {
+        case FILE_SYNC_NONE:
+            break;
+
+        case FILE_SYNC_FDATASYNC:
+            if(fdatasync(fd))
+            {
+                LOG_ERRNO("fdatasync %s", path);
+                return ERROR;
+            }
+            break;
+
+        case FILE_SYNC_RANGE:
+            if(sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+            {
+                LOG_ERRNO("sync_file_range %s", path);
+                return ERROR;
+            }
+            break;
+    }
+
+    return OK;
+}
+
+//Allocates the file up to at least size, extent at a time. Not every file
+//system can, the file grows as usual then
+static WARN_UNUSED
+enum error_code allocate(int fd, off_t* allocated, off_t size, off_t extent, const char* path)
+{
+    if(size <= *allocated)
+        return OK;
+
+    off_t length = ROUND_UP(size - *allocated, extent);
+
+    if(fallocate(fd, 0, *allocated, length))
+    {
+        if(errno == EOPNOTSUPP || errno == ENOSYS)
+            return OK;
+
+        LOG_ERRNO("fallocate %s %lld", path, (long long)length);
+        return ERROR;
+    }
+
+    *allocated += length;
+
+    return OK;
+}
+
+//Number of the frame after the last one indexed in the segment
+static WARN_UNUSED
+enum error_code next_number(const char* index_path, uint32_t* number)
+{
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        LOG_ERRNO("open %s", index_path);
+        return ERROR;
+    }
+
+    enum error_code result = OK;
+    struct archive_index_header header;
+
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != ARCHIVE_INDEX_MAGIC)
+    {
+        LOG_ERROR("archive: %s is not an index", index_path);
+        result = ERROR;
+    }
+    else
+    {
+        *number = header.first;
+
+        struct archive_index_entry entries[256];
+        off_t offset = sizeof(header);
+        ssize_t got;
+
+        while((got = pread(fd, entries, sizeof(entries), offset)) > 0)
+        {
+            unsigned count = got / sizeof(entries[0]);
+            unsigned i;
+
+            for(i=0; i<count && entries[i].length; i++)
+                *number = entries[i].number + 1;
+
+            if(i < count || !count)
+                break;
+
+            offset += count * sizeof(entries[0]);
+        }
+    }
+
+    close(fd);
+
+    return result;
+}
+
+enum error_code archive_open(archive_t* archive, const char* base, off_t segment_max, file_sync_mode sync)
+{
+    enum error_code result;
+
+    memset(archive, 0, sizeof(*archive));
+
+    archive->base        = base;
+    archive->segment_max = segment_max ? segment_max : ARCHIVE_SEGMENT_MAX;
+    archive->sync        = sync;
+    archive->fd          = -1;
+    archive->index       = -1;
+
+    //The new segment goes after the last one
+    while(1)
+    {
+        result = segment_paths(base, archive->segment, archive->path, archive->index_path); if(result!=OK) { return result; }
+
+        if(access(archive->index_path, F_OK))
+            break;
+
+        archive->segment++;
+    }
+
+    if(archive->segment)
+    {
+        result = segment_paths(base, archive->segment - 1, archive->path, archive->index_path); if(result!=OK) { return result; }
+        result = next_number(archive->index_path, &archive->number);                          if(result!=OK) { return result; }
+    }
+
+    return file_sync_directory(base, sync, &archive->directory);
+}
+
+//Trims the files of the segment to what they hold and closes them
+static WARN_UNUSED
+enum error_code segment_close(archive_t* archive)
+{
+    enum error_code result = OK;
+
+    if(archive->fd == -1)
+        return OK;
+
+    if(ftruncate(archive->fd, archive->size))
+    {
+        LOG_ERRNO("ftruncate %s", archive->path);
+        result = ERROR;
+    }
+
+    if(ftruncate(archive->index, archive->index_size))
+    {
+        LOG_ERRNO("ftruncate %s", archive->index_path);
+        result = ERROR;
+    }
+
+    //The sizes changed, a range sync does not cover them
+    if(result == OK && archive->sync != FILE_SYNC_NONE)
+    {
+        result = sync_range(archive->fd, 0, 0, FILE_SYNC_FDATASYNC, archive->path);
+
+        if(result == OK)
+            result = sync_range(archive->index, 0, 0, FILE_SYNC_FDATASYNC, archive->index_path);
+    }
+
+    if(close(archive->fd) && result == OK)
+    {
+        LOG_ERRNO("close %s", archive->path);
+        result = ERROR;
+    }
+
+    if(close(archive->index) && result == OK)
+    {
+        LOG_ERRNO("close %s", archive->index_path);
+        result = ERROR;
+    }
+
+    archive->fd    = -1;
+    archive->index = -1;
+    archive->segment++;
+
+    return result;
+}
+
+//Writes the headers of the segment just opened and makes its names durable
+static WARN_UNUSED
+enum error_code segment_init(archive_t* archive)
+{
+    enum error_code result;
+
+    struct archive_segment_header header = {
+        .magic   = ARCHIVE_SEGMENT_MAGIC,
+        .version = ARCHIVE_VERSION,
+        .segment = archive->segment,
+        .created = now_ns()
+    };
+
+    struct archive_index_header index_header = {
+        .magic   = ARCHIVE_INDEX_MAGIC,
+        .version = ARCHIVE_VERSION,
+        .segment = archive->segment,
+        .first   = archive->number
+    };
+
+    archive->size            = ROUND_UP(sizeof(header), ARCHIVE_ALIGN);
+    archive->allocated       = 0;
+    archive->synced          = 0;
+    archive->index_size      = sizeof(index_header);
+    archive->index_allocated = 0;
+
+    result = allocate(archive->index, &archive->index_allocated, archive->index_size, ARCHIVE_INDEX_EXTENT, archive->index_path); if(result!=OK) { return result; }
+
+    result = pwrite_all(archive->fd,    &header,       sizeof(header),       0, archive->path);       if(result!=OK) { return result; }
+    result = pwrite_all(archive->index, &index_header, sizeof(index_header), 0, archive->index_path); if(result!=OK) { return result; }
+
+    //The names of the segment, the only metadata of the archive in the sync
+    //of the frames
+    if(archive->directory != -1 && fsync(archive->directory))
+    {
+        LOG_ERRNO("fsync %s", archive->path);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+//Removes a segment that could not be initialized, the next frame opens it
+//again from scratch
+static void segment_discard(archive_t* archive)
+{
+    close(archive->fd);
+    close(archive->index);
+
+    unlink(archive->path);
+    unlink(archive->index_path);
+
+    archive->fd    = -1;
+    archive->index = -1;
+}
+
+static WARN_UNUSED
+enum error_code segment_open(archive_t* archive)
+{
+    enum error_code result;
+
+    result = segment_paths(archive->base, archive->segment, archive->path, archive->index_path); if(result!=OK) { return result; }
+
+    //O_EXCL, an archive has a single writer
+    archive->fd = open(archive->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(archive->fd == -1)
+    {
+        LOG_ERRNO("open %s", archive->path);
+        return ERROR;
+    }
+
+    archive->index = open(archive->index_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(archive->index == -1)
+    {
+        LOG_ERRNO("open %s", archive->index_path);
+        close(archive->fd);
+        unlink(archive->path);
+        archive->fd = -1;
+        return ERROR;
+    }
+
+    result = segment_init(archive);
+    if(result!=OK)
+    {
+        segment_discard(archive);
+        return result;
+    }
+
+    archive->segments++;
+
+    return OK;
+}
+
+enum error_code archive_close(archive_t* archive)
+{
+    enum error_code result = segment_close(archive);
+
+    LOG_MESSAGE("archive: %llu frames (%llu bytes) in %u segments of %s",
+            (unsigned long long)archive->frames, (unsigned long long)archive->bytes, archive->segments, archive->base);
+
+    if(archive->directory != -1)
+    {
+        close(archive->directory);
+        archive->directory = -1;
+    }
+
+    return result;
+}
+
+int archive_fits(const archive_t* archive, size_t length)
+{
+    //An empty segment takes any frame
+    return archive->fd == -1 ||
+           archive->size == ROUND_UP(sizeof(struct archive_segment_header), ARCHIVE_ALIGN) ||
+           archive->size + (off_t)(sizeof(struct archive_record) + length) <= archive->segment_max;
+}
+
+enum error_code archive_reserve(archive_t* archive, const frame_t* frame, struct archive_record* record, int* fd, off_t* offset)
+{
+    enum error_code result;
+
+    if(frame->truncated || frame->length > UINT32_MAX)
+    {
+        LOG_ERROR("archive: frame %u can't be archived, %zu bytes%s", frame->number, frame->length, frame->truncated ? ", truncated" : "");
+        return ERROR;
+    }
+
+    if(!archive_fits(archive, frame->length))
+    {
+        result = segment_close(archive); if(result!=OK) { return result; }
+    }
+
+    if(archive->fd == -1)
+    {
+        result = segment_open(archive); if(result!=OK) { return result; }
+    }
+
+    off_t end = archive->size + sizeof(*record) + frame->length;
+
+    result = allocate(archive->fd, &archive->allocated, end, ARCHIVE_EXTENT, archive->path); if(result!=OK) { return result; }
+
+    memset(record, 0, sizeof(*record));
+
+    record->magic     = ARCHIVE_RECORD_MAGIC;
+    record->number    = archive->number++;
+    record->timestamp = frame->timestamp;
+    record->length    = frame->length;
+
+    memcpy(record->info, frame->info, sizeof(record->info));
+
+    const struct frame_chunk* chunk;
+    for(chunk=frame->first; chunk; chunk=chunk->next)
+        record->crc = archive_crc32(record->crc, chunk->data, chunk->used);
+
+    *fd     = archive->fd;
+    *offset = archive->size;
+
+    //The allocated bytes are zeros, the padding is not written
+    archive->size = ROUND_UP(end, ARCHIVE_ALIGN);
+
+    return OK;
+}
+
+enum error_code archive_commit(archive_t* archive, const struct archive_index_entry* entries, unsigned count)
+{
+    enum error_code result;
+
+    if(!count)
+        return OK;
+
+    //The frames first, the index must not point to what is not written.
+    //sync_file_range() writes the data of the preallocated blocks but not
+    //their marking as written, after a crash they would read back as zeros:
+    //the segment is fdatasync'ed in range mode too
+    file_sync_mode sync = archive->sync == FILE_SYNC_RANGE ? FILE_SYNC_FDATASYNC : archive->sync;
+
+    result = sync_range(archive->fd, archive->synced, archive->size - archive->synced, sync, archive->path); if(result!=OK) { return result; }
+
+    archive->synced = archive->size;
+
+    off_t length = count * sizeof(*entries);
+
+    result = allocate(archive->index, &archive->index_allocated, archive->index_size + length, ARCHIVE_INDEX_EXTENT, archive->index_path); if(result!=OK) { return result; }
+
+    result = pwrite_all(archive->index, entries, length, archive->index_size, archive->index_path);          if(result!=OK) { return result; }
+    result = sync_range(archive->index, archive->index_size, length, archive->sync, archive->index_path);   if(result!=OK) { return result; }
+
+    archive->index_size += length;
+
+    unsigned i;
+    for(i=0; i<count; i++)
+        archive->bytes += entries[i].length;
+
+    archive->frames += count;
+
+    return OK;
+}
+
+enum error_code archive_append(archive_t* archive, const frame_t* frame)
+{
+    enum error_code result;
+
+    struct archive_record record;
+    int fd;
+    off_t offset;
+
+    result = archive_reserve(archive, frame, &record, &fd, &offset); if(result!=OK) { return result; }
+
+    struct iovec iov[ARCHIVE_IOVECS];
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len  = sizeof(record);
+
+    unsigned first = frame_iovec(frame, 0, &iov[1], ARCHIVE_IOVECS - 1);
+    unsigned count = first + 1;
+
+    while(count)
+    {
+        result = pwritev_all(fd, iov, count, &offset, archive->path); if(result!=OK) { return result; }
+
+        count = frame_iovec(frame, first, iov, ARCHIVE_IOVECS);
+        first += count;
+    }
+
+    struct archive_index_entry entry = {
+        .offset = offset - sizeof(record) - record.length,
+        .length = record.length,
+        .number = record.number
+    };
+
+    return archive_commit(archive, &entry, 1);
+}
+
+/*****************************************************************************/
+
+enum error_code archive_reader_open(archive_reader_t* reader, const char* base)
+{
+    enum error_code result;
+
+    memset(reader, 0, sizeof(*reader));
+
+    reader->base    = base;
+    reader->segment = -1;
+
+    char path[PATH_MAX], index_path[PATH_MAX];
+
+    while(1)
+    {
+        result = segment_paths(base, reader->segments, path, index_path); if(result!=OK) { return result; }
+
+        if(access(index_path, F_OK))
+            break;
+
+        reader->segments++;
+    }
+
+    if(!reader->segments)
+    {
+        LOG_ERROR("archive: no segment of %s", base);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+static void reader_unmap(archive_reader_t* reader)
+{
+    if(reader->data)
+        munmap((void*)reader->data, reader->data_size);
+
+    if(reader->header)
+        munmap((void*)reader->header, reader->index_size);
+
+    reader->data    = NULL;
+    reader->header  = NULL;
+    reader->entries = NULL;
+    reader->count   = 0;
+    reader->segment = -1;
+}
+
+void archive_reader_close(archive_reader_t* reader)
+{
+    reader_unmap(reader);
+}
+
+//Maps the whole file read only, size 0 if it is empty
+static WARN_UNUSED
+enum error_code map(const char* path, const void** data, size_t* size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        LOG_ERRNO("open %s", path);
+        return ERROR;
+    }
+
+    struct stat status;
+
+    if(fstat(fd, &status))
+    {
+        LOG_ERRNO("fstat %s", path);
+        close(fd);
+        return ERROR;
+    }
+
+    *data = NULL;
+    *size = status.st_size;
+
+    if(*size)
+    {
+        void* mapped = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        if(mapped == MAP_FAILED)
+        {
+            LOG_ERRNO("mmap %s %zu", path, *size);
+            close(fd);
+            return ERROR;
+        }
+
+        *data = mapped;
+    }
+
+    close(fd);
+
+    return OK;
+}
+
+enum error_code archive_reader_segment(archive_reader_t* reader, unsigned segment)
+{
+    enum error_code result;
+
+    if(reader->segment == (int)segment)
+        return OK;
+
+    reader_unmap(reader);
+
+    char path[PATH_MAX], index_path[PATH_MAX];
+
+    result = segment_paths(reader->base, segment, path, index_path); if(result!=OK) { return result; }
+
+    const void* index;
+    const void* data;
+
+    result = map(index_path, &index, &reader->index_size); if(result!=OK) { return result; }
+
+    reader->header = index;
+
+    if(reader->index_size < sizeof(*reader->header) || reader->header->magic != ARCHIVE_INDEX_MAGIC || reader->header->version != ARCHIVE_VERSION)
+    {
+        LOG_ERROR("archive: %s is not an index of version %d", index_path, ARCHIVE_VERSION);
+        reader_unmap(reader);
+        return ERROR;
+    }
+
+    result = map(path, &data, &reader->data_size);
+    if(result!=OK)
+    {
+        reader_unmap(reader);
+        return result;
+    }
+
+    reader->data = data;
+
+    const struct archive_segment_header* header = data;
+
+    if(reader->data_size < sizeof(*header) || header->magic != ARCHIVE_SEGMENT_MAGIC || header->version != ARCHIVE_VERSION)
+    {
+        LOG_ERROR("archive: %s is not a segment of version %d", path, ARCHIVE_VERSION);
+        reader_unmap(reader);
+        return ERROR;
+    }
+
+    reader->entries = (const struct archive_index_entry*)(reader->header + 1);
+
+    unsigned count = (reader->index_size - sizeof(*reader->header)) / sizeof(*reader->entries);
+
+    //Zeros after the last entry if the writer did not close the segment
+    while(reader->count < count && reader->entries[reader->count].length)
+        reader->count++;
+
+    reader->segment = segment;
+
+    return OK;
+}
+
+enum error_code archive_reader_frame(const archive_reader_t* reader, unsigned entry, int check,
+        const struct archive_record** record, const uint8_t** jpeg)
+{
+    if(entry >= reader->count)
+    {
+        LOG_ERROR("archive: segment %d has %u frames, not %u", reader->segment, reader->count, entry + 1);
+        return ERROR;
+    }
+
+    const struct archive_index_entry* index = &reader->entries[entry];
+
+    if(index->offset % ARCHIVE_ALIGN || index->offset + sizeof(**record) + index->length > reader->data_size)
+    {
+        LOG_ERROR("archive: frame %u is out of segment %d", index->number, reader->segment);
+        return ERROR;
+    }
+
+    *record = (const struct archive_record*)&reader->data[index->offset];
+    *jpeg   = (const uint8_t*)(*record + 1);
+
+    if((*record)->magic != ARCHIVE_RECORD_MAGIC || (*record)->number != index->number || (*record)->length != index->length)
+    {
+        LOG_ERROR("archive: record of frame %u of segment %d does not match its index", index->number, reader->segment);
+        return ERROR;
+    }
+
+    if(check && archive_crc32(0, *jpeg, (*record)->length) != (*record)->crc)
+    {
+        LOG_ERROR("archive: frame %u of segment %d is corrupt, wrong CRC", index->number, reader->segment);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+//First frame of the segment, from its index header
+static WARN_UNUSED
+enum error_code segment_first(const archive_reader_t* reader, unsigned segment, uint32_t* first)
+{
+    enum error_code result;
+
+    char path[PATH_MAX], index_path[PATH_MAX];
+
+    result = segment_paths(reader->base, segment, path, index_path); if(result!=OK) { return result; }
+
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        LOG_ERRNO("open %s", index_path);
+        return ERROR;
+    }
+
+    struct archive_index_header header;
+
+    result = pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == ARCHIVE_INDEX_MAGIC ? OK : ERROR;
+
+    close(fd);
+
+    if(result!=OK)
+    {
+        LOG_ERROR("archive: %s is not an index", index_path);
+        return ERROR;
+    }
+
+    *first = header.first;
+
+    return OK;
+}
+
+enum error_code archive_reader_find(archive_reader_t* reader, uint32_t number, unsigned* entry)
+{
+    enum error_code result;
+
+    //Last segment starting at or before the frame
+    unsigned low = 0, high = reader->segments;
+
+    while(high - low > 1)
+    {
+        unsigned middle = (low + high) / 2;
+        uint32_t first;
+
+        result = segment_first(reader, middle, &first); if(result!=OK) { return result; }
+
+        if(first <= number)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    result = archive_reader_segment(reader, low); if(result!=OK) { return result; }
+
+    //Where it is unless frames failed before it in the segment
+    uint32_t slot = number - reader->header->first;
+
+    if(number >= reader->header->first && slot < reader->count && reader->entries[slot].number == number)
+    {
+        *entry = slot;
+        return OK;
+    }
+
+    unsigned first = 0, last = reader->count;
+
+    while(first < last)
+    {
+        unsigned middle = (first + last) / 2;
+
+        if(reader->entries[middle].number < number)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+
+    if(first == reader->count || reader->entries[first].number != number)
+    {
+        LOG_ERROR("archive: no frame %u in %s", number, reader->base);
+        return ERROR;
+    }
+
+    *entry = first;
+
+    return OK;
+}
@@ -0,0 +1,181 @@
+#ifndef  ARCHIVE_INC
+#define  ARCHIVE_INC
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "error.h"
+#include "file_sink.h"
+#include "frame_sink.h"
+
+/*
+   Append-only archive of frames, for the jobs of thousands of frames where
+   a file per frame spends more time in the file system than in the data.
+
+   The archive is a series of segments named <base>.<segment>.seg, each with
+   its index <base>.<segment>.idx next to it. A segment is a header then the
+   frames back to back, each one a record (struct archive_record: number,
+   timestamp, capture info, size and CRC-32) followed by the JPEG, aligned to
+   8 bytes. The index is the list of the records committed to the segment,
+   in order, a reader finds any frame from it without reading the segment.
+
+   Both files are allocated ARCHIVE_EXTENT at a time and trimmed when the
+   segment is closed, so the frames do not grow the files, and a name is
+   created once per segment. With FILE_SYNC_NONE nothing is synced. Otherwise
+   the frames are synced with fdatasync() before their index entries are
+   written, the index never points to a frame that is not on the disk. In
+   range mode too: sync_file_range() does not commit the marking of the
+   preallocated blocks as written. The index is synced as the mode says, in
+   range mode its last entries may read back as zeros after a crash, those
+   frames are lost. A crash leaves the end of the files zeroed, a zero entry
+   ends the index.
+
+   The records are in the byte order of the host, the archive is read on the
+   host that wrote it or one of the same family.
+
+   Opening an archive that exists starts a new segment after the last one,
+   and the frame numbers go on from the last indexed frame.
+   */
+
+#define ARCHIVE_VERSION        1
+
+#define ARCHIVE_SEGMENT_MAGIC  0x47455343 //"CSEG"
+#define ARCHIVE_RECORD_MAGIC   0x4d524643 //"CFRM"
+#define ARCHIVE_INDEX_MAGIC    0x58444943 //"CIDX"
+
+//A segment is closed past this size, a frame is never split
+#define ARCHIVE_SEGMENT_MAX    ((off_t)1024*1024*1024)
+//Allocated at once when a segment needs room, and for the indices
+#define ARCHIVE_EXTENT         ((off_t)64*1024*1024)
+#define ARCHIVE_INDEX_EXTENT   ((off_t)64*1024)
+
+#define ARCHIVE_ALIGN          8
+
+struct archive_segment_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment;
+    uint32_t reserved;
+    //CLOCK_REALTIME of the creation, in nanoseconds
+    uint64_t created;
+};
+
+struct archive_record
+{
+    uint32_t magic;
+    //Frame number in the archive, from 0
+    uint32_t number;
+    //CLOCK_REALTIME of the first slice, in nanoseconds
+    uint64_t timestamp;
+    //Bytes of the JPEG after the record
+    uint32_t length;
+    uint32_t crc;
+    //Info of the frame, struct camera_shot_configuration for camera-app
+    uint8_t  info[FRAME_INFO_SIZE];
+};
+
+struct archive_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment;
+    //Number of the first frame of the segment
+    uint32_t first;
+};
+
+struct archive_index_entry
+{
+    //Of the record in the segment
+    uint64_t offset;
+    //Of the JPEG, 0 past the last entry
+    uint32_t length;
+    uint32_t number;
+};
+
+typedef struct
+{
+    //Path of the segments without their suffix
+    const char*     base;
+    off_t           segment_max;
+    file_sync_mode  sync;
+    //Directory of the segments, to sync their names. -1 if not needed
+    int             directory;
+    //Number of the segment being written or, when its files are -1, of the
+    //next one opened by a frame
+    unsigned        segment;
+    int             fd;
+    int             index;
+    char            path[PATH_MAX];
+    char            index_path[PATH_MAX];
+    //Bytes used and allocated in both files
+    off_t           size;
+    off_t           allocated;
+    off_t           synced;
+    off_t           index_size;
+    off_t           index_allocated;
+    //Number of the next frame
+    uint32_t        number;
+    //Totals since the open, of the frames committed and the segments created
+    uint64_t        frames;
+    uint64_t        bytes;
+    unsigned        segments;
+} archive_t;
+
+//segment_max 0 is ARCHIVE_SEGMENT_MAX. The directory of base must exist
+WARN_UNUSED enum error_code archive_open (archive_t* archive, const char* base, off_t segment_max, file_sync_mode sync);
+//Closes the segment being written, the frames not committed are lost
+WARN_UNUSED enum error_code archive_close(archive_t* archive);
+
+//Whether a frame of the given length goes in the current segment. The frames
+//reserved in a segment must be committed before a frame that does not fit is
+//reserved, it closes the segment
+int archive_fits(const archive_t* archive, size_t length);
+//Makes room for the frame, fills its record and where it goes: the record
+//then the chunks of the frame are written at offset of fd
+WARN_UNUSED enum error_code archive_reserve(archive_t* archive, const frame_t* frame, struct archive_record* record, int* fd, off_t* offset);
+//The frames are written: syncs them as the mode says, then adds them to the
+//index in the given order
+WARN_UNUSED enum error_code archive_commit (archive_t* archive, const struct archive_index_entry* entries, unsigned count);
+
+//Reserves, writes and commits one frame
+WARN_UNUSED enum error_code archive_append (archive_t* archive, const frame_t* frame);
+
+//CRC-32 (IEEE 802.3) of the data, crc is 0 at the start
+uint32_t archive_crc32(uint32_t crc, const void* data, size_t length);
+
+/*
+   Reading. A segment and its index are mapped, the frames are read in place.
+   */
+
+typedef struct
+{
+    const char*                        base;
+    //Segments found, numbered from 0
+    unsigned                           segments;
+    //Mapped segment, -1 if none
+    int                                segment;
+    const uint8_t*                     data;
+    size_t                             data_size;
+    const struct archive_index_header* header;
+    const struct archive_index_entry*  entries;
+    size_t                             index_size;
+    //Entries up to the first zero one
+    unsigned                           count;
+} archive_reader_t;
+
+WARN_UNUSED enum error_code archive_reader_open (archive_reader_t* reader, const char* base);
+void                        archive_reader_close(archive_reader_t* reader);
+
+//Maps the segment, the previous one is unmapped
+WARN_UNUSED enum error_code archive_reader_segment(archive_reader_t* reader, unsigned segment);
+//Record and JPEG of the entry of the mapped segment, checked against the
+//index. The CRC is checked only if asked
+WARN_UNUSED enum error_code archive_reader_frame(const archive_reader_t* reader, unsigned entry, int check,
+        const struct archive_record** record, const uint8_t** jpeg);
+//Maps the segment of the frame and finds its entry
+WARN_UNUSED enum error_code archive_reader_find(archive_reader_t* reader, uint32_t number, unsigned* entry);
+
+#endif
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "logerr.h"
+#include "archive.h"
+#include "omx_still.h"
+
+/*
+   Reads the archives written by camera-app (see archive.h). The segments and
+   their indices are mapped, a frame is found from the indices alone.
+
+   list prints a line per frame: number, segment, offset, size, time and the
+   configuration of the shot. extract writes the JPEG of a frame to a file or
+   stdout, its CRC checked. verify checks the CRC of every frame.
+
+   Usage: camera-archive list    base
+          camera-archive extract base number [file]
+          camera-archive verify  base
+   */
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s list base\n"
+                    "       %s extract base number [file]\n"
+                    "       %s verify base\n", program, program, program);
+}
+
+static void print_time(uint64_t timestamp, char* text, size_t size)
+{
+    time_t seconds = timestamp / 1000000000;
+    struct tm tm;
+
+    gmtime_r(&seconds, &tm);
+
+    size_t length = strftime(text, size, "%Y-%m-%dT%H:%M:%S", &tm);
+
+    snprintf(text + length, size - length, ".%03uZ", (unsigned)(timestamp % 1000000000 / 1000000));
+}
+
+static WARN_UNUSED
+enum error_code list(archive_reader_t* reader, int check)
+{
+    enum error_code result = OK;
+    unsigned frames = 0, failed = 0;
+
+    unsigned segment;
+    for(segment=0; segment<reader->segments; segment++)
+    {
+        if(archive_reader_segment(reader, segment)!=OK)
+        {
+            result = ERROR;
+            continue;
+        }
+
+        unsigned entry;
+        for(entry=0; entry<reader->count; entry++)
+        {
+            const struct archive_record* record;
+            const uint8_t* jpeg;
+
+            frames++;
+
+            if(archive_reader_frame(reader, entry, check, &record, &jpeg)!=OK)
+            {
+                failed++;
+                result = ERROR;
+                continue;
+            }
+
+            if(check)
+                continue;
+
+            struct camera_shot_configuration config;
+            char time[40];
+
+            //The info is a copy of the configuration of the shot
+            memcpy(&config, record->info, sizeof(config) < sizeof(record->info) ? sizeof(config) : sizeof(record->info));
+
+            print_time(record->timestamp, time, sizeof(time));
+
+            printf("%u\t%u\t%" PRIu64 "\t%u\t%s\tshutter %d iso %d quality %d %ux%u\n",
+                   record->number, segment, reader->entries[entry].offset, record->length, time,
+                   config.shutterSpeed, config.iso, config.quality, config.width, config.height);
+        }
+    }
+
+    if(check)
+        printf("%u frames in %u segments, %u failed\n", frames, reader->segments, failed);
+
+    return result;
+}
+
+static WARN_UNUSED
+enum error_code extract(archive_reader_t* reader, const char* number, const char* path)
+{
+    enum error_code result;
+
+    char* end;
+    unsigned long value = strtoul(number, &end, 10);
+
+    if(!*number || *end || value > UINT32_MAX)
+    {
+        LOG_ERROR("not a frame number: %s", number);
+        return ERROR;
+    }
+
+    unsigned entry;
+    const struct archive_record* record;
+    const uint8_t* jpeg;
+
+    result = archive_reader_find(reader, value, &entry);              if(result!=OK) { return result; }
+    result = archive_reader_frame(reader, entry, 1, &record, &jpeg); if(result!=OK) { return result; }
+
+    FILE* file = path ? fopen(path, "wb") : stdout;
+    if(!file)
+    {
+        LOG_ERRNO("fopen %s", path);
+        return ERROR;
+    }
+
+    if(fwrite(jpeg, 1, record->length, file) != record->length)
+    {
+        LOG_ERRNO("fwrite %s", path ? path : "stdout");
+        result = ERROR;
+    }
+
+    if(fflush(file) && result == OK)
+    {
+        LOG_ERRNO("fflush %s", path ? path : "stdout");
+        result = ERROR;
+    }
+
+    if(path)
+        fclose(file);
+
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    enum error_code result;
+
+    if(argc < 3)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+
+    const char* command = argv[1];
+
+    int is_list    = strcmp(command, "list") == 0    && argc == 3;
+    int is_verify  = strcmp(command, "verify") == 0  && argc == 3;
+    int is_extract = strcmp(command, "extract") == 0 && (argc == 4 || argc == 5);
+
+    if(!is_list && !is_verify && !is_extract)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+
+    archive_reader_t reader;
+
+    result = archive_reader_open(&reader, argv[2]); if(result!=OK) { return result; }
+
+    if(is_extract)
+        result = extract(&reader, argv[3], argc == 5 ? argv[4] : NULL);
+    else
+        result = list(&reader, is_verify);
+
+    archive_reader_close(&reader);
+
+    return result;
+}
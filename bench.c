@@ -0,0 +1,1117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "omx.h"
+
+#include "logerr.h"
+#include "latency.h"
+#include "omx_still.h"
+#include "omx_config.h"
+#include "omx_component.h"
+#include "jpeg_scan.h"
+#include "pretrigger.h"
+
+/*
+   Capture benchmark. Runs the still pipeline through one or all the scenarios
+   and writes, as JSON, the latency percentiles of every phase, the shots and
+   bytes per second and the CPU time used.
+
+   camera-bench is linked against the VideoCore libraries and measures the
+   firmware, camera-bench-fake is linked against omx_fake.c and measures only
+   this code, so it runs on any host.
+
+   The queue scenario queues all the shots at once with
+   omx_still_shoot_async(), the phases are measured from the time every shot
+   is queued. The polled scenario does the same on a session without threads
+   of its own, driven from its event fd.
+
+   The stream scenario shoots the -f frames of every iteration in one
+   continuous burst (omx_still_burst()), the splitter streaming at the frame
+   rate of the sensor instead of single stepping. The report adds the frame
+   rate the sensor timestamps show and the frames dropped on the way.
+
+   The pretrigger scenario captures continuously with a ring of the last
+   BENCH_PRE_FRAMES frames and triggers once per iteration, the frames after
+   the trigger are the -f frames. The phases are the times from the trigger
+   to the first frame given to the output, the last frame of the ring, and
+   to the last frame after the trigger.
+
+   The scan scenario does not use the camera: it checks every marker scanner
+   the CPU can run against the scalar one on random data, then times them
+   over a frame of entropy coded data.
+
+   -b reads the sensor 2x2 binned, at half the width and height. -d logs the
+   port definitions on every open, -c keeps the port definitions of the new
+   components in a file (see omx_still_port_cache()) so the cold-open
+   scenario can be measured with and without it.
+
+   The log goes to stderr as usual, the report to stdout (or -o).
+
+   Usage: camera-bench [-s scenario] [-n iterations] [-w warmup] [-f frames]
+                       [-q] [-b] [-d] [-c cache] [-o file]
+   */
+
+#define BENCH_ITERATIONS  10
+#define BENCH_WARMUP      1
+#define BENCH_FRAMES      5
+#define BENCH_PHASES_MAX  8
+
+//Frames kept before the trigger by the pretrigger scenario, and the memory
+//of its frames
+#define BENCH_PRE_FRAMES  4
+#define BENCH_CHUNK_SIZE  (256*1024)
+#define BENCH_MEMORY_MAX  (64*1024*1024)
+
+//Size of the data scanned per iteration and random buffers checked per
+//iteration by the scan scenario
+#define SCAN_FRAME_SIZE   (4*1024*1024)
+#define SCAN_FUZZ_TRIALS  2000
+#define SCAN_FUZZ_SIZE    512
+
+struct bench_options
+{
+    const char* scenario;
+    unsigned    iterations;
+    //Iterations run before measuring, not reported
+    unsigned    warmup;
+    //Frames of every shot of the burst scenario
+    uint32_t    frames;
+    //The reconfigure scenario changes the quality too, the encoder output
+    //port has to be restarted then
+    int         quality_change;
+};
+
+struct bench_phase
+{
+    const char*              name;
+    struct latency_histogram histogram;
+};
+
+struct bench_run
+{
+    const struct bench_options* options;
+    struct bench_phase          phases[BENCH_PHASES_MAX];
+    unsigned                    phases_count;
+    //Implementation measured, if the scenario has several
+    const char*                 implementation;
+    //Totals of the measured iterations only
+    int                         measuring;
+    uint64_t                    measure_start;
+    struct rusage               usage_start;
+    uint64_t                    wall;
+    uint64_t                    user;
+    uint64_t                    system;
+    uint64_t                    shots;
+    uint64_t                    bytes;
+    //Of the continuous bursts: frames lost, and the frames and time between
+    //the first and the last frame of each, by the sensor timestamps
+    uint64_t                    dropped;
+    uint64_t                    stream_intervals;
+    uint64_t                    stream_us;
+    //Settings sent to the components and skipped as unchanged
+    uint64_t                    configs_sent_start;
+    uint64_t                    configs_skipped_start;
+    uint64_t                    configs_sent;
+    uint64_t                    configs_skipped;
+    //Port definitions asked to the components and taken from the caches
+    uint64_t                    port_defs_read_start;
+    uint64_t                    port_defs_cached_start;
+    uint64_t                    port_defs_read;
+    uint64_t                    port_defs_cached;
+};
+
+//What the handler receives of a single omx_still_shoot()
+struct bench_shot
+{
+    struct bench_run* run;
+    uint64_t          start;
+    uint64_t          bytes;
+    uint32_t          frames;
+};
+
+static uint64_t timeval_us(struct timeval t)
+{
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static struct latency_histogram* phase(struct bench_run* run, const char* name)
+{
+    unsigned i;
+    for(i=0; i<run->phases_count; i++)
+    {
+        if(strcmp(run->phases[i].name, name) == 0)
+            return &run->phases[i].histogram;
+    }
+
+    if(run->phases_count == BENCH_PHASES_MAX)
+        return NULL;
+
+    struct bench_phase* p = &run->phases[run->phases_count++];
+
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+
+    return &p->histogram;
+}
+
+//Records the time since start in the phase, if the iteration is measured
+static void record(struct bench_run* run, const char* name, uint64_t start)
+{
+    if(!run->measuring)
+        return;
+
+    struct latency_histogram* histogram = phase(run, name);
+
+    if(histogram)
+        latency_histogram_record(histogram, latency_now() - start);
+}
+
+static void measure_start(struct bench_run* run)
+{
+    run->measuring = 1;
+
+    getrusage(RUSAGE_SELF, &run->usage_start);
+    omx_config_counters(&run->configs_sent_start, &run->configs_skipped_start);
+    port_definition_counters(&run->port_defs_read_start, &run->port_defs_cached_start);
+    run->measure_start = latency_now();
+}
+
+static void measure_stop(struct bench_run* run)
+{
+    if(!run->measuring)
+        return;
+
+    struct rusage usage;
+    uint64_t sent, skipped, read, cached;
+
+    run->wall += latency_now() - run->measure_start;
+    getrusage(RUSAGE_SELF, &usage);
+    omx_config_counters(&sent, &skipped);
+    port_definition_counters(&read, &cached);
+
+    run->configs_sent     += sent    - run->configs_sent_start;
+    run->configs_skipped  += skipped - run->configs_skipped_start;
+    run->port_defs_read   += read    - run->port_defs_read_start;
+    run->port_defs_cached += cached  - run->port_defs_cached_start;
+
+    run->user   += timeval_us(usage.ru_utime) - timeval_us(run->usage_start.ru_utime);
+    run->system += timeval_us(usage.ru_stime) - timeval_us(run->usage_start.ru_stime);
+
+    run->measuring = 0;
+}
+
+static void receive(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length)
+{
+    struct bench_shot* shot = context;
+
+    //Shutter lag, up to the first slice of the first frame
+    if(shot->bytes == 0 && length)
+        record(shot->run, "first_buffer", shot->start);
+
+    shot->bytes += length;
+
+    if(frame + 1 > shot->frames)
+        shot->frames = frame + 1;
+}
+
+static WARN_UNUSED
+enum error_code open_session(struct bench_run* run, struct camera_shot_configuration config, still_session** session)
+{
+    enum error_code result;
+    uint64_t start = latency_now();
+
+    result = omx_still_open(config, session); if(result!=OK) { return result; }
+
+    record(run, "open", start);
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code close_session(struct bench_run* run, still_session* session)
+{
+    enum error_code result;
+    uint64_t start = latency_now();
+
+    result = omx_still_close(session); if(result!=OK) { return result; }
+
+    record(run, "close", start);
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code shoot(struct bench_run* run, still_session* session, uint32_t frames)
+{
+    enum error_code result;
+
+    struct bench_shot shot = { .run = run, .start = latency_now() };
+
+    result = omx_still_shoot(session, frames, receive, &shot); if(result!=OK) { return result; }
+
+    record(run, "shoot", shot.start);
+
+    if(shot.frames != frames)
+        LOG_ERROR("bench: %" PRIu32 " frames requested, %" PRIu32 " received", frames, shot.frames);
+
+    if(run->measuring)
+    {
+        run->shots += shot.frames;
+        run->bytes += shot.bytes;
+    }
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code stream(struct bench_run* run, still_session* session, uint32_t frames)
+{
+    enum error_code result;
+    still_burst_report report;
+
+    struct bench_shot shot = { .run = run, .start = latency_now() };
+
+    result = omx_still_burst(session, frames, 0, receive, &shot, &report); if(result!=OK) { return result; }
+
+    record(run, "shoot", shot.start);
+
+    if(report.frames != frames)
+        LOG_ERROR("bench: %" PRIu32 " frames requested, %" PRIu32 " received", frames, report.frames);
+
+    if(run->measuring)
+    {
+        run->shots            += report.frames;
+        run->bytes            += shot.bytes;
+        run->dropped          += report.dropped;
+        run->stream_intervals += report.frames ? report.frames - 1 : 0;
+        run->stream_us        += report.duration_us;
+    }
+
+    return OK;
+}
+
+//Library initialisation, component loading and configuration, every time
+static WARN_UNUSED
+enum error_code scenario_cold_open(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i >= run->options->warmup) measure_start(run);
+
+        result = open_session(run, config, &session); if(result!=OK) { return result; }
+        result = close_session(run, session);         if(result!=OK) { return result; }
+
+        measure_stop(run);
+    }
+
+    return OK;
+}
+
+//Single frame shots on a session kept open
+static WARN_UNUSED
+enum error_code scenario_shoot(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    result = open_session(run, config, &session); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i == run->options->warmup) measure_start(run);
+
+        result = shoot(run, session, 1); if(result!=OK) { return result; }
+    }
+
+    measure_stop(run);
+
+    return close_session(run, session);
+}
+
+//What main.c does for a single picture
+static WARN_UNUSED
+enum error_code scenario_cycle(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i >= run->options->warmup) measure_start(run);
+
+        uint64_t start = latency_now();
+
+        result = open_session(run, config, &session); if(result!=OK) { return result; }
+        result = shoot(run, session, 1);              if(result!=OK) { return result; }
+        result = close_session(run, session);         if(result!=OK) { return result; }
+
+        record(run, "total", start);
+
+        measure_stop(run);
+    }
+
+    return OK;
+}
+
+//Several frames per shot on a session kept open
+static WARN_UNUSED
+enum error_code scenario_burst(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    result = open_session(run, config, &session); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i == run->options->warmup) measure_start(run);
+
+        result = shoot(run, session, run->options->frames); if(result!=OK) { return result; }
+    }
+
+    measure_stop(run);
+
+    return close_session(run, session);
+}
+
+//Same frames as the burst scenario in continuous bursts
+static WARN_UNUSED
+enum error_code scenario_stream(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    result = open_session(run, config, &session); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i == run->options->warmup) measure_start(run);
+
+        result = stream(run, session, run->options->frames); if(result!=OK) { return result; }
+    }
+
+    measure_stop(run);
+
+    return close_session(run, session);
+}
+
+//The settings change before every shot, the session is kept open
+static WARN_UNUSED
+enum error_code scenario_reconfigure(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    result = open_session(run, config, &session); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        if(i == run->options->warmup) measure_start(run);
+
+        struct camera_shot_configuration changed = config;
+
+        if(i % 2 == 0)
+        {
+            changed.iso = config.iso * 2;
+
+            if(run->options->quality_change)
+                changed.quality = config.quality + 10;
+        }
+
+        uint64_t start = latency_now();
+
+        result = omx_still_reconfigure(session, changed); if(result!=OK) { return result; }
+
+        record(run, "reconfigure", start);
+
+        result = shoot(run, session, 1); if(result!=OK) { return result; }
+    }
+
+    measure_stop(run);
+
+    return close_session(run, session);
+}
+
+//Records when a queued shot is done, from the thread of the session
+static void complete(void* context, still_request* request, enum error_code result)
+{
+    struct bench_shot* shot = context;
+
+    record(shot->run, "complete", shot->start);
+}
+
+//Single frame shots, all queued at once with the settings of each one, they
+//run back to back
+static WARN_UNUSED
+enum error_code scenario_queue(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    result = open_session(run, config, &session); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup; i++)
+    {
+        result = shoot(run, session, 1); if(result!=OK) { return result; }
+    }
+
+    unsigned count = run->options->iterations;
+
+    struct bench_shot* shots = calloc(count, sizeof(*shots));
+    still_request** requests = calloc(count, sizeof(*requests));
+    if(!shots || !requests)
+    {
+        LOG_ERRNO("calloc bench shots");
+        return ERROR;
+    }
+
+    measure_start(run);
+
+    for(i=0; i<count; i++)
+    {
+        struct camera_shot_configuration changed = config;
+
+        changed.iso = i % 2 ? config.iso : config.iso * 2;
+
+        shots[i].run   = run;
+        shots[i].start = latency_now();
+
+        result = omx_still_shoot_async(session, &changed, 1, receive, complete, &shots[i], &requests[i]); if(result!=OK) { return result; }
+    }
+
+    for(i=0; i<count; i++)
+    {
+        result = omx_still_wait(session, requests[i]); if(result!=OK) { return result; }
+
+        if(shots[i].frames != 1)
+            LOG_ERROR("bench: 1 frame requested, %" PRIu32 " received", shots[i].frames);
+
+        run->shots += shots[i].frames;
+        run->bytes += shots[i].bytes;
+    }
+
+    measure_stop(run);
+
+    free(requests);
+    free(shots);
+
+    return close_session(run, session);
+}
+
+//Same as queue on a polled session, driven from this thread the way an
+//epoll loop would
+static WARN_UNUSED
+enum error_code scenario_polled(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+
+    uint64_t start = latency_now();
+
+    result = omx_still_open_polled(config, &session); if(result!=OK) { return result; }
+
+    record(run, "open", start);
+
+    unsigned i;
+    for(i=0; i<run->options->warmup; i++)
+    {
+        result = shoot(run, session, 1); if(result!=OK) { return result; }
+    }
+
+    unsigned count = run->options->iterations;
+
+    struct bench_shot* shots = calloc(count, sizeof(*shots));
+    if(!shots)
+    {
+        LOG_ERRNO("calloc bench shots");
+        return ERROR;
+    }
+
+    measure_start(run);
+
+    for(i=0; i<count; i++)
+    {
+        shots[i].run   = run;
+        shots[i].start = latency_now();
+
+        result = omx_still_shoot_async(session, NULL, 1, receive, complete, &shots[i], NULL); if(result!=OK) { return result; }
+    }
+
+    struct pollfd fd = { .fd = omx_still_completion_fd(session), .events = POLLIN };
+    struct pollfd events = { .fd = omx_still_event_fd(session), .events = POLLIN };
+    uint64_t completed = 0;
+    uint64_t wakeups = 0;
+    uint64_t done;
+
+    //The warmup shots are counted too
+    if(read(fd.fd, &done, sizeof(done)) < 0 && errno != EAGAIN)
+        LOG_ERRNO("read completion fd");
+
+    while(completed < count)
+    {
+        if(poll(&events, 1, 100) < 0)
+        {
+            LOG_ERRNO("poll");
+            return ERROR;
+        }
+
+        wakeups++;
+
+        result = omx_still_process_events(session); if(result!=OK) { return result; }
+
+        if(poll(&fd, 1, 0) == 1 && read(fd.fd, &done, sizeof(done)) == sizeof(done))
+            completed += done;
+    }
+
+    measure_stop(run);
+
+    for(i=0; i<count; i++)
+    {
+        run->shots += shots[i].frames;
+        run->bytes += shots[i].bytes;
+    }
+
+    LOG_MESSAGE("bench: %" PRIu64 " wakeups for %d shots", wakeups, count);
+
+    free(shots);
+
+    return close_session(run, session);
+}
+
+//What the output of the pretrigger scenario received since the trigger
+struct bench_trigger
+{
+    struct bench_run* run;
+    frame_pool_t*     pool;
+    pthread_mutex_t   lock;
+    pthread_cond_t    done;
+    uint64_t          start;
+    unsigned          pre;
+    unsigned          post;
+};
+
+static void trigger_output(void* context, frame_t* frame, bool pre)
+{
+    struct bench_trigger* trigger = context;
+
+    pthread_mutex_lock(&trigger->lock);
+
+    if(trigger->pre + trigger->post == 0)
+        record(trigger->run, "first_frame", trigger->start);
+
+    if(pre)
+    {
+        if(++trigger->pre == BENCH_PRE_FRAMES)
+            record(trigger->run, "pre_frames", trigger->start);
+    }
+    else if(++trigger->post == trigger->run->options->frames)
+    {
+        record(trigger->run, "post_frames", trigger->start);
+    }
+
+    if(trigger->run->measuring)
+    {
+        trigger->run->shots++;
+        trigger->run->bytes += frame->length;
+    }
+
+    pthread_cond_broadcast(&trigger->done);
+    pthread_mutex_unlock(&trigger->lock);
+
+    frame_release(trigger->pool, frame);
+}
+
+//Frames complete so far
+static uint64_t pretrigger_frames(pretrigger_t* pretrigger)
+{
+    pthread_mutex_lock(&pretrigger->lock);
+    uint64_t frames = pretrigger->frames;
+    pthread_mutex_unlock(&pretrigger->lock);
+
+    return frames;
+}
+
+//Continuous capture into the ring, one trigger per iteration once the ring
+//is full
+static WARN_UNUSED
+enum error_code scenario_pretrigger(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_session* session;
+    frame_pool_t pool;
+    pretrigger_t pretrigger;
+
+    struct bench_trigger trigger = { .run = run, .pool = &pool };
+
+    pthread_mutex_init(&trigger.lock, NULL);
+    pthread_cond_init(&trigger.done, NULL);
+
+    result = frame_pool_init(&pool, BENCH_CHUNK_SIZE, BENCH_MEMORY_MAX); if(result!=OK) { return result; }
+    result = open_session(run, config, &session);                        if(result!=OK) { return result; }
+
+    result = pretrigger_start(&pretrigger, session, &pool, 1, BENCH_PRE_FRAMES, run->options->frames, trigger_output, &trigger); if(result!=OK) { return result; }
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        //The ring is full again
+        uint64_t frames = pretrigger_frames(&pretrigger);
+
+        while(pretrigger_frames(&pretrigger) < frames + BENCH_PRE_FRAMES)
+            usleep(1000);
+
+        if(i >= run->options->warmup) measure_start(run);
+
+        pthread_mutex_lock(&trigger.lock);
+
+        trigger.start = latency_now();
+        trigger.pre   = 0;
+        trigger.post  = 0;
+
+        pthread_mutex_unlock(&trigger.lock);
+
+        pretrigger_trigger(&pretrigger);
+
+        pthread_mutex_lock(&trigger.lock);
+
+        while(trigger.post < run->options->frames)
+            pthread_cond_wait(&trigger.done, &trigger.lock);
+
+        pthread_mutex_unlock(&trigger.lock);
+
+        measure_stop(run);
+    }
+
+    result = pretrigger_stop(&pretrigger); if(result!=OK) { return result; }
+
+    result = close_session(run, session); if(result!=OK) { return result; }
+
+    frame_pool_deinit(&pool);
+
+    pthread_cond_destroy(&trigger.done);
+    pthread_mutex_destroy(&trigger.lock);
+
+    return OK;
+}
+
+static uint32_t bench_random(uint32_t* seed)
+{
+    //xorshift32
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+
+    return *seed;
+}
+
+//Random data with few or many FF and 00 bytes, at any alignment and length.
+//Every scanner must find the same positions as the scalar one
+static WARN_UNUSED
+enum error_code scan_fuzz(const jpeg_scanner* scanners, unsigned count, unsigned trials)
+{
+    uint8_t data[SCAN_FUZZ_SIZE + 32];
+    uint32_t seed = 1;
+
+    unsigned trial;
+    for(trial=0; trial<trials; trial++)
+    {
+        size_t offset = bench_random(&seed) % 32;
+        size_t length = bench_random(&seed) % SCAN_FUZZ_SIZE;
+        unsigned density = bench_random(&seed) % 4;
+
+        size_t i;
+        for(i=0; i<length; i++)
+        {
+            uint32_t r = bench_random(&seed);
+            uint8_t byte = r >> 8;
+
+            switch(density)
+            {
+                case 0: if(byte == 0xFF) byte = 0xFE;                     break;
+                case 1:                                                    break;
+                case 2: if(r % 8 == 0) byte = 0xFF; if(r % 8 == 1) byte = 0; break;
+                case 3: if(r % 4 <  2) byte = 0xFF; if(r % 4 == 2) byte = 0; break;
+            }
+
+            data[offset + i] = byte;
+        }
+
+        const uint8_t* start = &data[offset];
+        const uint8_t* end   = start + length;
+
+        unsigned s;
+        for(s=1; s<count; s++)
+        {
+            const uint8_t* p = start;
+
+            for(;;)
+            {
+                const uint8_t* expected = jpeg_scan_marker_scalar(p, end);
+                const uint8_t* found    = scanners[s].scan(p, end);
+
+                if(found != expected)
+                {
+                    LOG_ERROR("bench: trial %d, %s found %td, scalar %td, from %td of %zu",
+                            trial, scanners[s].name, found - start, expected - start, p - start, length);
+                    return ERROR;
+                }
+
+                if(expected == end)
+                    break;
+
+                p = expected + 1;
+            }
+        }
+    }
+
+    return OK;
+}
+
+//Entropy coded data as the encoder writes it: FF stuffed with 00 and a
+//restart marker every 4096 bytes
+static void scan_frame(uint8_t* data, size_t size)
+{
+    uint32_t seed = 1;
+    uint8_t restart = 0;
+    size_t i = 0;
+
+    while(i < size)
+    {
+        uint8_t byte = bench_random(&seed) >> 24;
+
+        data[i++] = byte;
+
+        if(byte == 0xFF && i < size)
+            data[i++] = 0x00;
+
+        if(i % 4096 == 0 && i+2 <= size)
+        {
+            data[i++] = 0xFF;
+            data[i++] = 0xD0 + restart;
+            restart = (restart + 1) & 7;
+        }
+    }
+}
+
+static unsigned scan_all(jpeg_scan_function scan, const uint8_t* data, size_t size)
+{
+    const uint8_t* p   = data;
+    const uint8_t* end = data + size;
+    unsigned markers = 0;
+
+    while((p = scan(p, end)) != end)
+    {
+        markers++;
+        p++;
+    }
+
+    return markers;
+}
+
+//The last scanner is the one in use, the only one measured for throughput
+static WARN_UNUSED
+enum error_code scenario_scan(struct bench_run* run, struct camera_shot_configuration config)
+{
+    enum error_code result;
+
+    const jpeg_scanner* scanners;
+    unsigned count = jpeg_scanners(&scanners);
+
+    run->implementation = scanners[count-1].name;
+
+    result = scan_fuzz(scanners, count, SCAN_FUZZ_TRIALS * run->options->iterations); if(result!=OK) { return result; }
+
+    uint8_t* frame = malloc(SCAN_FRAME_SIZE);
+    if(!frame)
+    {
+        LOG_ERRNO("malloc scan frame");
+        return ERROR;
+    }
+
+    scan_frame(frame, SCAN_FRAME_SIZE);
+
+    unsigned expected = scan_all(jpeg_scan_marker_scalar, frame, SCAN_FRAME_SIZE);
+
+    unsigned i;
+    for(i=0; i<run->options->warmup + run->options->iterations; i++)
+    {
+        unsigned s;
+        for(s=0; s<count; s++)
+        {
+            int measured = i >= run->options->warmup && s == count-1;
+
+            if(measured) measure_start(run);
+
+            uint64_t start = latency_now();
+            unsigned markers = scan_all(scanners[s].scan, frame, SCAN_FRAME_SIZE);
+            uint64_t end = latency_now();
+
+            if(measured)
+            {
+                run->bytes += SCAN_FRAME_SIZE;
+                measure_stop(run);
+            }
+
+            if(markers != expected)
+            {
+                LOG_ERROR("bench: %s found %d markers, scalar %d", scanners[s].name, markers, expected);
+                free(frame);
+                return ERROR;
+            }
+
+            if(i >= run->options->warmup)
+            {
+                struct latency_histogram* histogram = phase(run, scanners[s].name);
+
+                if(histogram)
+                    latency_histogram_record(histogram, end - start);
+            }
+        }
+    }
+
+    free(frame);
+
+    return OK;
+}
+
+static const struct
+{
+    const char* name;
+    enum error_code (*run)(struct bench_run* run, struct camera_shot_configuration config);
+} scenarios[] =
+{
+    { "cold-open",   scenario_cold_open   },
+    { "shoot",       scenario_shoot       },
+    { "cycle",       scenario_cycle       },
+    { "burst",       scenario_burst       },
+    { "stream",      scenario_stream      },
+    { "reconfigure", scenario_reconfigure },
+    { "queue",       scenario_queue       },
+    { "polled",      scenario_polled      },
+    { "pretrigger",  scenario_pretrigger  },
+    { "scan",        scenario_scan        },
+};
+
+#define SCENARIOS_COUNT (sizeof(scenarios)/sizeof(scenarios[0]))
+
+static double per_second(uint64_t count, uint64_t microseconds)
+{
+    return microseconds ? count * 1000000.0 / microseconds : 0.0;
+}
+
+static void report_run(FILE* out, const char* name, const struct bench_run* run, int last)
+{
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", name);
+
+    if(run->implementation)
+        fprintf(out, "      \"implementation\": \"%s\",\n", run->implementation);
+
+    fprintf(out, "      \"wall_us\": %" PRIu64 ",\n", run->wall);
+    fprintf(out, "      \"cpu_user_us\": %" PRIu64 ",\n", run->user);
+    fprintf(out, "      \"cpu_system_us\": %" PRIu64 ",\n", run->system);
+    fprintf(out, "      \"shots\": %" PRIu64 ",\n", run->shots);
+    fprintf(out, "      \"bytes\": %" PRIu64 ",\n", run->bytes);
+    fprintf(out, "      \"shots_per_s\": %.3f,\n", per_second(run->shots, run->wall));
+    fprintf(out, "      \"bytes_per_s\": %.0f,\n", per_second(run->bytes, run->wall));
+
+    if(run->stream_us)
+    {
+        fprintf(out, "      \"frames_per_s\": %.3f,\n", per_second(run->stream_intervals, run->stream_us));
+        fprintf(out, "      \"frames_dropped\": %" PRIu64 ",\n", run->dropped);
+    }
+
+    fprintf(out, "      \"configs_sent\": %" PRIu64 ",\n", run->configs_sent);
+    fprintf(out, "      \"configs_skipped\": %" PRIu64 ",\n", run->configs_skipped);
+    fprintf(out, "      \"port_defs_read\": %" PRIu64 ",\n", run->port_defs_read);
+    fprintf(out, "      \"port_defs_cached\": %" PRIu64 ",\n", run->port_defs_cached);
+    fprintf(out, "      \"phases_us\": {");
+
+    unsigned i;
+    for(i=0; i<run->phases_count; i++)
+    {
+        const struct latency_histogram* h = &run->phases[i].histogram;
+
+        fprintf(out, "%s\n        \"%s\": { \"count\": %" PRIu64 ", \"min\": %" PRIu64 ", \"mean\": %" PRIu64
+                ", \"p50\": %" PRIu64 ", \"p95\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 " }",
+                i ? "," : "",
+                run->phases[i].name, h->count, h->min, h->count ? h->sum / h->count : 0,
+                latency_percentile(h, 50),
+                latency_percentile(h, 95),
+                latency_percentile(h, 99),
+                h->max);
+    }
+
+    fprintf(out, "\n      }\n");
+    fprintf(out, "    }%s\n", last ? "" : ",");
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "usage: %s [-s scenario] [-n iterations] [-w warmup] [-f frames] [-q] [-b] [-d] [-c cache] [-o file]\n", program);
+    fprintf(stderr, "scenarios: all");
+
+    unsigned i;
+    for(i=0; i<SCENARIOS_COUNT; i++)
+        fprintf(stderr, ", %s", scenarios[i].name);
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv)
+{
+    enum error_code result;
+
+    struct bench_options options =
+    {
+        .scenario       = "all",
+        .iterations     = BENCH_ITERATIONS,
+        .warmup         = BENCH_WARMUP,
+        .frames         = BENCH_FRAMES,
+        .quality_change = 0
+    };
+
+    const char* output = NULL;
+    const char* port_cache = NULL;
+    int binned = 0;
+
+    int option;
+    while((option = getopt(argc, argv, "s:n:w:f:qbdc:o:")) != -1)
+    {
+        switch(option)
+        {
+            case 's': options.scenario   = optarg;       break;
+            case 'n': options.iterations = atoi(optarg); break;
+            case 'w': options.warmup     = atoi(optarg); break;
+            case 'f': options.frames     = atoi(optarg); break;
+            case 'q': options.quality_change = 1;        break;
+            case 'b': binned = 1;                        break;
+            case 'd': omx_still_diagnostics(1);          break;
+            case 'c': port_cache = optarg;               break;
+            case 'o': output = optarg;                   break;
+            default:  usage(argv[0]); return ERROR;
+        }
+    }
+
+    if(options.iterations < 1 || options.frames < 1)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+
+    if(port_cache)
+    {
+        result = omx_still_port_cache(port_cache); if(result!=OK) { return result; }
+    }
+
+    //Same settings as main.c
+    struct camera_shot_configuration config = {
+        .shutterSpeed = 50000,
+        .iso          = 100,
+        .redGain      = 1000,
+        .blueGain     = 1000,
+        .quality      = 50,
+        .sharpness    = 0,
+        .contrast     = 0,
+        .brightness   = 50,
+        .saturation   = 0,
+        .drc          = OMX_DynRangeExpOff,
+        .whiteBalance = OMX_WhiteBalControlOff,
+        .rotation     = 90
+    };
+
+    if(binned)
+        config.sensorMode = CAMERA_SENSOR_MODE_BINNED;
+
+    struct bench_run* runs = calloc(SCENARIOS_COUNT, sizeof(*runs));
+    if(!runs)
+    {
+        LOG_ERRNO("calloc bench runs");
+        return ERROR;
+    }
+
+    int selected[SCENARIOS_COUNT];
+    unsigned selected_count = 0;
+
+    unsigned i;
+    for(i=0; i<SCENARIOS_COUNT; i++)
+    {
+        selected[i] = strcmp(options.scenario, "all") == 0 || strcmp(options.scenario, scenarios[i].name) == 0;
+        selected_count += selected[i];
+    }
+
+    if(!selected_count)
+    {
+        usage(argv[0]);
+        return ERROR;
+    }
+
+    for(i=0; i<SCENARIOS_COUNT; i++)
+    {
+        if(!selected[i])
+            continue;
+
+        LOG_MESSAGE("bench: scenario %s, %d iterations", scenarios[i].name, options.iterations);
+
+        runs[i].options = &options;
+
+        result = scenarios[i].run(&runs[i], config); if(result!=OK) { return result; }
+    }
+
+    FILE* out = stdout;
+
+    if(output)
+    {
+        out = fopen(output, "w");
+        if(!out)
+        {
+            LOG_ERRNO("fopen %s", output);
+            return ERROR;
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"iterations\": %u,\n", options.iterations);
+    fprintf(out, "  \"warmup\": %u,\n", options.warmup);
+    fprintf(out, "  \"burst_frames\": %" PRIu32 ",\n", options.frames);
+    fprintf(out, "  \"quality_change\": %s,\n", options.quality_change ? "true" : "false");
+    fprintf(out, "  \"scenarios\": [\n");
+
+    for(i=0; i<SCENARIOS_COUNT; i++)
+    {
+        if(!selected[i])
+            continue;
+
+        report_run(out, scenarios[i].name, &runs[i], --selected_count == 0);
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if(out != stdout && fclose(out))
+    {
+        LOG_ERRNO("fclose %s", output);
+        return ERROR;
+    }
+
+    free(runs);
+
+    return OK;
+}
@@ -1,5 +1,7 @@
 #include "dump.h"
 
+#include <inttypes.h>
+
 #include "logerr.h"
 
 #define DUMP_CASE(x) case x: return #x;
@@ -390,7 +392,7 @@ void dump_OMX_BUFFERHEADERTYPE(OMX_BUFFERHEADERTYPE* header)
       "nOffset: %d\n"
       "hMarkTargetComponent: %s\n"
       "nTickCount: %d\n"
-      "nTimeStamp: %lld\n"
+      "nTimeStamp: %" PRId64 "\n"
       "nFlags: %X\n"
       "nOutputPortIndex: %d\n"
       "nInputPortIndex: %d\n",
@@ -3,7 +3,10 @@
 
 enum error_code {
     OK,
-    ERROR
+    ERROR,
+    TIMEOUT,
+    //Nothing to do yet, only returned by the calls that never block
+    AGAIN
 };
 
 #define WARN_UNUSED __attribute__((warn_unused_result))
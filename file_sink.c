@@ -0,0 +1,271 @@
+//fallocate() and sync_file_range()
+#define _GNU_SOURCE
+
+#include "file_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logerr.h"
+
+enum error_code file_sync_directory(const char* pattern, file_sync_mode sync, int* directory)
+{
+    *directory = -1;
+
+    if(sync != FILE_SYNC_FDATASYNC)
+        return OK;
+
+    //dirname() may modify its argument
+    char name[PATH_MAX];
+
+    snprintf(name, sizeof(name), "%s", pattern);
+
+    *directory = open(dirname(name), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(*directory == -1)
+    {
+        LOG_ERRNO("open %s", name);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+enum error_code file_commit(int fd, const char* temporary, const char* path, off_t length, off_t allocated, file_sync_mode sync, int directory)
+{
+    enum error_code result = OK;
+
+    //What was preallocated and not used
+    if(length < allocated && ftruncate(fd, length))
+    {
+        LOG_ERRNO("ftruncate %s", temporary);
+        result = ERROR;
+    }
+
+    switch(result == OK ? sync : FILE_SYNC_NONE)
+    {
+        case FILE_SYNC_NONE:
+            break;
+
+        case FILE_SYNC_FDATASYNC:
+            if(fdatasync(fd))
+            {
+                LOG_ERRNO("fdatasync %s", temporary);
+                result = ERROR;
+            }
+            break;
+
+        case FILE_SYNC_RANGE:
+            if(sync_file_range(fd, 0, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+            {
+                LOG_ERRNO("sync_file_range %s", temporary);
+                result = ERROR;
+            }
+            break;
+    }
+
+    if(close(fd) && result == OK)
+    {
+        LOG_ERRNO("close %s", temporary);
+        result = ERROR;
+    }
+
+    if(result == OK && rename(temporary, path))
+    {
+        LOG_ERRNO("rename %s", path);
+        result = ERROR;
+    }
+
+    if(result!=OK)
+    {
+        unlink(temporary);
+        return result;
+    }
+
+    if(directory != -1 && fsync(directory))
+    {
+        LOG_ERRNO("fsync %s", path);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+enum error_code file_sink_init(file_sink_t* sink, const char* pattern, unsigned first, file_sync_mode sync)
+{
+    memset(sink, 0, sizeof(*sink));
+
+    sink->pattern   = pattern;
+    sink->number    = first - 1;
+    sink->sync      = sync;
+    sink->fd        = -1;
+    sink->result    = OK;
+
+    return file_sync_directory(pattern, sync, &sink->directory);
+}
+
+//Gives up the current frame, the rest of its slices are dropped
+static void discard(file_sink_t* sink)
+{
+    if(sink->fd != -1)
+        close(sink->fd);
+
+    unlink(sink->temporary);
+
+    sink->fd     = -1;
+    sink->failed = 1;
+    sink->result = ERROR;
+}
+
+static WARN_UNUSED
+enum error_code start(file_sink_t* sink, uint32_t frame)
+{
+    sink->frame   = frame;
+    sink->written = 0;
+    sink->synced  = 0;
+    sink->failed  = 0;
+
+    sink->number++;
+
+    if(snprintf(sink->path,      sizeof(sink->path),      sink->pattern, sink->number) >= (int)sizeof(sink->path) ||
+       snprintf(sink->temporary, sizeof(sink->temporary), "%s.tmp", sink->path)      >= (int)sizeof(sink->temporary))
+    {
+        LOG_ERROR("file name of frame %u too long", sink->number);
+        sink->temporary[0] = 0;
+        return ERROR;
+    }
+
+    sink->fd = open(sink->temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(sink->fd == -1)
+    {
+        LOG_ERRNO("open %s", sink->temporary);
+        return ERROR;
+    }
+
+    //Frames of a session have about the same size, reserving it up front
+    //keeps the file in one piece and the block allocation out of the writes.
+    //Not every file system can, the file grows as usual then
+    if(sink->expected && fallocate(sink->fd, 0, 0, sink->expected) && errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        LOG_ERRNO("fallocate %s %lld", sink->temporary, (long long)sink->expected);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code append(file_sink_t* sink, const uint8_t* buffer, size_t length)
+{
+    while(length)
+    {
+        ssize_t written = write(sink->fd, buffer, length);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            LOG_ERRNO("write %s %zu", sink->temporary, length);
+            return ERROR;
+        }
+
+        //A short write is not an error, the rest goes in the next call
+        buffer        += written;
+        length        -= written;
+        sink->written += written;
+    }
+
+    if(sink->sync == FILE_SYNC_RANGE)
+    {
+        //Starts the write back of the slice and returns, the disk works while
+        //the next slices are encoded
+        if(sync_file_range(sink->fd, sink->synced, sink->written - sink->synced, SYNC_FILE_RANGE_WRITE))
+        {
+            LOG_ERRNO("sync_file_range %s", sink->temporary);
+            return ERROR;
+        }
+
+        sink->synced = sink->written;
+    }
+
+    return OK;
+}
+
+//The frame is complete, it gets its name
+static WARN_UNUSED
+enum error_code complete(file_sink_t* sink)
+{
+    enum error_code result;
+
+    int fd = sink->fd;
+
+    //Closed either way
+    sink->fd = -1;
+
+    result = file_commit(fd, sink->temporary, sink->path, sink->written, sink->expected, sink->sync, sink->directory); if(result!=OK) { return result; }
+
+    LOG_MESSAGE("Frame %d, %lld bytes, to %s", sink->frame+1, (long long)sink->written, sink->path);
+
+    sink->expected = sink->written;
+
+    return OK;
+}
+
+//Completes the current frame, if any
+static void finish_frame(file_sink_t* sink)
+{
+    if(sink->fd != -1 && complete(sink)!=OK)
+        discard(sink);
+}
+
+void file_sink_receive(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length)
+{
+    file_sink_t* sink = context;
+
+    if(sink->fd != -1 && sink->frame != frame)
+        finish_frame(sink);
+
+    if(sink->failed && sink->frame == frame)
+        return;
+
+    if(sink->fd == -1 && start(sink, frame)!=OK)
+    {
+        discard(sink);
+        return;
+    }
+
+    if(append(sink, buffer, length)!=OK)
+        discard(sink);
+}
+
+enum error_code file_sink_finish(file_sink_t* sink)
+{
+    finish_frame(sink);
+
+    enum error_code result = sink->result;
+
+    sink->result = OK;
+    sink->failed = 0;
+
+    return result;
+}
+
+void file_sink_deinit(file_sink_t* sink)
+{
+    if(sink->fd != -1)
+    {
+        close(sink->fd);
+        unlink(sink->temporary);
+        sink->fd = -1;
+    }
+
+    if(sink->directory != -1)
+    {
+        close(sink->directory);
+        sink->directory = -1;
+    }
+}
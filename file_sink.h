@@ -0,0 +1,82 @@
+#ifndef  FILE_SINK_INC
+#define  FILE_SINK_INC
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "error.h"
+
+/*
+   Writes every frame of a shot to its own file while it is being encoded.
+   It is a buffer_output_handler: each slice is written as it arrives, so the
+   disk works while the encoder fills the next buffers and nothing is kept in
+   memory.
+
+   A frame goes to a temporary file next to its final name, preallocated with
+   the size of the previous frame, and is renamed once complete. A reader
+   never sees half a frame under the final name, and a crash leaves at most a
+   .tmp file behind.
+   */
+
+typedef enum
+{
+    //The data reaches the disk whenever the kernel writes it back
+    FILE_SYNC_NONE,
+    //Every file and its name are on the disk when the frame is complete
+    FILE_SYNC_FDATASYNC,
+    //Each slice is sent to the disk as it is written and the frame waits
+    //for all of them. Only the data, the size and the name are not synced
+    //and the disk may still cache it, faster than fdatasync on SD cards
+    FILE_SYNC_RANGE
+} file_sync_mode;
+
+typedef struct
+{
+    //printf format of the file names, it is given the frame number. The
+    //directory must exist
+    const char*     pattern;
+    //Number of the last file, the next one gets the following
+    unsigned        number;
+    file_sync_mode  sync;
+    //Directory of the files, to sync the renames. -1 if not needed
+    int             directory;
+    //File of the frame being received, -1 between frames
+    int             fd;
+    uint32_t        frame;
+    char            path[PATH_MAX];
+    char            temporary[PATH_MAX];
+    //The current frame could not be written, its other slices are dropped
+    int             failed;
+    //Bytes written and sent to the disk of the current frame
+    off_t           written;
+    off_t           synced;
+    //Size of the previous frame, preallocated for the next one
+    off_t           expected;
+    //Something was lost since the last file_sink_finish()
+    enum error_code result;
+} file_sink_t;
+
+//Opens the directory of the files named by the pattern if the mode syncs
+//the renames, -1 otherwise
+WARN_UNUSED enum error_code file_sync_directory(const char* pattern, file_sync_mode sync, int* directory);
+//A frame is written to the temporary file: trims what was allocated past its
+//length, syncs it as the mode says and renames it to path. The file is
+//closed, and removed on failure
+WARN_UNUSED enum error_code file_commit(int fd, const char* temporary, const char* path, off_t length, off_t allocated, file_sync_mode sync, int directory);
+
+//The files are numbered from first
+WARN_UNUSED enum error_code file_sink_init(file_sink_t* sink, const char* pattern, unsigned first, file_sync_mode sync);
+
+//buffer_output_handler, the context is the sink
+void file_sink_receive(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length);
+
+//Completes the frame being received, at the end of a shot. Fails if any
+//frame of the shot could not be written, its file is removed
+WARN_UNUSED enum error_code file_sink_finish(file_sink_t* sink);
+
+//Removes the frame being received, if any
+void file_sink_deinit(file_sink_t* sink);
+
+#endif
@@ -0,0 +1,338 @@
+#include "frame_sink.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logerr.h"
+
+enum error_code frame_pool_init(frame_pool_t* pool, size_t chunk_size, size_t memory_max)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if(chunk_size == 0 || memory_max < chunk_size * FRAME_SLAB_CHUNKS)
+    {
+        LOG_ERROR("frame pool: %zu bytes can't hold a slab of %d chunks of %zu bytes", memory_max, FRAME_SLAB_CHUNKS, chunk_size);
+        return ERROR;
+    }
+
+    int result_pthread = pthread_mutex_init(&pool->lock, NULL);
+    if(result_pthread)
+    {
+        LOG_ERROR("frame pool: pthread_mutex_init (%d)", result_pthread);
+        return ERROR;
+    }
+
+    pool->chunk_size = chunk_size;
+    pool->memory_max = memory_max;
+
+    return OK;
+}
+
+void frame_pool_deinit(frame_pool_t* pool)
+{
+    while(pool->slabs)
+    {
+        struct frame_slab* slab = pool->slabs;
+
+        pool->slabs = slab->next;
+
+        free(slab->data);
+        free(slab);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+//Adds a slab of free chunks and frames if the cap allows it. Must be called
+//with the lock held
+static void pool_grow(frame_pool_t* pool)
+{
+    size_t size = pool->chunk_size * FRAME_SLAB_CHUNKS;
+
+    if(pool->memory + size > pool->memory_max)
+        return;
+
+    struct frame_slab* slab = malloc(sizeof(*slab));
+    if(!slab)
+    {
+        LOG_ERRNO("frame pool: malloc slab");
+        return;
+    }
+
+    slab->data = malloc(size);
+    if(!slab->data)
+    {
+        LOG_ERRNO("frame pool: malloc %zu", size);
+        free(slab);
+        return;
+    }
+
+    unsigned i;
+    for(i=0; i<FRAME_SLAB_CHUNKS; i++)
+    {
+        slab->chunks[i].data = &slab->data[i * pool->chunk_size];
+        slab->chunks[i].next = pool->free_chunks;
+        pool->free_chunks = &slab->chunks[i];
+
+        slab->frames[i].next = pool->free_frames;
+        pool->free_frames = &slab->frames[i];
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->memory += size;
+}
+
+enum error_code frame_pool_fill(frame_pool_t* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    size_t memory;
+
+    do
+    {
+        memory = pool->memory;
+        pool_grow(pool);
+    } while(pool->memory != memory);
+
+    memory = pool->memory;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    //Another slab would pass the cap
+    if(memory + pool->chunk_size * FRAME_SLAB_CHUNKS <= pool->memory_max)
+    {
+        LOG_ERROR("frame pool: filled %zu bytes of %zu", memory, pool->memory_max);
+        return ERROR;
+    }
+
+    return OK;
+}
+
+static struct frame_chunk* chunk_get(frame_pool_t* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if(!pool->free_chunks)
+        pool_grow(pool);
+
+    struct frame_chunk* chunk = pool->free_chunks;
+
+    if(chunk)
+    {
+        pool->free_chunks = chunk->next;
+
+        chunk->next = NULL;
+        chunk->used = 0;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return chunk;
+}
+
+static frame_t* frame_get(frame_pool_t* pool, uint32_t number)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if(!pool->free_frames)
+        pool_grow(pool);
+
+    frame_t* frame = pool->free_frames;
+
+    if(frame)
+        pool->free_frames = frame->next;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if(!frame)
+    {
+        LOG_ERROR("frame pool: no free frame");
+        return NULL;
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->number = number;
+
+    return frame;
+}
+
+void frame_release(frame_pool_t* pool, frame_t* frame)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    if(frame->first)
+    {
+        frame->last->next = pool->free_chunks;
+        pool->free_chunks = frame->first;
+    }
+
+    frame->next = pool->free_frames;
+    pool->free_frames = frame;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+unsigned frame_iovec(const frame_t* frame, unsigned first, struct iovec* iov, unsigned max)
+{
+    const struct frame_chunk* chunk = frame->first;
+
+    for(; chunk && first; first--)
+        chunk = chunk->next;
+
+    unsigned count;
+    for(count=0; chunk && count<max; count++, chunk=chunk->next)
+    {
+        iov[count].iov_base = chunk->data;
+        iov[count].iov_len  = chunk->used;
+    }
+
+    return count;
+}
+
+void frame_sink_init(frame_sink_t* sink, frame_pool_t* pool)
+{
+    memset(sink, 0, sizeof(*sink));
+
+    sink->pool   = pool;
+    sink->result = OK;
+}
+
+void frame_sink_info(frame_sink_t* sink, const void* info, size_t size)
+{
+    if(size > FRAME_INFO_SIZE)
+        size = FRAME_INFO_SIZE;
+
+    memset(sink->info, 0, sizeof(sink->info));
+    memcpy(sink->info, info, size);
+}
+
+void frame_sink_reclaim(frame_sink_t* sink, frame_reclaim_handler reclaim, void* context)
+{
+    sink->reclaim         = reclaim;
+    sink->reclaim_context = context;
+}
+
+//Moves the frame being received to the received ones
+static void complete(frame_sink_t* sink)
+{
+    frame_t* frame = sink->current;
+
+    if(!frame)
+        return;
+
+    if(sink->last)
+        sink->last->next = frame;
+    else
+        sink->first = frame;
+
+    sink->last = frame;
+    sink->current = NULL;
+}
+
+void frame_sink_receive(void* context, const uint32_t number, const uint8_t * buffer, size_t length)
+{
+    frame_sink_t* sink = context;
+    frame_pool_t* pool = sink->pool;
+
+    if(sink->current && sink->current->number != number)
+        complete(sink);
+
+    if(!sink->current)
+    {
+        sink->current = frame_get(pool, number);
+        if(!sink->current)
+        {
+            sink->result = ERROR;
+            return;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        sink->current->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        memcpy(sink->current->info, sink->info, sizeof(sink->info));
+    }
+
+    frame_t* frame = sink->current;
+
+    while(length && !frame->truncated)
+    {
+        struct frame_chunk* chunk = frame->last;
+
+        if(!chunk || chunk->used == pool->chunk_size)
+        {
+            chunk = chunk_get(pool);
+
+            while(!chunk && sink->reclaim && sink->reclaim(sink->reclaim_context))
+                chunk = chunk_get(pool);
+
+            if(!chunk)
+            {
+                LOG_ERROR("frame %d truncated at %zu bytes, the pool is full (%zu bytes)", number, frame->length, pool->memory_max);
+
+                frame->truncated = 1;
+                sink->result = ERROR;
+                return;
+            }
+
+            if(frame->last)
+                frame->last->next = chunk;
+            else
+                frame->first = chunk;
+
+            frame->last = chunk;
+            frame->chunks_count++;
+        }
+
+        size_t size = pool->chunk_size - chunk->used;
+
+        if(size > length)
+            size = length;
+
+        memcpy(&chunk->data[chunk->used], buffer, size);
+
+        chunk->used   += size;
+        frame->length += size;
+        buffer        += size;
+        length        -= size;
+    }
+}
+
+enum error_code frame_sink_finish(frame_sink_t* sink)
+{
+    complete(sink);
+
+    enum error_code result = sink->result;
+
+    sink->result = OK;
+
+    return result;
+}
+
+frame_t* frame_sink_take(frame_sink_t* sink)
+{
+    frame_t* frame = sink->first;
+
+    if(frame)
+    {
+        sink->first = frame->next;
+
+        if(!sink->first)
+            sink->last = NULL;
+
+        frame->next = NULL;
+    }
+
+    return frame;
+}
+
+void frame_sink_deinit(frame_sink_t* sink)
+{
+    complete(sink);
+
+    frame_t* frame;
+    while((frame = frame_sink_take(sink)))
+        frame_release(sink->pool, frame);
+}
@@ -0,0 +1,126 @@
+#ifndef  FRAME_SINK_INC
+#define  FRAME_SINK_INC
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "error.h"
+
+/*
+   Memory for the received frames. The pool hands out fixed size chunks and
+   the frames holding them, it grows one slab of both at a time up to a
+   memory cap and keeps the released ones for the next frames, so a process
+   of any number of shots or burst frames stays in bounded memory.
+
+   A frame is a list of chunks filled in order, it is read as a scatter list
+   (struct iovec, ready for writev()). The sink receives the slices of a shot
+   (it is a buffer_output_handler) and turns them into frames.
+   */
+
+//Chunks allocated together
+#define FRAME_SLAB_CHUNKS 16
+//Capture settings carried by every frame, opaque to the sink
+#define FRAME_INFO_SIZE   32
+
+struct frame_chunk
+{
+    struct frame_chunk* next;
+    uint8_t*            data;
+    size_t              used;
+};
+
+typedef struct frame
+{
+    //Frame number in the shot, from 0
+    uint32_t            number;
+    //CLOCK_REALTIME of the first slice, in nanoseconds
+    uint64_t            timestamp;
+    //Copy of the info of the sink when the frame started
+    uint8_t             info[FRAME_INFO_SIZE];
+    size_t              length;
+    unsigned            chunks_count;
+    struct frame_chunk* first;
+    struct frame_chunk* last;
+    //The pool was exhausted, the frame misses its end
+    int                 truncated;
+    struct frame*       next;
+} frame_t;
+
+//A frame is received in chunks, one frame per chunk is enough
+struct frame_slab
+{
+    struct frame_slab* next;
+    uint8_t*           data;
+    struct frame_chunk chunks[FRAME_SLAB_CHUNKS];
+    frame_t            frames[FRAME_SLAB_CHUNKS];
+};
+
+//Chunks and frames can be released from any thread
+typedef struct
+{
+    pthread_mutex_t     lock;
+    size_t              chunk_size;
+    size_t              memory_max;
+    size_t              memory;
+    struct frame_slab*  slabs;
+    struct frame_chunk* free_chunks;
+    frame_t*            free_frames;
+} frame_pool_t;
+
+//Called when the pool is exhausted in the middle of a frame, with the
+//context given to frame_sink_reclaim(). Returns whether it gave chunks back
+//to the pool, the sink tries again then
+typedef int (*frame_reclaim_handler)(void* context);
+
+typedef struct
+{
+    frame_pool_t* pool;
+    frame_reclaim_handler reclaim;
+    void*         reclaim_context;
+    //Frame being received
+    frame_t*      current;
+    //Received frames not taken yet, oldest first
+    frame_t*      first;
+    frame_t*      last;
+    //Given to every new frame, see frame_sink_info()
+    uint8_t       info[FRAME_INFO_SIZE];
+    //Something was lost since the last frame_sink_finish()
+    enum error_code result;
+} frame_sink_t;
+
+WARN_UNUSED enum error_code frame_pool_init  (frame_pool_t* pool, size_t chunk_size, size_t memory_max);
+void                        frame_pool_deinit(frame_pool_t* pool);
+//Allocates the pool up to its cap, so the frames never allocate memory
+WARN_UNUSED enum error_code frame_pool_fill  (frame_pool_t* pool);
+
+//Gives the chunks of the frame back to the pool
+void frame_release(frame_pool_t* pool, frame_t* frame);
+
+//Fills iov with the chunks of the frame from the given one (0 is the first),
+//returns how many were filled
+unsigned frame_iovec(const frame_t* frame, unsigned first, struct iovec* iov, unsigned max);
+
+void frame_sink_init(frame_sink_t* sink, frame_pool_t* pool);
+//Sets what the next frames carry in their info, usually the configuration of
+//the shot. Up to FRAME_INFO_SIZE bytes, the rest is zeroed
+void frame_sink_info(frame_sink_t* sink, const void* info, size_t size);
+//Frees memory for the frame being received when the pool is exhausted,
+//instead of truncating it. NULL truncates
+void frame_sink_reclaim(frame_sink_t* sink, frame_reclaim_handler reclaim, void* context);
+
+//buffer_output_handler, the context is the sink
+void frame_sink_receive(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length);
+
+//Completes the frame being received, at the end of a shot. Fails if any
+//frame of the shot was truncated
+WARN_UNUSED enum error_code frame_sink_finish(frame_sink_t* sink);
+
+//Oldest received frame, the caller releases it. NULL if there are none
+frame_t* frame_sink_take(frame_sink_t* sink);
+
+//Releases the frames not taken
+void frame_sink_deinit(frame_sink_t* sink);
+
+#endif
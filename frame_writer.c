@@ -0,0 +1,800 @@
+//fallocate()
+#define _GNU_SOURCE
+
+#include "frame_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define FRAME_WRITER_URING
+#endif
+#endif
+
+#include "logerr.h"
+
+//A frame being written
+typedef struct
+{
+    frame_t*        frame;
+    int             fd;
+    char            path[PATH_MAX];
+    char            temporary[PATH_MAX];
+    //Where the record then the frame go in the archive, if any
+    off_t           offset;
+    struct archive_record record;
+    enum error_code result;
+    //A write of the frame may still be running, its memory is never released
+    bool            in_flight;
+} write_job_t;
+
+//A vectored write of consecutive chunks of a frame
+typedef struct frame_writer_op
+{
+    write_job_t* job;
+    struct iovec iov[FRAME_WRITER_IOVECS];
+    unsigned     count;
+    off_t        offset;
+    size_t       length;
+    //Bytes written, or -errno
+    ssize_t      written;
+} write_op_t;
+
+/*****************************************************************************/
+
+#ifdef FRAME_WRITER_URING
+
+//The rings shared with the kernel, no liburing needed
+struct frame_writer_ring
+{
+    int                  fd;
+    unsigned*            sq_head;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_cqe* cqes;
+    void*                sq_ring;
+    size_t               sq_ring_size;
+    void*                cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+};
+
+static void ring_close(struct frame_writer_ring* ring)
+{
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if(ring->cq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+    if(ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    close(ring->fd);
+    free(ring);
+}
+
+static struct frame_writer_ring* ring_open(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, FRAME_WRITER_OPS, &params);
+    if(fd < 0)
+    {
+        //Not in this kernel, or not allowed
+        LOG_MESSAGE("frame writer: io_uring not available (%s), using pwritev", strerror(errno));
+        return NULL;
+    }
+
+    struct frame_writer_ring* ring = calloc(1, sizeof(*ring));
+    if(!ring)
+    {
+        LOG_ERRNO("calloc frame_writer_ring");
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd           = fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes    = mmap(NULL, ring->sqes_size,    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        LOG_ERRNO("frame writer: mmap io_uring");
+
+        if(ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+        if(ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+        if(ring->sqes    == MAP_FAILED) ring->sqes    = NULL;
+
+        ring_close(ring);
+        return NULL;
+    }
+
+    ring->sq_head  = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail  = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head  = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail  = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask  = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+
+    return ring;
+}
+
+//Submits all the writes in one call and waits for all of them. On failure
+//the writes the kernel took are still waited for, the ones it did not take
+//are left as they are. If even that fails their jobs are in flight
+static WARN_UNUSED
+enum error_code ring_write(struct frame_writer_ring* ring, write_op_t* ops, unsigned count)
+{
+    //This thread is the only producer
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+
+        sqe->opcode    = IORING_OP_WRITEV;
+        sqe->fd        = ops[i].job->fd;
+        sqe->addr      = (uintptr_t)ops[i].iov;
+        sqe->len       = ops[i].count;
+        sqe->off       = ops[i].offset;
+        sqe->user_data = i;
+
+        ring->sq_array[index] = index;
+        tail++;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    bool     failed    = false;
+
+    while(completed < (failed ? submitted : count))
+    {
+        int entered = failed ?
+            syscall(__NR_io_uring_enter, ring->fd, 0, submitted - completed, IORING_ENTER_GETEVENTS, NULL, 0) :
+            syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if(entered < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            LOG_ERRNO("io_uring_enter");
+
+            if(failed)
+            {
+                //The writes not complete may still be running, the memory
+                //of their frames can't be released
+                unsigned i;
+                for(i=0; i<submitted; i++)
+                {
+                    if(ops[i].written == -EINPROGRESS)
+                        ops[i].job->in_flight = true;
+                }
+
+                return ERROR;
+            }
+
+            //What the kernel took before the failure, in order
+            submitted = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - head;
+            failed    = true;
+            continue;
+        }
+
+        if(!failed)
+            submitted += entered;
+
+        unsigned cq_head = *ring->cq_head;
+
+        while(cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &ring->cqes[cq_head & *ring->cq_mask];
+
+            ops[cqe->user_data].written = cqe->res;
+
+            completed++;
+            cq_head++;
+        }
+
+        __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+
+    return failed ? ERROR : OK;
+}
+
+#else
+
+struct frame_writer_ring
+{
+    int unused;
+};
+
+static struct frame_writer_ring* ring_open(void)
+{
+    return NULL;
+}
+
+static void ring_close(struct frame_writer_ring* ring)
+{
+}
+
+static WARN_UNUSED
+enum error_code ring_write(struct frame_writer_ring* ring, write_op_t* ops, unsigned count)
+{
+    return ERROR;
+}
+
+#endif
+
+/*****************************************************************************/
+
+//Writes the rest of the op after the first done bytes, the short writes
+//are continued
+static WARN_UNUSED
+enum error_code write_rest(write_op_t* op, size_t done)
+{
+    struct iovec rest[FRAME_WRITER_IOVECS];
+    unsigned     count  = 0;
+    off_t        offset = op->offset + done;
+
+    unsigned i;
+    for(i=0; i<op->count; i++)
+    {
+        if(done >= op->iov[i].iov_len)
+        {
+            done -= op->iov[i].iov_len;
+            continue;
+        }
+
+        rest[count].iov_base = (uint8_t*)op->iov[i].iov_base + done;
+        rest[count].iov_len  = op->iov[i].iov_len - done;
+        count++;
+        done = 0;
+    }
+
+    struct iovec* next = rest;
+
+    while(count)
+    {
+        ssize_t written = pwritev(op->job->fd, next, count, offset);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            LOG_ERRNO("pwritev %s", op->job->temporary);
+            return ERROR;
+        }
+
+        offset += written;
+
+        while(count && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+
+        if(count)
+        {
+            next->iov_base = (uint8_t*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return OK;
+}
+
+//Runs a batch of writes, the failures are set in their jobs
+static void write_ops(frame_writer_t* writer, write_op_t* ops, unsigned count)
+{
+    //Without io_uring nothing is written yet
+    bool ring = writer->ring != NULL;
+
+    if(ring && ring_write(writer->ring, ops, count)!=OK)
+    {
+        //Not usable anymore, the next batches use pwritev()
+        ring_close(writer->ring);
+        writer->ring = NULL;
+    }
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        write_op_t* op = &ops[i];
+
+        if(ring && op->written == -EINPROGRESS)
+        {
+            //Not taken by the kernel, or still running
+            op->job->result = ERROR;
+            continue;
+        }
+
+        if(op->written < 0 && op->written != -EINPROGRESS)
+        {
+            errno = -op->written;
+            LOG_ERRNO("io_uring writev %s", op->job->temporary);
+            op->job->result = ERROR;
+            continue;
+        }
+
+        //The rest of a short write
+        size_t done = op->written < 0 ? 0 : op->written;
+
+        if(done < op->length && write_rest(op, done)!=OK)
+            op->job->result = ERROR;
+    }
+}
+
+//Makes room for the frame in the archive
+static WARN_UNUSED
+enum error_code job_reserve(frame_writer_t* writer, write_job_t* job)
+{
+    enum error_code result;
+
+    result = archive_reserve(writer->archive, job->frame, &job->record, &job->fd, &job->offset); if(result!=OK) { return result; }
+
+    snprintf(job->path, sizeof(job->path), "%s", writer->archive->path);
+
+    return OK;
+}
+
+//Names the file of the frame and opens it, the whole frame is allocated
+static WARN_UNUSED
+enum error_code job_open(frame_writer_t* writer, write_job_t* job)
+{
+    if(writer->archive)
+        return job_reserve(writer, job);
+
+    writer->number++;
+
+    if(job->frame->truncated)
+    {
+        LOG_ERROR("frame writer: frame %u is truncated, not written", writer->number);
+        return ERROR;
+    }
+
+    if(snprintf(job->path,      sizeof(job->path),      writer->pattern, writer->number) >= (int)sizeof(job->path) ||
+       snprintf(job->temporary, sizeof(job->temporary), "%s.tmp", job->path)           >= (int)sizeof(job->temporary))
+    {
+        LOG_ERROR("frame writer: file name of frame %u too long", writer->number);
+        return ERROR;
+    }
+
+    job->fd = open(job->temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(job->fd == -1)
+    {
+        LOG_ERRNO("open %s", job->temporary);
+        return ERROR;
+    }
+
+    job->offset = 0;
+
+    //Not every file system can, the file grows as usual then
+    if(job->frame->length && fallocate(job->fd, 0, 0, job->frame->length) && errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        LOG_ERRNO("fallocate %s %zu", job->temporary, job->frame->length);
+        close(job->fd);
+        unlink(job->temporary);
+        job->fd = -1;
+        return ERROR;
+    }
+
+    return OK;
+}
+
+//Gives the frame files their names, or adds them to the index of the
+//archive
+static void jobs_commit(frame_writer_t* writer, write_job_t* jobs, unsigned jobs_count)
+{
+    unsigned i;
+
+    if(writer->archive)
+    {
+        struct archive_index_entry entries[FRAME_WRITER_QUEUE];
+        unsigned count = 0;
+
+        for(i=0; i<jobs_count; i++)
+        {
+            if(jobs[i].result!=OK)
+                continue;
+
+            entries[count].offset = jobs[i].offset;
+            entries[count].length = jobs[i].record.length;
+            entries[count].number = jobs[i].record.number;
+            count++;
+        }
+
+        //A failed frame stays in the segment, unreachable without its entry
+        if(archive_commit(writer->archive, entries, count)!=OK)
+        {
+            for(i=0; i<jobs_count; i++)
+                jobs[i].result = ERROR;
+        }
+
+        return;
+    }
+
+    for(i=0; i<jobs_count; i++)
+    {
+        write_job_t* job = &jobs[i];
+        size_t length = job->frame->length;
+
+        if(job->fd == -1)
+            continue;
+
+        if(job->result == OK)
+            job->result = file_commit(job->fd, job->temporary, job->path, length, length, writer->sync, writer->directory);
+        else
+        {
+            close(job->fd);
+            unlink(job->temporary);
+        }
+    }
+}
+
+//Writes the frames of opened jobs, in one file or segment of the archive each
+static void write_jobs(frame_writer_t* writer, write_job_t* jobs, unsigned jobs_count)
+{
+    write_op_t* ops = writer->ops;
+    unsigned count = 0;
+
+    unsigned i;
+    for(i=0; i<jobs_count; i++)
+    {
+        write_job_t* job = &jobs[i];
+
+        if(job->result!=OK)
+            continue;
+
+        unsigned first = 0;
+        off_t offset = job->offset;
+        //The record goes before the frame in the first write
+        unsigned record = writer->archive ? 1 : 0;
+
+        while(1)
+        {
+            write_op_t* op = &ops[count];
+
+            if(record)
+            {
+                op->iov[0].iov_base = &job->record;
+                op->iov[0].iov_len  = sizeof(job->record);
+            }
+
+            op->count = frame_iovec(job->frame, first, &op->iov[record], FRAME_WRITER_IOVECS - record);
+            first += op->count;
+            op->count += record;
+            record = 0;
+
+            if(!op->count)
+                break;
+
+            op->job     = job;
+            op->offset  = offset;
+            op->length  = 0;
+            op->written = -EINPROGRESS;
+
+            unsigned j;
+            for(j=0; j<op->count; j++)
+                op->length += op->iov[j].iov_len;
+
+            offset += op->length;
+
+            if(++count == FRAME_WRITER_OPS)
+            {
+                write_ops(writer, ops, count);
+                count = 0;
+            }
+        }
+    }
+
+    if(count)
+        write_ops(writer, ops, count);
+
+    jobs_commit(writer, jobs, jobs_count);
+
+    for(i=0; i<jobs_count; i++)
+    {
+        write_job_t* job = &jobs[i];
+        size_t length = job->frame->length;
+
+        //Lost rather than filled by the next shot while the kernel reads it
+        if(job->in_flight)
+            LOG_ERROR("frame writer: %s may still be written, the memory of its frame is not released", job->temporary[0] ? job->temporary : job->path);
+        else
+            frame_release(writer->pool, job->frame);
+
+        pthread_mutex_lock(&writer->lock);
+
+        if(job->result == OK)
+        {
+            writer->frames_written++;
+            writer->bytes_written += length;
+        }
+        else
+        {
+            writer->frames_failed++;
+            writer->result = ERROR;
+        }
+
+        pthread_mutex_unlock(&writer->lock);
+
+        if(writer->handler)
+            writer->handler(writer->context, job->path, length, job->result);
+    }
+}
+
+static void write_batch(frame_writer_t* writer, write_job_t* jobs, unsigned jobs_count)
+{
+    unsigned first = 0;
+
+    unsigned i;
+    for(i=0; i<jobs_count; i++)
+    {
+        write_job_t* job = &jobs[i];
+
+        //The frames of a segment are committed before the next one starts
+        if(writer->archive && i > first && !archive_fits(writer->archive, job->frame->length))
+        {
+            write_jobs(writer, &jobs[first], i - first);
+            first = i;
+        }
+
+        job->fd           = -1;
+        job->path[0]      = 0;
+        job->temporary[0] = 0;
+        job->in_flight    = false;
+        job->result       = job_open(writer, job);
+    }
+
+    write_jobs(writer, &jobs[first], jobs_count - first);
+}
+
+static void* run(void* arg)
+{
+    frame_writer_t* writer = arg;
+    write_job_t jobs[FRAME_WRITER_QUEUE];
+
+    pthread_mutex_lock(&writer->lock);
+
+    while(1)
+    {
+        while(!writer->queue_count && !writer->stopping)
+            pthread_cond_wait(&writer->queued, &writer->lock);
+
+        if(!writer->queue_count)
+            break;
+
+        //Everything queued goes in one batch
+        unsigned count = writer->queue_count;
+
+        unsigned i;
+        for(i=0; i<count; i++)
+        {
+            jobs[i].frame = writer->queue[writer->queue_head];
+            writer->queue_head = (writer->queue_head + 1) % FRAME_WRITER_QUEUE;
+        }
+
+        writer->queue_count = 0;
+        writer->writing     = count;
+        writer->batches++;
+
+        //There is room again
+        pthread_cond_broadcast(&writer->written);
+        pthread_mutex_unlock(&writer->lock);
+
+        write_batch(writer, jobs, count);
+
+        pthread_mutex_lock(&writer->lock);
+
+        writer->writing = 0;
+        pthread_cond_broadcast(&writer->written);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+//Starts the thread of a writer set up
+static WARN_UNUSED
+enum error_code start(frame_writer_t* writer)
+{
+    int result_pthread;
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->written, NULL);
+
+    //Of this writer only, several can run at once
+    writer->ops = calloc(FRAME_WRITER_OPS, sizeof(*writer->ops));
+    if(!writer->ops)
+    {
+        LOG_ERRNO("calloc frame writer ops");
+
+        if(writer->directory != -1)
+            close(writer->directory);
+
+        return ERROR;
+    }
+
+    writer->ring = ring_open();
+
+    result_pthread = pthread_create(&writer->thread, NULL, run, writer);
+    if(result_pthread)
+    {
+        LOG_ERROR("frame writer: pthread_create (%d)", result_pthread);
+
+        if(writer->ring)
+            ring_close(writer->ring);
+
+        free(writer->ops);
+
+        if(writer->directory != -1)
+            close(writer->directory);
+
+        return ERROR;
+    }
+
+    return OK;
+}
+
+enum error_code frame_writer_start(frame_writer_t* writer, frame_pool_t* pool, const char* pattern, unsigned first, file_sync_mode sync,
+        frame_written_handler handler, void* context)
+{
+    enum error_code result;
+
+    memset(writer, 0, sizeof(*writer));
+
+    writer->pool    = pool;
+    writer->pattern = pattern;
+    writer->number  = first - 1;
+    writer->sync    = sync;
+    writer->handler = handler;
+    writer->context = context;
+    writer->result  = OK;
+
+    result = file_sync_directory(pattern, sync, &writer->directory); if(result!=OK) { return result; }
+
+    return start(writer);
+}
+
+enum error_code frame_writer_start_archive(frame_writer_t* writer, frame_pool_t* pool, archive_t* archive,
+        frame_written_handler handler, void* context)
+{
+    memset(writer, 0, sizeof(*writer));
+
+    writer->pool      = pool;
+    writer->archive   = archive;
+    writer->sync      = archive->sync;
+    writer->directory = -1;
+    writer->handler   = handler;
+    writer->context   = context;
+    writer->result    = OK;
+
+    return start(writer);
+}
+
+void frame_writer_stop(frame_writer_t* writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+
+    LOG_MESSAGE("frame writer: %llu frames written (%llu bytes) in %llu batches with %s, %llu failed, %llu found the queue full, at most %u queued",
+            (unsigned long long)writer->frames_written,
+            (unsigned long long)writer->bytes_written,
+            (unsigned long long)writer->batches,
+            writer->ring ? "io_uring" : "pwritev",
+            (unsigned long long)writer->frames_failed,
+            (unsigned long long)writer->queue_full,
+            writer->queue_max);
+
+    if(writer->ring)
+        ring_close(writer->ring);
+
+    free(writer->ops);
+
+    if(writer->directory != -1)
+        close(writer->directory);
+
+    pthread_cond_destroy(&writer->written);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+static WARN_UNUSED
+enum error_code queue(frame_writer_t* writer, frame_t* frame, bool block)
+{
+    pthread_mutex_lock(&writer->lock);
+
+    if(writer->queue_count == FRAME_WRITER_QUEUE)
+    {
+        writer->queue_full++;
+
+        if(!block)
+        {
+            pthread_mutex_unlock(&writer->lock);
+            return AGAIN;
+        }
+
+        while(writer->queue_count == FRAME_WRITER_QUEUE)
+            pthread_cond_wait(&writer->written, &writer->lock);
+    }
+
+    writer->queue[(writer->queue_head + writer->queue_count) % FRAME_WRITER_QUEUE] = frame;
+    writer->queue_count++;
+
+    if(writer->queue_count > writer->queue_max)
+        writer->queue_max = writer->queue_count;
+
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+
+    return OK;
+}
+
+enum error_code frame_writer_queue(frame_writer_t* writer, frame_t* frame)
+{
+    return queue(writer, frame, true);
+}
+
+enum error_code frame_writer_try_queue(frame_writer_t* writer, frame_t* frame)
+{
+    return queue(writer, frame, false);
+}
+
+enum error_code frame_writer_flush(frame_writer_t* writer)
+{
+    pthread_mutex_lock(&writer->lock);
+
+    while(writer->queue_count || writer->writing)
+        pthread_cond_wait(&writer->written, &writer->lock);
+
+    enum error_code result = writer->result;
+
+    writer->result = OK;
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return result;
+}
+
+bool frame_writer_uring(const frame_writer_t* writer)
+{
+    return writer->ring != NULL;
+}
@@ -0,0 +1,110 @@
+#ifndef  FRAME_WRITER_INC
+#define  FRAME_WRITER_INC
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "archive.h"
+#include "file_sink.h"
+#include "frame_sink.h"
+
+/*
+   Writes the frames received by a frame_sink_t to their files from a thread
+   of its own, so the capture goes on at the rate of the sensor while the
+   storage catches up.
+
+   The capture side queues the complete frames, the queue is bounded. The
+   thread takes all the frames queued at once and writes them in a single
+   batch: with io_uring every chunk list is a vectored write and the whole
+   batch is one system call, without it (old kernels, or io_uring not
+   allowed) the same writes are done with pwritev(). Each frame goes to a
+   temporary file renamed once written, as file_sink does, or is appended to
+   an archive (see archive.h), then its chunks go back to the pool and the
+   handler is called.
+
+   The frames hold memory of the pool until they are written. A full queue
+   is reported to the capture side, which can wait or drop frames. The pool
+   must be large enough for the queued frames and the ones of the next shot.
+   */
+
+//Frames waiting to be written
+#define FRAME_WRITER_QUEUE  8
+//Writes in flight at once, each of up to FRAME_WRITER_IOVECS chunks
+#define FRAME_WRITER_OPS    32
+#define FRAME_WRITER_IOVECS 16
+
+//Called from the thread of the writer once the frame is in its file, or
+//failed to. The frame is released already. The path is the one of the
+//segment for an archive
+typedef void (*frame_written_handler)(void* context, const char* path, size_t length, enum error_code result);
+
+struct frame_writer_ring;
+struct frame_writer_op;
+
+typedef struct
+{
+    frame_pool_t*         pool;
+    //printf format of the file names, given the number of the file
+    const char*           pattern;
+    //Where the frames go instead of their files, if not NULL
+    archive_t*            archive;
+    unsigned              number;
+    file_sync_mode        sync;
+    frame_written_handler handler;
+    void*                 context;
+    //io_uring of the thread, NULL if pwritev() is used
+    struct frame_writer_ring* ring;
+    //Writes of the batch being written, FRAME_WRITER_OPS of them
+    struct frame_writer_op*   ops;
+    //Directory of the files, to sync the renames. -1 if not needed
+    int                   directory;
+    pthread_t             thread;
+    //Guards the queue, the counters and stopping
+    pthread_mutex_t       lock;
+    pthread_cond_t        queued;
+    pthread_cond_t        written;
+    frame_t*              queue[FRAME_WRITER_QUEUE];
+    unsigned              queue_head;
+    unsigned              queue_count;
+    //Frames taken by the thread and not written yet
+    unsigned              writing;
+    bool                  stopping;
+    //A frame failed since the last frame_writer_flush()
+    enum error_code       result;
+    //Totals since the start
+    uint64_t              frames_written;
+    uint64_t              frames_failed;
+    uint64_t              bytes_written;
+    //Frames queued while the queue was full: waited for or refused
+    uint64_t              queue_full;
+    unsigned              queue_max;
+    uint64_t              batches;
+} frame_writer_t;
+
+//The files are numbered from first. The handler may be NULL
+WARN_UNUSED enum error_code frame_writer_start(frame_writer_t* writer, frame_pool_t* pool, const char* pattern, unsigned first, file_sync_mode sync,
+        frame_written_handler handler, void* context);
+//Same as frame_writer_start(), the frames are appended to the archive. It is
+//used only by the thread of the writer until it is stopped, the archive is
+//closed by the caller
+WARN_UNUSED enum error_code frame_writer_start_archive(frame_writer_t* writer, frame_pool_t* pool, archive_t* archive,
+        frame_written_handler handler, void* context);
+//Writes the frames queued and stops the thread
+void                        frame_writer_stop (frame_writer_t* writer);
+
+//Queues a frame taken from the sink, the writer releases it. Blocks while
+//the queue is full
+WARN_UNUSED enum error_code frame_writer_queue    (frame_writer_t* writer, frame_t* frame);
+//Same as frame_writer_queue(), AGAIN if the queue is full. The frame stays
+//with the caller then
+WARN_UNUSED enum error_code frame_writer_try_queue(frame_writer_t* writer, frame_t* frame);
+//Blocks until every queued frame is written. Fails if any of them failed
+//since the last call
+WARN_UNUSED enum error_code frame_writer_flush    (frame_writer_t* writer);
+
+//Whether the writer uses io_uring
+bool frame_writer_uring(const frame_writer_t* writer);
+
+#endif
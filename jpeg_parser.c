@@ -0,0 +1,198 @@
+#include "jpeg_parser.h"
+
+#include <string.h>
+
+#include "jpeg_scan.h"
+
+#define JPEG_TEM  0x01
+#define JPEG_RST0 0xD0
+#define JPEG_RST7 0xD7
+#define JPEG_SOI  0xD8
+#define JPEG_EOI  0xD9
+#define JPEG_SOS  0xDA
+
+void jpeg_parser_init(jpeg_parser_t* parser)
+{
+    memset(parser, 0, sizeof(*parser));
+
+    parser->state = JPEG_STATE_SOI;
+}
+
+int jpeg_parser_idle(const jpeg_parser_t* parser)
+{
+    return parser->state == JPEG_STATE_SOI;
+}
+
+void jpeg_parser_end_frame(jpeg_parser_t* parser)
+{
+    parser->state = JPEG_STATE_SOI;
+    parser->frames++;
+}
+
+//Handles the code of a marker found inside a frame. Returns 1 for EOI
+static int marker_code(jpeg_parser_t* parser, uint8_t code)
+{
+    //Fill bytes before the code
+    if(code == 0xFF)
+    {
+        parser->state = JPEG_STATE_CODE;
+        return 0;
+    }
+
+    parser->marker = code;
+
+    if(code == JPEG_EOI)
+    {
+        parser->state = JPEG_STATE_SOI;
+        parser->frames++;
+        return 1;
+    }
+
+    //Only valid inside another segment (a thumbnail) or as the first marker
+    if(code == JPEG_SOI || code == 0x00)
+    {
+        parser->errors += 2;
+        parser->state = JPEG_STATE_MARKER;
+        return 0;
+    }
+
+    //Markers without a length
+    if(code == JPEG_TEM || (code >= JPEG_RST0 && code <= JPEG_RST7))
+    {
+        parser->state = JPEG_STATE_MARKER;
+        return 0;
+    }
+
+    parser->state = JPEG_STATE_LENGTH_HIGH;
+    return 0;
+}
+
+size_t jpeg_parser_parse(jpeg_parser_t* parser, const uint8_t* data, size_t length, int* frame_end)
+{
+    const uint8_t* p   = data;
+    const uint8_t* end = data + length;
+
+    *frame_end = 0;
+
+    while(p < end && !*frame_end)
+    {
+        uint8_t byte;
+
+        switch(parser->state)
+        {
+            case JPEG_STATE_SOI:
+                byte = *p++;
+
+                if(byte == 0xFF)
+                {
+                    parser->frame_start = parser->position + (p - data) - 1;
+                    parser->state = JPEG_STATE_SOI_CODE;
+                }
+                else
+                {
+                    parser->errors++;
+                }
+                break;
+
+            case JPEG_STATE_SOI_CODE:
+                byte = *p++;
+
+                if(byte == JPEG_SOI)
+                {
+                    parser->state = JPEG_STATE_MARKER;
+                }
+                else if(byte == 0xFF)
+                {
+                    parser->errors++;
+                    parser->frame_start++;
+                }
+                else
+                {
+                    parser->errors += 2;
+                    parser->state = JPEG_STATE_SOI;
+                }
+                break;
+
+            case JPEG_STATE_MARKER:
+                byte = *p++;
+
+                if(byte == 0xFF)
+                    parser->state = JPEG_STATE_CODE;
+                else
+                    parser->errors++;
+                break;
+
+            case JPEG_STATE_CODE:
+                *frame_end = marker_code(parser, *p++);
+                break;
+
+            case JPEG_STATE_LENGTH_HIGH:
+                parser->remaining = *p++ << 8;
+                parser->state = JPEG_STATE_LENGTH_LOW;
+                break;
+
+            case JPEG_STATE_LENGTH_LOW:
+                parser->remaining |= *p++;
+
+                //The length counts itself
+                if(parser->remaining < 2)
+                {
+                    parser->errors += 2;
+                    parser->state = JPEG_STATE_MARKER;
+                    break;
+                }
+
+                parser->remaining -= 2;
+                parser->state = JPEG_STATE_SEGMENT;
+
+                if(!parser->remaining)
+                    parser->state = parser->marker == JPEG_SOS ? JPEG_STATE_ENTROPY : JPEG_STATE_MARKER;
+                break;
+
+            case JPEG_STATE_SEGMENT:
+            {
+                size_t skip = end - p;
+
+                if(skip > parser->remaining)
+                    skip = parser->remaining;
+
+                p += skip;
+                parser->remaining -= skip;
+
+                if(!parser->remaining)
+                    parser->state = parser->marker == JPEG_SOS ? JPEG_STATE_ENTROPY : JPEG_STATE_MARKER;
+                break;
+            }
+
+            case JPEG_STATE_ENTROPY:
+            {
+                //Stuffed FFs are skipped by the scanner
+                const uint8_t* marker = jpeg_scan_marker(p, end);
+
+                if(marker == end)
+                {
+                    p = end;
+                    break;
+                }
+
+                p = marker + 1;
+                parser->state = JPEG_STATE_ENTROPY_CODE;
+                break;
+            }
+
+            case JPEG_STATE_ENTROPY_CODE:
+                byte = *p++;
+
+                //Stuffed FF, restart marker or fill byte, the data goes on
+                if(byte == 0x00 || (byte >= JPEG_RST0 && byte <= JPEG_RST7))
+                    parser->state = JPEG_STATE_ENTROPY;
+                else if(byte != 0xFF)
+                    *frame_end = marker_code(parser, byte);
+                break;
+        }
+    }
+
+    parser->position += p - data;
+
+    return p - data;
+}
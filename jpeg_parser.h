@@ -0,0 +1,66 @@
+#ifndef  JPEG_PARSER_INC
+#define  JPEG_PARSER_INC
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   Incremental JPEG marker parser. It follows the marker segments of a stream
+   of concatenated JPEG frames, slice by slice, to find where every frame
+   ends. The marker segments (APPn included, so an EXIF thumbnail does not
+   count as a frame) are skipped using their length and the entropy coded
+   data is scanned for the next marker (jpeg_scan.h), the data is never
+   copied.
+
+   A marker split between two slices is completed on the next call.
+   */
+
+typedef enum
+{
+    //Before a frame, waiting for SOI
+    JPEG_STATE_SOI,
+    JPEG_STATE_SOI_CODE,
+    //Between marker segments
+    JPEG_STATE_MARKER,
+    //After an FF, the marker code comes
+    JPEG_STATE_CODE,
+    JPEG_STATE_LENGTH_HIGH,
+    JPEG_STATE_LENGTH_LOW,
+    //Inside a marker segment
+    JPEG_STATE_SEGMENT,
+    //Entropy coded data after SOS, FF is stuffing, a restart or a marker
+    JPEG_STATE_ENTROPY,
+    JPEG_STATE_ENTROPY_CODE
+} jpeg_state;
+
+typedef struct
+{
+    jpeg_state state;
+    //Marker of the segment being read
+    uint8_t    marker;
+    //Bytes left in the segment
+    uint16_t   remaining;
+    //Bytes parsed since the start of the stream
+    uint64_t   position;
+    //Position of the SOI of the current frame
+    uint64_t   frame_start;
+    //Frames completed
+    uint32_t   frames;
+    //Bytes that are not part of a valid frame
+    uint64_t   errors;
+} jpeg_parser_t;
+
+void jpeg_parser_init(jpeg_parser_t* parser);
+
+//Parses the data up to the end of the next frame. Returns the number of bytes
+//consumed, *frame_end is set when the last of them is the EOI of a frame
+size_t jpeg_parser_parse(jpeg_parser_t* parser, const uint8_t* data, size_t length, int* frame_end);
+
+//Whether the parser is between two frames
+int jpeg_parser_idle(const jpeg_parser_t* parser);
+
+//Ends the current frame without its EOI, the next frame starts with the next
+//byte
+void jpeg_parser_end_frame(jpeg_parser_t* parser);
+
+#endif
@@ -0,0 +1,165 @@
+#include "jpeg_scan.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JPEG_SCAN_SSE2
+#endif
+
+//AVX2 is compiled for any x86 and only used if the CPU has it
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define JPEG_SCAN_AVX2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define JPEG_SCAN_NEON
+#endif
+
+#define JPEG_SCANNERS_MAX 4
+
+static pthread_once_t scanners_once = PTHREAD_ONCE_INIT;
+static jpeg_scanner   scanners[JPEG_SCANNERS_MAX];
+static unsigned       scanners_count = 0;
+
+const uint8_t* jpeg_scan_marker_scalar(const uint8_t* p, const uint8_t* end)
+{
+    while(p < end)
+    {
+        p = memchr(p, 0xFF, end - p);
+
+        if(!p)
+            return end;
+
+        if(p+1 == end || p[1] != 0x00)
+            return p;
+
+        //Stuffed FF
+        p += 2;
+    }
+
+    return end;
+}
+
+//The vector versions compare a block and the block one byte ahead, both
+//loads must stay inside the data. The tail is left to the scalar version
+
+#ifdef JPEG_SCAN_SSE2
+static const uint8_t* scan_sse2(const uint8_t* p, const uint8_t* end)
+{
+    const __m128i ff   = _mm_set1_epi8((char)0xFF);
+    const __m128i zero = _mm_setzero_si128();
+
+    while(end - p > 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        __m128i next  = _mm_loadu_si128((const __m128i*)(p+1));
+
+        unsigned mask = _mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(next, zero), _mm_cmpeq_epi8(bytes, ff)));
+
+        if(mask)
+            return p + __builtin_ctz(mask);
+
+        p += 16;
+    }
+
+    return jpeg_scan_marker_scalar(p, end);
+}
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+__attribute__((target("avx2")))
+static const uint8_t* scan_avx2(const uint8_t* p, const uint8_t* end)
+{
+    const __m256i ff   = _mm256_set1_epi8((char)0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while(end - p > 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)p);
+        __m256i next  = _mm256_loadu_si256((const __m256i*)(p+1));
+
+        unsigned mask = _mm256_movemask_epi8(_mm256_andnot_si256(_mm256_cmpeq_epi8(next, zero), _mm256_cmpeq_epi8(bytes, ff)));
+
+        if(mask)
+            return p + __builtin_ctz(mask);
+
+        p += 32;
+    }
+
+    return jpeg_scan_marker_scalar(p, end);
+}
+#endif
+
+#ifdef JPEG_SCAN_NEON
+static const uint8_t* scan_neon(const uint8_t* p, const uint8_t* end)
+{
+    const uint8x16_t ff   = vdupq_n_u8(0xFF);
+    const uint8x16_t zero = vdupq_n_u8(0x00);
+
+    while(end - p > 16)
+    {
+        uint8x16_t bytes = vld1q_u8(p);
+        uint8x16_t next  = vld1q_u8(p+1);
+
+        uint8x16_t match = vbicq_u8(vceqq_u8(bytes, ff), vceqq_u8(next, zero));
+
+        //No movemask in NEON, narrowing every 16 bits to 8 leaves 4 bits per
+        //byte in a 64 bit value
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+
+        if(mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+
+        p += 16;
+    }
+
+    return jpeg_scan_marker_scalar(p, end);
+}
+#endif
+
+static void scanners_add(const char* name, jpeg_scan_function scan)
+{
+    scanners[scanners_count].name = name;
+    scanners[scanners_count].scan = scan;
+    scanners_count++;
+}
+
+static void scanners_init(void)
+{
+    scanners_add("scalar", jpeg_scan_marker_scalar);
+
+#ifdef JPEG_SCAN_NEON
+    scanners_add("neon", scan_neon);
+#endif
+
+#ifdef JPEG_SCAN_SSE2
+    scanners_add("sse2", scan_sse2);
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+        scanners_add("avx2", scan_avx2);
+#endif
+}
+
+unsigned jpeg_scanners(const jpeg_scanner** list)
+{
+    pthread_once(&scanners_once, scanners_init);
+
+    *list = scanners;
+
+    return scanners_count;
+}
+
+const uint8_t* jpeg_scan_marker(const uint8_t* p, const uint8_t* end)
+{
+    pthread_once(&scanners_once, scanners_init);
+
+    return scanners[scanners_count-1].scan(p, end);
+}
@@ -0,0 +1,35 @@
+#ifndef  JPEG_SCAN_INC
+#define  JPEG_SCAN_INC
+
+#include <stdint.h>
+
+/*
+   Marker scanner for JPEG entropy coded data, the part of the frame the
+   parser spends its time on. It finds the next FF that is not a stuffed FF00,
+   16 or 32 bytes at a time with NEON, SSE2 or AVX2. The fastest one the CPU
+   supports is chosen on the first call.
+
+   The NEON version needs the compiler to target it (aarch64, or -mfpu=neon
+   on ARMv7). Otherwise the scalar version is used.
+   */
+
+//First p[i] == FF with p[i+1] != 00 (the FF is the last byte or starts a
+//marker, a restart or a fill byte), end if there is none
+typedef const uint8_t* (*jpeg_scan_function)(const uint8_t* p, const uint8_t* end);
+
+typedef struct
+{
+    const char*        name;
+    jpeg_scan_function scan;
+} jpeg_scanner;
+
+const uint8_t* jpeg_scan_marker(const uint8_t* p, const uint8_t* end);
+
+//Plain C version, the reference for the others
+const uint8_t* jpeg_scan_marker_scalar(const uint8_t* p, const uint8_t* end);
+
+//Scanners this CPU can run, scalar first. The last one is the one used by
+//jpeg_scan_marker(). Returns how many there are
+unsigned jpeg_scanners(const jpeg_scanner** scanners);
+
+#endif
@@ -0,0 +1,199 @@
+#include "latency.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "logerr.h"
+
+struct latency_series
+{
+    const char* component;
+    const char* operation;
+    uint32_t    key;
+    struct latency_histogram histogram;
+};
+
+//Samples are recorded from the OMX callback thread and read from the
+//application, the lock is only held to update a few counters
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_series series[LATENCY_SERIES_MAX];
+static unsigned series_count = 0;
+
+uint64_t latency_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned bucket_index(uint64_t value)
+{
+    if(value >= (UINT64_C(1) << LATENCY_MAX_BITS))
+        value = (UINT64_C(1) << LATENCY_MAX_BITS) - 1;
+
+    if(value < LATENCY_SUB_BUCKETS)
+        return value;
+
+    //Position of the most significant bit, at least LATENCY_SUB_BITS here
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - (LATENCY_SUB_BITS - 1);
+
+    return LATENCY_SUB_BUCKETS
+         + (msb - LATENCY_SUB_BITS) * (LATENCY_SUB_BUCKETS / 2)
+         + (value >> shift) - (LATENCY_SUB_BUCKETS / 2);
+}
+
+//Biggest value counted in the bucket
+static uint64_t bucket_value(unsigned index)
+{
+    if(index < LATENCY_SUB_BUCKETS)
+        return index;
+
+    unsigned msb = LATENCY_SUB_BITS + (index - LATENCY_SUB_BUCKETS) / (LATENCY_SUB_BUCKETS / 2);
+    unsigned sub = (index - LATENCY_SUB_BUCKETS) % (LATENCY_SUB_BUCKETS / 2);
+    unsigned shift = msb - (LATENCY_SUB_BITS - 1);
+
+    return ((uint64_t)(LATENCY_SUB_BUCKETS / 2 + sub + 1) << shift) - 1;
+}
+
+//Must be called with the lock held
+static struct latency_series* find_series(const char* component, const char* operation, uint32_t key)
+{
+    unsigned i;
+    for(i=0; i<series_count; i++)
+    {
+        if(series[i].key == key &&
+           strcmp(series[i].component, component) == 0 &&
+           strcmp(series[i].operation, operation) == 0)
+        {
+            return &series[i];
+        }
+    }
+
+    return NULL;
+}
+
+void latency_histogram_record(struct latency_histogram* histogram, uint64_t microseconds)
+{
+    if(histogram->count == 0 || microseconds < histogram->min) histogram->min = microseconds;
+    if(histogram->count == 0 || microseconds > histogram->max) histogram->max = microseconds;
+
+    histogram->count++;
+    histogram->sum += microseconds;
+    histogram->buckets[bucket_index(microseconds)]++;
+}
+
+void latency_record(const char* component, const char* operation, uint32_t key, uint64_t microseconds)
+{
+    pthread_mutex_lock(&latency_lock);
+
+    struct latency_series* s = find_series(component, operation, key);
+
+    if(!s)
+    {
+        if(series_count == LATENCY_SERIES_MAX)
+        {
+            pthread_mutex_unlock(&latency_lock);
+            LOG_ERROR("latency: no room for %s %s %" PRIu32, component, operation, key);
+            return;
+        }
+
+        s = &series[series_count++];
+        memset(s, 0, sizeof(*s));
+        s->component = component;
+        s->operation = operation;
+        s->key       = key;
+    }
+
+    latency_histogram_record(&s->histogram, microseconds);
+
+    pthread_mutex_unlock(&latency_lock);
+}
+
+enum error_code latency_get(const char* component, const char* operation, uint32_t key, struct latency_histogram* histogram)
+{
+    enum error_code result = ERROR;
+
+    pthread_mutex_lock(&latency_lock);
+
+    struct latency_series* s = find_series(component, operation, key);
+
+    if(s)
+    {
+        *histogram = s->histogram;
+        result = OK;
+    }
+
+    pthread_mutex_unlock(&latency_lock);
+
+    return result;
+}
+
+uint64_t latency_percentile(const struct latency_histogram* histogram, double percentile)
+{
+    if(histogram->count == 0)
+        return 0;
+
+    //Rank of the sample, 1 .. count
+    uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+
+    if(rank < 1)                rank = 1;
+    if(rank > histogram->count) rank = histogram->count;
+
+    uint64_t seen = 0;
+
+    unsigned i;
+    for(i=0; i<LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+
+        if(seen >= rank)
+        {
+            //The bucket bound can be past the real samples
+            uint64_t value = bucket_value(i);
+
+            if(value > histogram->max) value = histogram->max;
+            if(value < histogram->min) value = histogram->min;
+
+            return value;
+        }
+    }
+
+    return histogram->max;
+}
+
+void latency_dump(void)
+{
+    pthread_mutex_lock(&latency_lock);
+
+    LOG_MESSAGE("latency (us)                                   key    count      min      p50      p90      p99      max");
+
+    unsigned i;
+    for(i=0; i<series_count; i++)
+    {
+        const struct latency_histogram* h = &series[i].histogram;
+
+        LOG_MESSAGE("%-30s %-15s %5" PRIu32 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64,
+                series[i].component, series[i].operation, series[i].key, h->count,
+                h->min,
+                latency_percentile(h, 50),
+                latency_percentile(h, 90),
+                latency_percentile(h, 99),
+                h->max);
+    }
+
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void latency_reset(void)
+{
+    pthread_mutex_lock(&latency_lock);
+
+    series_count = 0;
+
+    pthread_mutex_unlock(&latency_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef  LATENCY_INC
+#define  LATENCY_INC
+
+#include <stdint.h>
+
+#include "error.h"
+
+/*
+   Latency recorder. Every series is identified by the component name, the
+   operation and a key (the port or the state) and keeps the samples in a
+   log-linear histogram, the same layout as HdrHistogram: the values below
+   LATENCY_SUB_BUCKETS are exact, above that every power of two is split in
+   LATENCY_SUB_BUCKETS/2 buckets, so the error of a reported value is below
+   2/LATENCY_SUB_BUCKETS (6.25%).
+
+   The values are in microseconds.
+   */
+
+#define LATENCY_SERIES_MAX     64
+#define LATENCY_SUB_BITS       5
+#define LATENCY_SUB_BUCKETS    (1 << LATENCY_SUB_BITS)
+//Values up to 2^LATENCY_MAX_BITS microseconds (~18 minutes), the bigger ones
+//are counted in the last bucket
+#define LATENCY_MAX_BITS       30
+#define LATENCY_BUCKETS        ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * (LATENCY_SUB_BUCKETS / 2))
+
+struct latency_histogram
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint32_t buckets[LATENCY_BUCKETS];
+};
+
+//Monotonic time in microseconds
+uint64_t latency_now(void);
+
+//Adds a sample to a histogram owned by the caller, it must start zeroed. Not
+//locked
+void latency_histogram_record(struct latency_histogram* histogram, uint64_t microseconds);
+
+//Adds a sample to the series, the series is created on the first sample
+void latency_record(const char* component, const char* operation, uint32_t key, uint64_t microseconds);
+
+//Copies the histogram of the series. Fails if there are no samples yet
+WARN_UNUSED enum error_code latency_get(const char* component, const char* operation, uint32_t key, struct latency_histogram* histogram);
+
+//Value below which the given percentage of the samples is, 0 .. 100
+uint64_t latency_percentile(const struct latency_histogram* histogram, double percentile);
+
+//Logs all the series
+void latency_dump(void);
+
+//Forgets all the series
+void latency_reset(void);
+
+#endif
@@ -1,20 +1,56 @@
-
 #include "logerr.h"
 
 #include <pthread.h>
+#include <semaphore.h>
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 
 /* TODO: Print GIT SHA1 on startup */
 
-#define LOGERR_THREAD_SAFE
+/* Longest message, the rest is cut */
+#define LOGERR_MESSAGE_MAX 1024
+/* Messages waiting to be written, must be a power of two */
+#define LOGERR_RING_SIZE   256
+/* Lines written to stderr at once, room for a few messages with the prefix */
+#define LOGERR_BATCH_MAX   8192
+#define LOGERR_PREFIX_MAX  256
+
+/* A message as logged, the prefix is added by the writer */
+struct log_record
+{
+    /* Bounded MPMC queue sequence (D. Vyukov): the slot is free for the
+     * producer of position p when it is p, it is filled when it is p+1 */
+    uintptr_t   sequence;
+    time_t      time;
+    const void* addr;
+    int         caller_errno;
+    char        text[LOGERR_MESSAGE_MAX];
+};
 
-#ifdef LOGERR_THREAD_SAFE
-static pthread_mutex_t logerr_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+static struct
+{
+    struct log_record slots[LOGERR_RING_SIZE];
+    /* Next position to fill, taken by the producers with a CAS */
+    uintptr_t         head;
+    /* Next position to write, only changed with write_mutex held */
+    uintptr_t         tail;
+    /* Posted after every message, the writer sleeps on it */
+    sem_t             ready;
+    pthread_t         thread;
+    int               running;
+} ring;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* Held while writing to stderr, by the writer thread or by a caller that
+ * could not use the ring. The batch buffer is only used with it held */
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char batch[LOGERR_BATCH_MAX];
 
 void (*logerr)(const char * const message) = NULL;
 
@@ -23,83 +59,215 @@ const void * const log_pc(void)
     return __builtin_return_address(0);
 }
 
-static void log_message(const char * const message)
+/* Formats the record as a line into out. Returns the length, the newline
+ * included */
+static size_t format_record(const struct log_record * const record, char * const out, const size_t size)
 {
-    (void)fputs(message, stderr);
-    (void)fputs("\n", stderr);
+    size_t length = 0;
+    int result;
 
-    if(logerr)
-        logerr(message);
-}
+    /* Print error time and address */
+    result = snprintf(&out[length], size-length, "%08X %08"PRIXPTR" ", (uint32_t)record->time, (uintptr_t)record->addr);
 
-void log_error(int caller_errno, const void * const addr, const char * const format, ... )
-{
-    /* Get the time as soon as possible */
-    time_t t;
-    errno = 0;
-    t = time(NULL);
-    int result;
+    if(result>0)
+        length += result;
+
+    /* Print human readable errno */
+    if(record->caller_errno && length < size-2)
+    {
+        errno = 0;
+        const char * strerr = strerror(record->caller_errno);
 
-    char message[1024];
+        result = snprintf(&out[length], size-length, ": \"%s\" errno(%d)", errno==0 ? strerr : "Unknown", record->caller_errno);
+
+        if(result>0)
+            length += result;
+    }
 
-#ifdef LOGERR_THREAD_SAFE
-    /* Try to lock. In case of error report it and continue,
-     * we cannot do something better. */
-    int lock_err = pthread_mutex_lock(&logerr_mutex);
-    if(lock_err!=0)
+    /* Print actual error */
+    if(length < size-2)
     {
-        result = snprintf(&message[0], sizeof(message), "L%08X", lock_err);
+        result = snprintf(&out[length], size-length, "%s", record->text);
 
         if(result>0)
-            log_message(message);
+            length += result;
     }
-#endif
 
+    /* Leave room for the newline */
+    if(length > size-2)
+        length = size-2;
+
+    out[length] = '\0';
+
+    if(logerr)
+        logerr(out);
+
+    out[length++] = '\n';
+    out[length  ] = '\0';
+
+    return length;
+}
+
+static void write_batch(const size_t size)
+{
+    if(size)
+        (void)fwrite(batch, 1, size, stderr);
+}
+
+/* Writes the filled slots, in order, up to the first one that is not
+ * filled yet. Must be called with write_mutex held */
+static void drain(void)
+{
     size_t size = 0;
 
-    /* Print error time and address */
-    result = snprintf(&message[size], sizeof(message)-size, "%08X %08"PRIXPTR" ", (uint32_t)t, (uintptr_t)addr);
+    for(;;)
+    {
+        struct log_record* record = &ring.slots[ring.tail & (LOGERR_RING_SIZE-1)];
 
-    if(result>0)
-        size += result;
+        if(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != ring.tail+1)
+            break;
 
-    /* Print human readable errno */
-    if(caller_errno)
+        if(sizeof(batch)-size < LOGERR_MESSAGE_MAX + LOGERR_PREFIX_MAX)
+        {
+            write_batch(size);
+            size = 0;
+        }
+
+        size += format_record(record, &batch[size], sizeof(batch)-size);
+
+        /* Give the slot back for the next round of the ring */
+        __atomic_store_n(&record->sequence, ring.tail + LOGERR_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring.tail, ring.tail+1, __ATOMIC_RELAXED);
+    }
+
+    write_batch(size);
+}
+
+static void* log_thread(void* arg)
+{
+    for(;;)
     {
-        errno = 0;
-        const char * strerr = strerror(caller_errno);
+        while(sem_wait(&ring.ready) != 0 && errno == EINTR);
 
-        result = snprintf(&message[size], sizeof(message)-size, ": \"%s\" errno(%d)", errno==0 ? strerr : "Unknown", caller_errno);
+        pthread_mutex_lock(&write_mutex);
+        drain();
+        pthread_mutex_unlock(&write_mutex);
 
-        if(result>0)
-            size += result;
+        if(!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE))
+            break;
     }
 
-    /* Print actual error */
-    va_list ap;
-    va_start(ap, format);
-    result = vsnprintf(&message[size], sizeof(message)-size, format, ap);
-    va_end(ap);
+    return NULL;
+}
 
-    if(result>0)
-        size += result;
+/* At exit, the messages left are written before the process ends */
+static void log_stop(void)
+{
+    __atomic_store_n(&ring.running, 0, __ATOMIC_RELEASE);
+
+    sem_post(&ring.ready);
+    pthread_join(ring.thread, NULL);
 
-    log_message(message);
+    log_flush();
+}
+
+static void log_start(void)
+{
+    unsigned i;
+    for(i=0; i<LOGERR_RING_SIZE; i++)
+        ring.slots[i].sequence = i;
 
-#ifdef LOGERR_THREAD_SAFE
-    /* Unlock if lock was successful */
-    if(lock_err==0)
+    if(sem_init(&ring.ready, 0, 0) != 0)
+        return;
+
+    /* Without the writer thread every caller writes its own message */
+    if(pthread_create(&ring.thread, NULL, log_thread, NULL) != 0)
+        return;
+
+    __atomic_store_n(&ring.running, 1, __ATOMIC_RELEASE);
+
+    atexit(log_stop);
+}
+
+/* Takes a free slot, NULL if the ring is full */
+static struct log_record* ring_reserve(uintptr_t * const position)
+{
+    uintptr_t head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+
+    for(;;)
     {
-        int unlock_err = pthread_mutex_unlock(&logerr_mutex);
+        struct log_record* record = &ring.slots[head & (LOGERR_RING_SIZE-1)];
+        intptr_t difference = (intptr_t)__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - (intptr_t)head;
 
-        if(unlock_err!=0)
+        if(difference == 0)
         {
-            result = snprintf(&message[0], sizeof(message), "U%08X\n", unlock_err);
-
-            if(result>0)
-                log_message(message);
+            /* On failure head is updated to the current value */
+            if(__atomic_compare_exchange_n(&ring.head, &head, head+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *position = head;
+                return record;
+            }
+        }
+        else if(difference < 0)
+        {
+            /* The writer is a full round behind */
+            return NULL;
+        }
+        else
+        {
+            head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
         }
     }
-#endif
 }
 
+void log_error(int caller_errno, const void * const addr, const char * const format, ... )
+{
+    /* Get the time as soon as possible */
+    time_t t;
+    errno = 0;
+    t = time(NULL);
+
+    pthread_once(&ring_once, log_start);
+
+    /* When the ring is full or there is no writer thread the message is
+     * written right away, like the ones before it */
+    struct log_record local;
+    struct log_record* record = NULL;
+    uintptr_t position = 0;
+
+    if(__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE))
+        record = ring_reserve(&position);
+
+    if(!record)
+        record = &local;
+
+    record->time         = t;
+    record->addr         = addr;
+    record->caller_errno = caller_errno;
+
+    va_list ap;
+    va_start(ap, format);
+    (void)vsnprintf(record->text, sizeof(record->text), format, ap);
+    va_end(ap);
+
+    if(record != &local)
+    {
+        __atomic_store_n(&record->sequence, position+1, __ATOMIC_RELEASE);
+        sem_post(&ring.ready);
+        return;
+    }
+
+    pthread_mutex_lock(&write_mutex);
+
+    drain();
+    write_batch(format_record(record, batch, sizeof(batch)));
+
+    pthread_mutex_unlock(&write_mutex);
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&write_mutex);
+    drain();
+    pthread_mutex_unlock(&write_mutex);
+}
@@ -22,16 +22,37 @@
 #include <stdarg.h>
 #include <errno.h>
 
-#define LOG_ERROR(format, ... ) do { log_error(    0, log_pc(), format, ##__VA_ARGS__); } while(0)
-#define LOG_ERRNO(format, ... ) do { log_error(errno, log_pc(), format, ##__VA_ARGS__); } while(0)
+/* Levels, the ones above LOGERR_LEVEL are removed at compile time (the
+ * arguments are still type checked but never evaluated) */
+#define LOGERR_LEVEL_NONE    0
+#define LOGERR_LEVEL_ERROR   1
+#define LOGERR_LEVEL_MESSAGE 2
+#define LOGERR_LEVEL_DEBUG   3
+
+#ifndef LOGERR_LEVEL
+#define LOGERR_LEVEL LOGERR_LEVEL_MESSAGE
+#endif
+
+#define LOG_LEVEL(level, caller_errno, format, ... ) do { if(LOGERR_LEVEL >= (level)) log_error(caller_errno, log_pc(), format, ##__VA_ARGS__); } while(0)
 
-#define LOG_MESSAGE(fmt, ...) LOG_ERROR(fmt, ##__VA_ARGS__)
+#define LOG_ERROR(format, ... ) LOG_LEVEL(LOGERR_LEVEL_ERROR,     0, format, ##__VA_ARGS__)
+#define LOG_ERRNO(format, ... ) LOG_LEVEL(LOGERR_LEVEL_ERROR, errno, format, ##__VA_ARGS__)
 
+#define LOG_MESSAGE(fmt, ...) LOG_LEVEL(LOGERR_LEVEL_MESSAGE, 0, fmt, ##__VA_ARGS__)
+/* Once per buffer or event, too often for the default level */
+#define LOG_DEBUG(fmt, ...)   LOG_LEVEL(LOGERR_LEVEL_DEBUG,   0, fmt, ##__VA_ARGS__)
+
+/* Called with every message from the writer thread */
 extern void (*logerr)(const char * const message);
 
 const void * const log_pc(void);
 
+/* The message is formatted by the caller into a lock-free ring and written
+ * to stderr by a background thread, so the caller never waits for stderr */
 __attribute__((format(printf,3,4)))
 void log_error(int caller_errno, const void * const addr, const char * const format, ... );
 
+/* Waits until all the messages logged so far are written */
+void log_flush(void);
+
 #endif
@@ -1,125 +1,183 @@
-#include <unistd.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-#include <time.h>
-#include <signal.h>
-
-#include "omx.h"
-
-#include "logerr.h"
-#include "omx_still.h"
-
-uint8_t jpeg1[10000000];
-uint8_t jpeg2[10000000];
-
-size_t position1 = 0;
-size_t position2 = 0;
-
-void buffering1(const uint8_t * const buffer, size_t length)
-{
-    LOG_MESSAGE("Buffer 1 Received %zd at position %zd", length, position1);
-
-    if(length > sizeof(jpeg1)-position1)
-    {
-        LOG_ERROR("Buffer1 overflow %zd %zd", position1, length);
-        length = sizeof(jpeg1)-position1;
-    }
-
-    memcpy(&jpeg1[position1], buffer, length);
-
-    position1 += length;
-}
-
-void buffering2(const uint8_t * const buffer, size_t length)
-{
-    LOG_MESSAGE("Buffer 2 Received %zd at position %zd", length, position2);
-
-    if(length > sizeof(jpeg2)-position2)
-    {
-        LOG_ERROR("Buffer2 overflow %zd %zd", position2, length);
-        length = sizeof(jpeg2)-position2;
-    }
-
-    memcpy(&jpeg2[position2], buffer, length);
-
-    position2 += length;
-}
-
-void buffering(const uint32_t frame, const uint8_t * const buffer, size_t length)
-{
-    switch(frame)
-    {
-        case 0: buffering1(buffer, length); break;
-        case 1: buffering2(buffer, length); break;
-        default: LOG_ERROR("Unexpected frame %d", frame); break;
-    }
-}
-
-WARN_UNUSED enum error_code write_file(const char * const filename, const uint8_t * const buffer, const size_t length)
-{
-    //Open the file
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
-    if(fd == -1)
-    {
-        LOG_ERRNO("open %s", filename);
-        return ERROR;
-    }
-
-    //Append the buffer into the file
-    if(write(fd, buffer, length) == -1)
-    {
-        LOG_ERRNO("write %s %zu", filename, length);
-        return ERROR;
-    }
-
-    //Close the file
-    if(close(fd))
-    {
-        LOG_ERRNO("close %s", filename);
-        return ERROR;
-    }
-
-    return OK;
-}
-
-int main()
-{
-    enum error_code result;
-
-    struct camera_shot_configuration config = {
-        .shutterSpeed = 50000,
-        .iso          = 100,
-        .redGain      = 1000,
-        .blueGain     = 1000,
-        .quality      = 50,
-        .sharpness    = 0,
-        .contrast     = 0,
-        .brightness   = 50,
-        .saturation   = 0,
-        .drc          = OMX_DynRangeExpOff,
-        .whiteBalance = OMX_WhiteBalControlOff
-    };
-
-    position1 = 0;
-    position2 = 0;
-
-    config.iso = 100;
-
-    result = omx_still_open(config);        if(result!=OK) { return result; }
-    result = omx_still_shoot(1, buffering); if(result!=OK) { return result; }
-    result = omx_still_close();             if(result!=OK) { return result; }
-    result = write_file("/tmp/1.jpg", jpeg1, position1); if(result!=OK) { return result; }
-
-    position1 = 0;
-    position2 = 0;
-
-    config.iso = 200;
-
-    result = omx_still_open(config);        if(result!=OK) { return result; }
-    result = omx_still_shoot(1, buffering); if(result!=OK) { return result; }
-    result = write_file("/tmp/2.jpg", jpeg1, position1); if(result!=OK) { return result; }
-
-    return OK;
-}
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+
+#include "omx.h"
+
+#include "logerr.h"
+#include "omx_still.h"
+#include "frame_sink.h"
+#include "file_sink.h"
+#include "frame_writer.h"
+#include "archive.h"
+
+//Where the frames go, numbered from 1
+#define FRAME_FILES "/tmp/%u.jpg"
+
+//Memory of the frames received and not written yet
+#define FRAME_CHUNK_SIZE (256*1024)
+#define FRAME_MEMORY_MAX (32*1024*1024)
+
+static const char* const sync_modes[] =
+{
+    [FILE_SYNC_NONE]      = "none",
+    [FILE_SYNC_FDATASYNC] = "fdatasync",
+    [FILE_SYNC_RANGE]     = "range"
+};
+
+//Hands the frames of the shot to the writer, the next shot does not wait
+//for them
+static WARN_UNUSED
+enum error_code queue_frames(frame_sink_t* sink, frame_writer_t* writer)
+{
+    enum error_code result;
+    frame_t* frame;
+
+    result = frame_sink_finish(sink); if(result!=OK) { return result; }
+
+    while((frame = frame_sink_take(sink)))
+    {
+        result = frame_writer_queue(writer, frame); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+//Shoots a frame. Streamed, its slices are written by the file sink as they
+//arrive. Otherwise the frame is collected by the sink and queued to the
+//writer
+static WARN_UNUSED
+enum error_code shoot(still_session* session, file_sink_t* file_sink, frame_sink_t* sink, frame_writer_t* writer)
+{
+    enum error_code result;
+
+    if(file_sink)
+    {
+        result = omx_still_shoot(session, 1, file_sink_receive, file_sink); if(result!=OK) { return result; }
+
+        return file_sink_finish(file_sink);
+    }
+
+    result = omx_still_shoot(session, 1, frame_sink_receive, sink); if(result!=OK) { return result; }
+
+    return queue_frames(sink, writer);
+}
+
+//The archived frames carry the configuration of their shot
+_Static_assert(sizeof(struct camera_shot_configuration) <= FRAME_INFO_SIZE, "configuration larger than the info of a frame");
+
+//Usage: camera-app [none|fdatasync|range] [archive|-s], how durable every
+//file is once written (see file_sink.h), none by default. The files are
+//written from a thread of their own (see frame_writer.h). Given the base
+//name of an archive, the frames are appended to it (see archive.h) instead
+//of their own files. With -s the slices are written as they arrive, from
+//the thread of the session, without keeping the frames in memory
+int main(int argc, char** argv)
+{
+    enum error_code result;
+
+    file_sync_mode sync = FILE_SYNC_NONE;
+
+    if(argc > 1)
+    {
+        for(sync=0; sync<sizeof(sync_modes)/sizeof(sync_modes[0]); sync++)
+        {
+            if(strcmp(argv[1], sync_modes[sync]) == 0)
+                break;
+        }
+
+        if(sync == sizeof(sync_modes)/sizeof(sync_modes[0]))
+        {
+            fprintf(stderr, "usage: %s [none|fdatasync|range] [archive|-s]\n", argv[0]);
+            return ERROR;
+        }
+    }
+
+    struct camera_shot_configuration config = {
+        .shutterSpeed = 50000,
+        .iso          = 100,
+        .redGain      = 1000,
+        .blueGain     = 1000,
+        .quality      = 50,
+        .sharpness    = 0,
+        .contrast     = 0,
+        .brightness   = 50,
+        .saturation   = 0,
+        .drc          = OMX_DynRangeExpOff,
+        .whiteBalance = OMX_WhiteBalControlOff,
+        //Full sensor frame, portrait
+        .rotation     = 90
+    };
+
+    still_session* session;
+    frame_pool_t pool;
+    frame_sink_t sink;
+    frame_writer_t writer;
+    archive_t archive;
+    file_sink_t streamed;
+
+    bool stream = argc > 2 && strcmp(argv[2], "-s") == 0;
+
+    const char* archive_base = argc > 2 && !stream ? argv[2] : NULL;
+    file_sink_t* file_sink = stream ? &streamed : NULL;
+
+    result = frame_pool_init(&pool, FRAME_CHUNK_SIZE, FRAME_MEMORY_MAX); if(result!=OK) { return result; }
+    frame_sink_init(&sink, &pool);
+
+    if(stream)
+    {
+        result = file_sink_init(&streamed, FRAME_FILES, 1, sync); if(result!=OK) { return result; }
+    }
+    else if(archive_base)
+    {
+        result = archive_open(&archive, archive_base, 0, sync);                     if(result!=OK) { return result; }
+        result = frame_writer_start_archive(&writer, &pool, &archive, NULL, NULL); if(result!=OK) { return result; }
+    }
+    else
+    {
+        result = frame_writer_start(&writer, &pool, FRAME_FILES, 1, sync, NULL, NULL); if(result!=OK) { return result; }
+    }
+
+    config.iso = 100;
+
+    frame_sink_info(&sink, &config, sizeof(config));
+
+    result = omx_still_open(config, &session);                if(result!=OK) { return result; }
+    result = shoot(session, file_sink, &sink, &writer);       if(result!=OK) { return result; }
+
+    config.iso = 200;
+
+    frame_sink_info(&sink, &config, sizeof(config));
+
+    //The pipeline is kept open, only the changed settings are applied. The
+    //first frame is written meanwhile
+    result = omx_still_reconfigure(session, config);          if(result!=OK) { return result; }
+    result = shoot(session, file_sink, &sink, &writer);       if(result!=OK) { return result; }
+
+    result = omx_still_close(session);                        if(result!=OK) { return result; }
+
+    if(stream)
+    {
+        file_sink_deinit(&streamed);
+    }
+    else
+    {
+        result = frame_writer_flush(&writer); if(result!=OK) { return result; }
+
+        frame_writer_stop(&writer);
+    }
+
+    if(archive_base)
+    {
+        result = archive_close(&archive); if(result!=OK) { return result; }
+    }
+
+    frame_sink_deinit(&sink);
+    frame_pool_deinit(&pool);
+
+    return OK;
+}
@@ -170,6 +170,28 @@ omx_allocate_buffer(
 
 /*****************************************************************************/
 
+enum error_code
+omx_use_buffer(
+        OMX_IN    OMX_HANDLETYPE         hComponent,
+        OMX_INOUT OMX_BUFFERHEADERTYPE **ppBuffer,
+        OMX_IN    OMX_U32                nPortIndex,
+        OMX_IN    OMX_PTR                pAppPrivate,
+        OMX_IN    OMX_U32                nSizeBytes,
+        OMX_IN    OMX_U8                *pBuffer)
+{
+    OMX_ERRORTYPE result_omx = OMX_UseBuffer(hComponent, ppBuffer, nPortIndex, pAppPrivate, nSizeBytes, pBuffer);
+
+    if(result_omx != OMX_ErrorNone)
+    {
+        LOG_ERROR("OMX_UseBuffer: port %d %d (%s)", nPortIndex, nSizeBytes, dump_OMX_ERRORTYPE(result_omx));
+        return ERROR;
+    }
+
+    return OK;
+}
+
+/*****************************************************************************/
+
 enum error_code
 omx_free_buffer(
         OMX_IN OMX_HANDLETYPE        hComponent,
@@ -84,6 +84,17 @@ omx_allocate_buffer(
 
 /*****************************************************************************/
 
+WARN_UNUSED enum error_code
+omx_use_buffer(
+        OMX_IN    OMX_HANDLETYPE         hComponent,
+        OMX_INOUT OMX_BUFFERHEADERTYPE **ppBuffer,
+        OMX_IN    OMX_U32                nPortIndex,
+        OMX_IN    OMX_PTR                pAppPrivate,
+        OMX_IN    OMX_U32                nSizeBytes,
+        OMX_IN    OMX_U8                *pBuffer);
+
+/*****************************************************************************/
+
 WARN_UNUSED enum error_code
 omx_free_buffer(
         OMX_IN OMX_HANDLETYPE        hComponent,
@@ -1,9 +1,18 @@
 #include "omx_component.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "omx.h"
 #include "omx_config.h"
 #include "omx_parameter.h"
 #include "dump.h"
+#include "latency.h"
 
 //Function that is called when a component receives an event from a secondary
 //thread
@@ -21,21 +30,21 @@ OMX_ERRORTYPE event_handler(OMX_IN OMX_HANDLETYPE comp,
         case OMX_EventCmdComplete:
             switch(data1)
             {
-                case OMX_CommandStateSet:    wake(component, EVENT_STATE_SET   ); LOG_MESSAGE_EVENT(component, EVENT_STATE_SET,    "state: %s", dump_OMX_STATETYPE (data2)); break;
-                case OMX_CommandPortDisable: wake(component, EVENT_PORT_DISABLE); LOG_MESSAGE_EVENT(component, EVENT_PORT_DISABLE, "port: %d",  data2); break;
-                case OMX_CommandPortEnable:  wake(component, EVENT_PORT_ENABLE ); LOG_MESSAGE_EVENT(component, EVENT_PORT_ENABLE,  "port: %d",  data2); break;
-                case OMX_CommandFlush:       wake(component, EVENT_FLUSH       ); LOG_MESSAGE_EVENT(component, EVENT_FLUSH,        "port: %d",  data2); break;
-                case OMX_CommandMarkBuffer:  wake(component, EVENT_MARK_BUFFER ); LOG_MESSAGE_EVENT(component, EVENT_MARK_BUFFER,  "port: %d",  data2); break;
+                case OMX_CommandStateSet:    post_event(component, EVENT_STATE_SET,    data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_STATE_SET,    "state: %s", dump_OMX_STATETYPE (data2)); break;
+                case OMX_CommandPortDisable: post_event(component, EVENT_PORT_DISABLE, data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_PORT_DISABLE, "port: %d",  data2); break;
+                case OMX_CommandPortEnable:  post_event(component, EVENT_PORT_ENABLE,  data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_PORT_ENABLE,  "port: %d",  data2); break;
+                case OMX_CommandFlush:       post_event(component, EVENT_FLUSH,        data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_FLUSH,        "port: %d",  data2); break;
+                case OMX_CommandMarkBuffer:  post_event(component, EVENT_MARK_BUFFER,  data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_MARK_BUFFER,  "port: %d",  data2); break;
             }
             break;
 
-        case OMX_EventError:                     wake(component, EVENT_ERROR                      ); LOG_ERROR_EVENT  (component, EVENT_ERROR,                       "%s",       dump_OMX_ERRORTYPE(data1)); break;
-        case OMX_EventMark:                      wake(component, EVENT_MARK                       ); LOG_MESSAGE_EVENT(component, EVENT_MARK,                        ""                                   ); break;
-        case OMX_EventPortSettingsChanged:       wake(component, EVENT_PORT_SETTINGS_CHANGED      ); LOG_MESSAGE_EVENT(component, EVENT_PORT_SETTINGS_CHANGED,       "port: %d",             data1        ); break;
-        case OMX_EventParamOrConfigChanged:      wake(component, EVENT_PARAM_OR_CONFIG_CHANGED    ); LOG_MESSAGE_EVENT(component, EVENT_PARAM_OR_CONFIG_CHANGED,     "data1: %d, data2: %X", data1, data2 ); break;
-        case OMX_EventBufferFlag:                wake(component, EVENT_BUFFER_FLAG                ); LOG_MESSAGE_EVENT(component, EVENT_BUFFER_FLAG,                 "port: %d",             data1        ); break;
-        case OMX_EventResourcesAcquired:         wake(component, EVENT_RESOURCES_ACQUIRED         ); LOG_MESSAGE_EVENT(component, EVENT_RESOURCES_ACQUIRED,          ""                                   ); break;
-        case OMX_EventDynamicResourcesAvailable: wake(component, EVENT_DYNAMIC_RESOURCES_AVAILABLE); LOG_MESSAGE_EVENT(component, EVENT_DYNAMIC_RESOURCES_AVAILABLE, ""                                   ); break;
+        case OMX_EventError:                     post_event(component, EVENT_ERROR,                       data1, data2, 0); LOG_ERROR_EVENT  (component, EVENT_ERROR,                       "%s",       dump_OMX_ERRORTYPE(data1)); break;
+        case OMX_EventMark:                      post_event(component, EVENT_MARK,                        data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_MARK,                        ""                                   ); break;
+        case OMX_EventPortSettingsChanged:       forget_port_definitions(component); post_event(component, EVENT_PORT_SETTINGS_CHANGED,       data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_PORT_SETTINGS_CHANGED,       "port: %d",             data1        ); break;
+        case OMX_EventParamOrConfigChanged:      post_event(component, EVENT_PARAM_OR_CONFIG_CHANGED,     data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_PARAM_OR_CONFIG_CHANGED,     "data1: %d, data2: %X", data1, data2 ); break;
+        case OMX_EventBufferFlag:                post_event(component, EVENT_BUFFER_FLAG,                 data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_BUFFER_FLAG,                 "port: %d",             data1        ); break;
+        case OMX_EventResourcesAcquired:         post_event(component, EVENT_RESOURCES_ACQUIRED,          data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_RESOURCES_ACQUIRED,          ""                                   ); break;
+        case OMX_EventDynamicResourcesAvailable: post_event(component, EVENT_DYNAMIC_RESOURCES_AVAILABLE, data1, data2, 0); LOG_MESSAGE_EVENT(component, EVENT_DYNAMIC_RESOURCES_AVAILABLE, ""                                   ); break;
 
         default:
             //This should never execute, just ignore
@@ -53,40 +62,393 @@ OMX_ERRORTYPE fill_buffer_done(OMX_IN OMX_HANDLETYPE comp,
 {
     component_t* component = (component_t*)app_data;
 
-    wake(component, EVENT_FILL_BUFFER_DONE);
-    LOG_MESSAGE_COMPONENT(component, "fill_buffer_done");
+    LOG_DEBUG_COMPONENT(component, "fill_buffer_done");
+
+    if(__atomic_load_n(&component->ring_enabled, __ATOMIC_ACQUIRE))
+    {
+        unsigned head = component->ring_head;
+
+        //Never full, a port has fewer buffers than slots
+        if(head - __atomic_load_n(&component->ring_tail, __ATOMIC_ACQUIRE) < COMPONENT_RING_SIZE)
+        {
+            ring_slot_t* slot = &component->ring[head % COMPONENT_RING_SIZE];
+
+            slot->buffer = buffer;
+            slot->time   = latency_now();
+
+            __atomic_store_n(&component->ring_head, head + 1, __ATOMIC_RELEASE);
+            sem_post(&component->ring_ready);
+
+            return OMX_ErrorNone;
+        }
+
+        LOG_ERROR_COMPONENT(component, "buffer ring full, buffer sent to the event queue");
+    }
+
+    post_event(component, EVENT_FILL_BUFFER_DONE, 0, 0, buffer);
 
     return OMX_ErrorNone;
 }
 
-void wake(component_t* component, VCOS_UNSIGNED event)
+//Removes the event at the given position of the queue. Must be called with
+//the lock held
+static void remove_event(component_t* component, unsigned position)
 {
-    vcos_event_flags_set(&component->flags, event, VCOS_OR);
+    for(; position+1 < component->events_count; position++)
+    {
+        component->events[(component->events_head + position    ) % COMPONENT_EVENTS_MAX] =
+        component->events[(component->events_head + position + 1) % COMPONENT_EVENTS_MAX];
+    }
+
+    component->events_count--;
 }
 
-enum error_code wait(component_t* component, VCOS_UNSIGNED events, VCOS_UNSIGNED* retrieved_events)
+//The data that wait_for() compares: the port or the state for the command
+//completions, the index for the parameter changes, data1 for the rest
+static OMX_U32 event_key(const event_t* event)
 {
-    VCOS_UNSIGNED set;
-    VCOS_STATUS_T result_vcos;
+    switch(event->event)
+    {
+        case EVENT_STATE_SET:
+        case EVENT_PORT_ENABLE:
+        case EVENT_PORT_DISABLE:
+        case EVENT_FLUSH:
+        case EVENT_MARK_BUFFER:
+        case EVENT_PARAM_OR_CONFIG_CHANGED:
+            return event->data2;
+
+        default:
+            return event->data1;
+    }
+}
 
-    result_vcos = vcos_event_flags_get(&component->flags, events | EVENT_ERROR, VCOS_OR_CONSUME, VCOS_SUSPEND, &set);
-    if(result_vcos!=VCOS_SUCCESS)
+//Name of the series the completions of the event are recorded in
+static const char* operation_name(component_event event)
+{
+    switch(event)
     {
-        LOG_ERROR_COMPONENT(component, "vcos_event_flags_get (%d)", result_vcos);
-        return ERROR;
+        case EVENT_STATE_SET:               return "change_state";
+        case EVENT_PORT_ENABLE:             return "enable_port";
+        case EVENT_PORT_DISABLE:            return "disable_port";
+        case EVENT_FLUSH:                   return "flush_port";
+        case EVENT_PARAM_OR_CONFIG_CHANGED: return "load_drivers";
+        case EVENT_FILL_BUFFER_DONE:        return "fill_buffer";
+        default:                            return "unknown";
+    }
+}
+
+//Starts timing a command or a buffer. Must be called before it is sent, the
+//completion can arrive before the OMX call returns
+static void start_timing(component_t* component, component_event event, OMX_U32 key, OMX_BUFFERHEADERTYPE* buffer)
+{
+    pthread_mutex_lock(&component->lock);
+
+    if(component->pending_count < COMPONENT_PENDING_MAX)
+    {
+        pending_t* pending = &component->pending[component->pending_count++];
+
+        pending->event  = event;
+        pending->key    = key;
+        pending->buffer = buffer;
+        pending->start  = latency_now();
+    }
+    else
+    {
+        LOG_ERROR_COMPONENT(component, "too many pending commands, %s %d not timed", operation_name(event), key);
+    }
+
+    pthread_mutex_unlock(&component->lock);
+}
+
+//Finds and removes the pending command or buffer the event completes, that
+//arrived at the given time. Returns the time it took in microseconds, or -1
+//if it was not being timed. Must be called with the lock held
+static int64_t stop_timing(component_t* component, const event_t* event, uint64_t now, OMX_U32* key)
+{
+    unsigned i;
+    for(i=0; i<component->pending_count; i++)
+    {
+        pending_t* pending = &component->pending[i];
+
+        if(pending->event != event->event)
+            continue;
+
+        if(pending->buffer ? pending->buffer != event->buffer : pending->key != event_key(event))
+            continue;
+
+        int64_t elapsed = now - pending->start;
+        *key = pending->key;
+
+        component->pending[i] = component->pending[--component->pending_count];
+
+        return elapsed;
+    }
+
+    return -1;
+}
+
+//Forgets the timing of a command or buffer that could not be sent
+static void cancel_timing(component_t* component, component_event event, OMX_U32 key, OMX_BUFFERHEADERTYPE* buffer)
+{
+    event_t sent = { event, key, key, buffer };
+    OMX_U32 ignored;
+
+    pthread_mutex_lock(&component->lock);
+    stop_timing(component, &sent, latency_now(), &ignored);
+    pthread_mutex_unlock(&component->lock);
+}
+
+void post_event(component_t* component, component_event event, OMX_U32 data1, OMX_U32 data2, OMX_BUFFERHEADERTYPE* buffer)
+{
+    pthread_mutex_lock(&component->lock);
+
+    if(component->events_count == COMPONENT_EVENTS_MAX)
+    {
+        //Nobody is consuming the events. Drop the oldest one that does not
+        //carry a buffer, losing a buffer would stall the port
+        unsigned i;
+        for(i=0; i<component->events_count; i++)
+        {
+            event_t* oldest = &component->events[(component->events_head + i) % COMPONENT_EVENTS_MAX];
+
+            if(!oldest->buffer)
+            {
+                LOG_ERROR_COMPONENT(component, "event queue full, dropping event %X (%X, %X)", oldest->event, oldest->data1, oldest->data2);
+                remove_event(component, i);
+                break;
+            }
+        }
+    }
+
+    if(component->events_count < COMPONENT_EVENTS_MAX)
+    {
+        event_t* slot = &component->events[(component->events_head + component->events_count) % COMPONENT_EVENTS_MAX];
+
+        slot->event  = event;
+        slot->data1  = data1;
+        slot->data2  = data2;
+        slot->buffer = buffer;
+
+        component->events_count++;
+    }
+    else
+    {
+        //This should never execute, there are never more buffers than slots
+        LOG_ERROR_COMPONENT(component, "event queue full of buffers, dropping event %X", event);
+    }
+
+    //Buffers returned empty by a flush or a port disable are not timed, they
+    //were never filled
+    event_t posted = { event, data1, data2, buffer };
+    OMX_U32 key;
+    int64_t elapsed = stop_timing(component, &posted, latency_now(), &key);
+
+    int notify_fd = component->notify_fd;
+
+    pthread_cond_broadcast(&component->cond);
+
+    pthread_mutex_unlock(&component->lock);
+
+    if(elapsed >= 0 && !(buffer && buffer->nFilledLen == 0))
+    {
+        latency_record(component->name, operation_name(event), key, elapsed);
+    }
+
+    if(notify_fd >= 0)
+    {
+        uint64_t one = 1;
+
+        //Only fails if the counter is about to overflow, it is readable then
+        if(write(notify_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+            LOG_ERRNO("write notify_fd");
+    }
+}
+
+//Blocks until an event of the given kinds (and data or buffer, if not any) is
+//queued and consumes it. Any queued error is consumed and makes the wait fail.
+//If not block, returns AGAIN instead of waiting
+static WARN_UNUSED
+enum error_code wait_match(component_t* component, uint32_t events, OMX_U32 data, OMX_BUFFERHEADERTYPE* buffer, bool block, event_t* retrieved)
+{
+    //The condition uses the monotonic clock, see init_component()
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    deadline.tv_sec  += component->timeout_ms / 1000;
+    deadline.tv_nsec += (component->timeout_ms % 1000) * 1000000;
+
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&component->lock);
+
+    while(1)
+    {
+        unsigned i;
+        for(i=0; i<component->events_count; i++)
+        {
+            event_t* event = &component->events[(component->events_head + i) % COMPONENT_EVENTS_MAX];
+
+            if(event->event == EVENT_ERROR)
+            {
+                // EVENT_ERROR already log the error
+                remove_event(component, i);
+                pthread_mutex_unlock(&component->lock);
+                return ERROR;
+            }
+
+            if(!(event->event & events))
+                continue;
+
+            if(data != EVENT_DATA_ANY && event_key(event) != data)
+                continue;
+
+            if(buffer && event->buffer != buffer)
+                continue;
+
+            if(retrieved)
+            {
+                *retrieved = *event;
+            }
+
+            remove_event(component, i);
+            pthread_mutex_unlock(&component->lock);
+            return OK;
+        }
+
+        if(!block)
+        {
+            pthread_mutex_unlock(&component->lock);
+            return AGAIN;
+        }
+
+        if(component->timeout_ms == 0)
+        {
+            pthread_cond_wait(&component->cond, &component->lock);
+        }
+        else if(pthread_cond_timedwait(&component->cond, &component->lock, &deadline) == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&component->lock);
+            LOG_ERROR_COMPONENT(component, "timeout after %d ms waiting for events %X, data %X", component->timeout_ms, events, data);
+            return TIMEOUT;
+        }
+    }
+}
+
+enum error_code wait(component_t* component, uint32_t events, event_t* retrieved)
+{
+    return wait_match(component, events, EVENT_DATA_ANY, 0, true, retrieved);
+}
+
+enum error_code wait_for(component_t* component, uint32_t events, OMX_U32 data, event_t* retrieved)
+{
+    return wait_match(component, events, data, 0, true, retrieved);
+}
+
+enum error_code wait_buffer(component_t* component, OMX_BUFFERHEADERTYPE* buffer, OMX_BUFFERHEADERTYPE** retrieved)
+{
+    enum error_code result;
+    event_t event;
+
+    result = wait_match(component, EVENT_FILL_BUFFER_DONE | EVENT_EMPTY_BUFFER_DONE, EVENT_DATA_ANY, buffer, true, &event); if(result!=OK) { return result; }
+
+    if(retrieved)
+    {
+        *retrieved = event.buffer;
     }
 
-    if(set == EVENT_ERROR)
+    return OK;
+}
+
+enum error_code try_wait(component_t* component, uint32_t events, event_t* retrieved)
+{
+    return wait_match(component, events, EVENT_DATA_ANY, 0, false, retrieved);
+}
+
+enum error_code try_wait_for(component_t* component, uint32_t events, OMX_U32 data, event_t* retrieved)
+{
+    return wait_match(component, events, data, 0, false, retrieved);
+}
+
+void set_notify_fd(component_t* component, int fd)
+{
+    pthread_mutex_lock(&component->lock);
+    component->notify_fd = fd;
+    pthread_mutex_unlock(&component->lock);
+}
+
+enum error_code enable_buffer_ring(component_t* component)
+{
+    component->ring_head     = 0;
+    component->ring_tail     = 0;
+    component->ring_stopping = 0;
+
+    if(sem_init(&component->ring_ready, 0, 0))
     {
-        // EVENT_ERROR already log the error
+        LOG_ERRNO("sem_init");
         return ERROR;
     }
 
-    if(retrieved_events)
+    //From now on the callback uses the ring
+    __atomic_store_n(&component->ring_enabled, 1, __ATOMIC_RELEASE);
+
+    return OK;
+}
+
+void stop_buffer_ring(component_t* component)
+{
+    __atomic_store_n(&component->ring_stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&component->ring_ready);
+}
+
+void disable_buffer_ring(component_t* component)
+{
+    __atomic_store_n(&component->ring_enabled, 0, __ATOMIC_RELEASE);
+    sem_destroy(&component->ring_ready);
+}
+
+enum error_code take_buffer(component_t* component, OMX_BUFFERHEADERTYPE** buffer)
+{
+    while(sem_wait(&component->ring_ready))
+    {
+        if(errno != EINTR)
+        {
+            LOG_ERRNO("sem_wait");
+            return ERROR;
+        }
+    }
+
+    if(__atomic_load_n(&component->ring_stopping, __ATOMIC_ACQUIRE))
     {
-        *retrieved_events = set;
+        *buffer = NULL;
+        return OK;
     }
 
+    unsigned tail = component->ring_tail;
+
+    //Every post follows a push, the slot is there
+    ring_slot_t slot = component->ring[tail % COMPONENT_RING_SIZE];
+
+    __atomic_store_n(&component->ring_tail, tail + 1, __ATOMIC_RELEASE);
+
+    //Timed as when the callback received it, not when it was taken
+    event_t taken = { EVENT_FILL_BUFFER_DONE, 0, 0, slot.buffer };
+    OMX_U32 key;
+
+    pthread_mutex_lock(&component->lock);
+    int64_t elapsed = stop_timing(component, &taken, slot.time, &key);
+    pthread_mutex_unlock(&component->lock);
+
+    if(elapsed >= 0 && slot.buffer->nFilledLen)
+    {
+        latency_record(component->name, operation_name(EVENT_FILL_BUFFER_DONE), key, elapsed);
+    }
+
+    *buffer = slot.buffer;
+
     return OK;
 }
 
@@ -94,15 +456,36 @@ enum error_code init_component(component_t* component)
 {
     LOG_MESSAGE_COMPONENT(component, "initializing component");
 
-    VCOS_STATUS_T result_vcos;
     OMX_ERRORTYPE result_omx;
     enum error_code result;
+    int result_pthread;
+
+    //Create the event queue
+    component->events_head      = 0;
+    component->events_count     = 0;
+    component->pending_count    = 0;
+    component->timeout_ms       = COMPONENT_TIMEOUT_MS;
+    component->notify_fd        = -1;
+    component->ports_count      = 0;
+    component->ports_generation = 0;
 
-    //Create the event flags
-    result_vcos = vcos_event_flags_create(&component->flags, "component");
-    if(result_vcos!=VCOS_SUCCESS)
+    result_pthread = pthread_mutex_init(&component->lock, NULL);
+    if(result_pthread!=0)
     {
-        LOG_ERROR_COMPONENT(component, "vcos_event_flags_create (%d)", result_vcos);
+        LOG_ERROR_COMPONENT(component, "pthread_mutex_init (%d)", result_pthread);
+        return ERROR;
+    }
+
+    //The timed waits must not be affected by changes of the wall clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+    result_pthread = pthread_cond_init(&component->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR_COMPONENT(component, "pthread_cond_init (%d)", result_pthread);
         return ERROR;
     }
 
@@ -128,20 +511,30 @@ enum error_code init_component(component_t* component)
         OMX_IndexParamOtherInit
     };
 
-    OMX_PORT_PARAM_TYPE ports_st; OMX_INIT_STRUCTURE (ports_st);
+    //The commands are sent to all the ports first and then all the completions
+    //are awaited, the ports are disabled at the same time
+    OMX_PORT_PARAM_TYPE ports_st[4];
 
     int i;
     for(i=0; i<4; i++)
     {
-        result = omx_get_parameter(component->handle, types[i], &ports_st); if(result!=OK) { return result; }
+        OMX_INIT_STRUCTURE (ports_st[i]);
+
+        result = omx_get_parameter(component->handle, types[i], &ports_st[i]); if(result!=OK) { return result; }
 
         OMX_U32 port;
-        for(port=ports_st.nStartPortNumber; port<ports_st.nStartPortNumber + ports_st.nPorts; port++)
+        for(port=ports_st[i].nStartPortNumber; port<ports_st[i].nStartPortNumber + ports_st[i].nPorts; port++)
         {
-            //Disable the port
             result = disable_port(component, port); if(result!=OK) { return result; }
-            //Wait to the event
-            result = wait(component, EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
+        }
+    }
+
+    for(i=0; i<4; i++)
+    {
+        OMX_U32 port;
+        for(port=ports_st[i].nStartPortNumber; port<ports_st[i].nStartPortNumber + ports_st[i].nPorts; port++)
+        {
+            result = wait_for(component, EVENT_PORT_DISABLE, port, 0); if(result!=OK) { return result; }
         }
     }
 
@@ -152,12 +545,16 @@ enum error_code deinit_component(component_t* component)
 {
     LOG_MESSAGE_COMPONENT(component, "deinit_component");
 
-    vcos_event_flags_delete(&component->flags);
+    pthread_cond_destroy(&component->cond);
+    pthread_mutex_destroy(&component->lock);
+
+    //A new component can get the same handle
+    omx_config_forget(component->handle);
 
     return omx_free_handle(component->handle);
 }
 
-enum error_code load_camera_drivers(component_t* component)
+enum error_code load_camera_drivers(component_t* component, OMX_U32 camera)
 {
     /*
        This is a specific behaviour of the Broadcom's Raspberry Pi OpenMAX IL
@@ -171,61 +568,530 @@ enum error_code load_camera_drivers(component_t* component)
        The red LED of the camera will be turned on after this call.
        */
 
-    LOG_MESSAGE_COMPONENT(component, "load_camera_drivers");
+    LOG_MESSAGE_COMPONENT(component, "load_camera_drivers %d", camera);
 
     enum error_code result;
 
     result = omx_config_request_callback(component->handle, OMX_ALL, OMX_IndexParamCameraDeviceNumber, OMX_TRUE); if(result!=OK) { return result; }
-    result = omx_parameter_camera_device_number(component->handle, OMX_ALL, 0); if(result!=OK) { return result; }
 
-    return wait(component, EVENT_PARAM_OR_CONFIG_CHANGED, 0);
+    start_timing(component, EVENT_PARAM_OR_CONFIG_CHANGED, OMX_IndexParamCameraDeviceNumber, 0);
+
+    result = omx_parameter_camera_device_number(component->handle, OMX_ALL, camera);
+    if(result!=OK)
+    {
+        cancel_timing(component, EVENT_PARAM_OR_CONFIG_CHANGED, OMX_IndexParamCameraDeviceNumber, 0);
+        return result;
+    }
+
+    return wait_for(component, EVENT_PARAM_OR_CONFIG_CHANGED, OMX_IndexParamCameraDeviceNumber, 0);
+}
+
+//Sends a command and starts timing it until its completion event
+static WARN_UNUSED
+enum error_code send_command(component_t* component, OMX_COMMANDTYPE command, component_event event, OMX_U32 param)
+{
+    enum error_code result;
+
+    start_timing(component, event, param, 0);
+
+    result = omx_send_command(component->handle, command, param, 0);
+    if(result!=OK)
+    {
+        cancel_timing(component, event, param, 0);
+    }
+
+    return result;
 }
 
 enum error_code change_state(component_t* component, OMX_STATETYPE state)
 {
     LOG_MESSAGE_COMPONENT(component, "change_state to %s", dump_OMX_STATETYPE (state));
 
-    return omx_send_command(component->handle, OMX_CommandStateSet, state, 0);
+    return send_command(component, OMX_CommandStateSet, EVENT_STATE_SET, state);
 }
 
 enum error_code enable_port(component_t* component, OMX_U32 port)
 {
     LOG_MESSAGE_COMPONENT(component, "enable_port %d", port);
 
-    return omx_send_command(component->handle, OMX_CommandPortEnable, port, 0);
+    return send_command(component, OMX_CommandPortEnable, EVENT_PORT_ENABLE, port);
 }
 
 enum error_code disable_port(component_t* component, OMX_U32 port)
 {
     LOG_MESSAGE_COMPONENT(component, "disable_port %d", port);
 
-    return omx_send_command(component->handle, OMX_CommandPortDisable, port, 0);
+    return send_command(component, OMX_CommandPortDisable, EVENT_PORT_DISABLE, port);
+}
+
+enum error_code flush_port(component_t* component, OMX_U32 port)
+{
+    LOG_MESSAGE_COMPONENT(component, "flush_port %d", port);
+
+    return send_command(component, OMX_CommandFlush, EVENT_FLUSH, port);
 }
 
-enum error_code port_enable_allocate_buffer(component_t* component, OMX_BUFFERHEADERTYPE** buffer, OMX_U32 port)
+enum error_code change_state_all(component_t* const* components, unsigned count, OMX_STATETYPE state)
 {
-    //The port is not enabled until the buffer is allocated
+    //Every component makes its transition meanwhile the others do, it takes as
+    //long as the slowest one instead of the sum of all
+    enum error_code result;
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        result = change_state(components[i], state); if(result!=OK) { return result; }
+    }
+
+    for(i=0; i<count; i++)
+    {
+        result = wait_for(components[i], EVENT_STATE_SET, state, 0); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+enum error_code enable_ports(const component_port_t* ports, unsigned count)
+{
+    //Both ends of a tunnel must be in the same call, the enable of a tunneled
+    //port does not complete until the other end is enabled too
+    enum error_code result;
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        result = enable_port(ports[i].component, ports[i].port); if(result!=OK) { return result; }
+    }
+
+    for(i=0; i<count; i++)
+    {
+        result = wait_for(ports[i].component, EVENT_PORT_ENABLE, ports[i].port, 0); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+enum error_code disable_ports(const component_port_t* ports, unsigned count)
+{
+    //Same as enable_ports(), both ends of a tunnel must be in the same call
+    enum error_code result;
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        result = disable_port(ports[i].component, ports[i].port); if(result!=OK) { return result; }
+    }
+
+    for(i=0; i<count; i++)
+    {
+        result = wait_for(ports[i].component, EVENT_PORT_DISABLE, ports[i].port, 0); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+enum error_code fill_buffer(component_t* component, OMX_BUFFERHEADERTYPE* buffer)
+{
+    enum error_code result;
+
+    start_timing(component, EVENT_FILL_BUFFER_DONE, buffer->nOutputPortIndex, buffer);
+
+    result = omx_fill_this_buffer(component->handle, buffer);
+    if(result!=OK)
+    {
+        cancel_timing(component, EVENT_FILL_BUFFER_DONE, buffer->nOutputPortIndex, buffer);
+    }
+
+    return result;
+}
+
+enum error_code port_enable_allocate_buffer(component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port)
+{
+    //The port is not enabled until all the buffers are allocated. The count
+    //must match nBufferCountActual of the port definition
+    enum error_code result;
+
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
+
+    result = get_port_definition(component, port, &port_def); if(result!=OK) { return result; }
+
+    result = enable_port(component, port); if(result!=OK) { return result; }
+
+    LOG_MESSAGE_COMPONENT(component, "allocating %d output buffers", count);
+
+    OMX_U32 i;
+    for(i=0; i<count; i++)
+    {
+        result = omx_allocate_buffer(component->handle, &buffers[i], port, 0, port_def.nBufferSize); if(result!=OK) { return result; }
+    }
+
+    return wait_for(component, EVENT_PORT_ENABLE, port, 0);
+}
+
+enum error_code port_enable_use_buffer(component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port, OMX_U8* const* memory, OMX_U32 size)
+{
+    //Same as port_enable_allocate_buffer(), the memory of the buffers is the
+    //caller's. The headers are still released by port_disable_free_buffer()
     enum error_code result;
 
     result = enable_port(component, port); if(result!=OK) { return result; }
 
-    LOG_MESSAGE_COMPONENT(component, "allocating output buffer");
+    LOG_MESSAGE_COMPONENT(component, "using %d output buffers of %d bytes", count, size);
 
-    result = omx_allocate_port_buffer(component->handle, buffer, port, 0); if(result!=OK) { return result; }
-    return wait(component, EVENT_PORT_ENABLE, 0);
+    OMX_U32 i;
+    for(i=0; i<count; i++)
+    {
+        result = omx_use_buffer(component->handle, &buffers[i], port, 0, size, memory[i]); if(result!=OK) { return result; }
+    }
+
+    return wait_for(component, EVENT_PORT_ENABLE, port, 0);
 }
 
-enum error_code port_disable_free_buffer(component_t* component, OMX_BUFFERHEADERTYPE* buffer, OMX_U32 port)
+enum error_code port_disable_free_buffer(component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port)
 {
-    //The port is not disabled until the buffer is released
+    //The port is not disabled until all the buffers are released
     enum error_code result;
 
     result = disable_port(component, port); if(result!=OK) { return result; }
 
-    //Free encoder output buffer
-    LOG_MESSAGE_COMPONENT(component, "releasing output buffer");
+    //Free encoder output buffers
+    LOG_MESSAGE_COMPONENT(component, "releasing %d output buffers", count);
+
+    OMX_U32 i;
+    for(i=0; i<count; i++)
+    {
+        result = omx_free_buffer(component->handle, port, buffers[i]); if(result!=OK) { return result; }
+    }
 
-    result = omx_free_buffer(component->handle, port, buffer); if(result!=OK) { return result; }
-    return wait(component, EVENT_PORT_DISABLE, 0);
+    return wait_for(component, EVENT_PORT_DISABLE, port, 0);
 }
 
+
+/*****************************************************************************/
+
+//Every OMX_GetParameter is a round trip to the VideoCore, and the same ports
+//are read several times on every open
+#define PORT_DEFAULTS_MAX   32
+#define PORT_DEFAULTS_NAME  64
+#define PORT_DEFAULTS_MAGIC 0x54524F50 //"PORT"
+
+typedef struct
+{
+    char                         name[PORT_DEFAULTS_NAME];
+    OMX_PARAM_PORTDEFINITIONTYPE def;
+} port_default_t;
+
+//Start of the file, followed by count port_default_t. The record size
+//changes with the OpenMAX headers
+typedef struct
+{
+    uint32_t magic;
+    uint32_t record_size;
+    uint32_t count;
+} port_defaults_header_t;
+
+static pthread_mutex_t port_defaults_lock = PTHREAD_MUTEX_INITIALIZER;
+static port_default_t  port_defaults[PORT_DEFAULTS_MAX];
+static unsigned        port_defaults_count = 0;
+static int             port_defaults_changed = 0;
+static uint64_t        port_defs_read = 0;
+static uint64_t        port_defs_cached = 0;
+
+//Must be called with the lock of the component held
+static port_cache_t* port_cache_find(component_t* component, OMX_U32 port)
+{
+    unsigned i;
+    for(i=0; i<component->ports_count; i++)
+    {
+        if(component->ports[i].def.nPortIndex == port)
+            return &component->ports[i];
+    }
+
+    return NULL;
+}
+
+//Must be called with the defaults lock held
+static port_default_t* port_default_find(const char* name, OMX_U32 port)
+{
+    unsigned i;
+    for(i=0; i<port_defaults_count; i++)
+    {
+        if(port_defaults[i].def.nPortIndex == port && strcmp(port_defaults[i].name, name) == 0)
+            return &port_defaults[i];
+    }
+
+    return NULL;
+}
+
+//The pointers are the component's, they are not valid in another process
+static void port_definition_trim(OMX_PARAM_PORTDEFINITIONTYPE* def)
+{
+    switch(def->eDomain)
+    {
+        case OMX_PortDomainVideo:
+            def->format.video.cMIMEType     = NULL;
+            def->format.video.pNativeRender = NULL;
+            def->format.video.pNativeWindow = NULL;
+            break;
+
+        case OMX_PortDomainImage:
+            def->format.image.cMIMEType     = NULL;
+            def->format.image.pNativeRender = NULL;
+            def->format.image.pNativeWindow = NULL;
+            break;
+
+        case OMX_PortDomainAudio:
+            def->format.audio.cMIMEType     = NULL;
+            break;
+
+        default:
+            break;
+    }
+}
+
+enum error_code get_port_definition(component_t* component, OMX_U32 port, OMX_PARAM_PORTDEFINITIONTYPE* def)
+{
+    enum error_code result;
+
+    pthread_mutex_lock(&component->lock);
+
+    port_cache_t* cached     = port_cache_find(component, port);
+    unsigned      generation = component->ports_generation;
+    //Never read and nothing changed since the component was loaded
+    int           fresh      = !cached && generation == 0;
+
+    if(cached && cached->valid)
+    {
+        *def = cached->def;
+        pthread_mutex_unlock(&component->lock);
+
+        pthread_mutex_lock(&port_defaults_lock);
+        port_defs_cached++;
+        pthread_mutex_unlock(&port_defaults_lock);
+
+        return OK;
+    }
+
+    pthread_mutex_unlock(&component->lock);
+
+    pthread_mutex_lock(&port_defaults_lock);
+
+    port_default_t* known = fresh ? port_default_find(component->name, port) : NULL;
+
+    if(known)
+    {
+        *def = known->def;
+        port_defs_cached++;
+    }
+    else
+    {
+        port_defs_read++;
+    }
+
+    pthread_mutex_unlock(&port_defaults_lock);
+
+    if(!known)
+    {
+        OMX_INIT_STRUCTURE(*def);
+
+        def->nPortIndex = port;
+
+        result = omx_get_parameter(component->handle, OMX_IndexParamPortDefinition, def); if(result!=OK) { return result; }
+
+        if(fresh && strlen(component->name) < PORT_DEFAULTS_NAME)
+        {
+            pthread_mutex_lock(&port_defaults_lock);
+
+            if(!port_default_find(component->name, port) && port_defaults_count < PORT_DEFAULTS_MAX)
+            {
+                port_default_t* added = &port_defaults[port_defaults_count++];
+
+                strcpy(added->name, component->name);
+                added->def = *def;
+                port_definition_trim(&added->def);
+
+                port_defaults_changed = 1;
+            }
+
+            pthread_mutex_unlock(&port_defaults_lock);
+        }
+    }
+
+    pthread_mutex_lock(&component->lock);
+
+    //Not kept if the settings changed while it was read
+    if(component->ports_generation == generation)
+    {
+        cached = port_cache_find(component, port);
+
+        if(!cached && component->ports_count < COMPONENT_PORTS_MAX)
+            cached = &component->ports[component->ports_count++];
+
+        if(cached)
+        {
+            cached->def   = *def;
+            cached->valid = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&component->lock);
+
+    return OK;
+}
+
+enum error_code set_port_definition(component_t* component, OMX_PARAM_PORTDEFINITIONTYPE* def)
+{
+    enum error_code result;
+
+    result = omx_set_parameter(component->handle, OMX_IndexParamPortDefinition, def);
+
+    //The component fills in the rest (buffer size, the other ports) on its
+    //own, the next read asks it, failed or not
+    forget_port_definitions(component);
+
+    return result;
+}
+
+void forget_port_definitions(component_t* component)
+{
+    pthread_mutex_lock(&component->lock);
+
+    unsigned i;
+    for(i=0; i<component->ports_count; i++)
+        component->ports[i].valid = 0;
+
+    component->ports_generation++;
+
+    pthread_mutex_unlock(&component->lock);
+}
+
+enum error_code load_port_defaults(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+
+    if(!file)
+    {
+        //Not saved yet
+        if(errno == ENOENT)
+            return OK;
+
+        LOG_ERRNO("fopen %s", path);
+        return ERROR;
+    }
+
+    port_defaults_header_t header;
+    port_default_t         loaded[PORT_DEFAULTS_MAX];
+
+    if(fread(&header, sizeof(header), 1, file) != 1 ||
+       header.magic != PORT_DEFAULTS_MAGIC ||
+       header.record_size != sizeof(port_default_t) ||
+       header.count > PORT_DEFAULTS_MAX ||
+       fread(loaded, sizeof(port_default_t), header.count, file) != header.count)
+    {
+        //Written by another build, the definitions are read again
+        LOG_ERROR("%s: not a port definitions file, ignored", path);
+        fclose(file);
+        return OK;
+    }
+
+    fclose(file);
+
+    pthread_mutex_lock(&port_defaults_lock);
+
+    unsigned i;
+    for(i=0; i<header.count; i++)
+    {
+        loaded[i].name[PORT_DEFAULTS_NAME-1] = 0;
+        port_defaults[i] = loaded[i];
+    }
+
+    port_defaults_count   = header.count;
+    port_defaults_changed = 0;
+
+    pthread_mutex_unlock(&port_defaults_lock);
+
+    LOG_MESSAGE("%s: %d port definitions loaded", path, header.count);
+
+    return OK;
+}
+
+enum error_code save_port_defaults(const char* path)
+{
+    char temporary[PATH_MAX];
+
+    if(snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary))
+    {
+        LOG_ERROR("%s: path too long", path);
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&port_defaults_lock);
+
+    if(!port_defaults_changed)
+    {
+        pthread_mutex_unlock(&port_defaults_lock);
+        return OK;
+    }
+
+    port_defaults_header_t header = { PORT_DEFAULTS_MAGIC, sizeof(port_default_t), port_defaults_count };
+    port_default_t         saved[PORT_DEFAULTS_MAX];
+
+    memcpy(saved, port_defaults, port_defaults_count * sizeof(port_default_t));
+
+    pthread_mutex_unlock(&port_defaults_lock);
+
+    //Written aside and renamed, a reader never sees half of it
+    FILE* file = fopen(temporary, "wb");
+
+    if(!file)
+    {
+        LOG_ERRNO("fopen %s", temporary);
+        return ERROR;
+    }
+
+    if(fwrite(&header, sizeof(header), 1, file) != 1 ||
+       fwrite(saved, sizeof(port_default_t), header.count, file) != header.count)
+    {
+        LOG_ERRNO("fwrite %s", temporary);
+        fclose(file);
+        unlink(temporary);
+        return ERROR;
+    }
+
+    if(fclose(file))
+    {
+        LOG_ERRNO("fclose %s", temporary);
+        unlink(temporary);
+        return ERROR;
+    }
+
+    if(rename(temporary, path))
+    {
+        LOG_ERRNO("rename %s", path);
+        unlink(temporary);
+        return ERROR;
+    }
+
+    //Only once saved, a failure is retried by the next call. Definitions
+    //added meanwhile are not in the file yet
+    pthread_mutex_lock(&port_defaults_lock);
+
+    if(port_defaults_count == header.count)
+        port_defaults_changed = 0;
+
+    pthread_mutex_unlock(&port_defaults_lock);
+
+    LOG_MESSAGE("%s: %d port definitions saved", path, header.count);
+
+    return OK;
+}
+
+void port_definition_counters(uint64_t* read, uint64_t* cached)
+{
+    pthread_mutex_lock(&port_defaults_lock);
+
+    *read   = port_defs_read;
+    *cached = port_defs_cached;
+
+    pthread_mutex_unlock(&port_defaults_lock);
+}
@@ -1,33 +1,41 @@
 #ifndef  OMX_COMPONENT_INC
 #define  OMX_COMPONENT_INC
 
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <IL/OMX_Broadcom.h>
-#include <interface/vcos/vcos.h>
 
 #include "logerr.h"
 
 #define LOG_MESSAGE_COMPONENT(component, fmt, ...) LOG_MESSAGE("component: %-30s, " fmt, (component)->name, ##__VA_ARGS__)
 #define LOG_MESSAGE_EVENT(component, event, fmt, ...) LOG_MESSAGE_COMPONENT((component), "event: %-20s, " fmt, #event, ##__VA_ARGS__)
 
+#define LOG_DEBUG_COMPONENT(component, fmt, ...) LOG_DEBUG("component: %-30s, " fmt, (component)->name, ##__VA_ARGS__)
+
 #define LOG_ERROR_COMPONENT(component, fmt, ...) LOG_ERROR("component: %-30s, " fmt, (component)->name, ##__VA_ARGS__)
 #define LOG_ERROR_EVENT(component, event, fmt, ...) LOG_ERROR_COMPONENT((component), "event: %-20s, " fmt, #event, ##__VA_ARGS__)
 
 #include "error.h"
 
-//Data of each component
-typedef struct
-{
-    //The handle is obtained with OMX_GetHandle() and is used on every function
-    //that needs to manipulate a component. It is released with OMX_FreeHandle()
-    OMX_HANDLETYPE handle;
-    //Bitwise OR of flags. Used for blocking the current thread and waiting an
-    //event. Used with vcos_event_flags_get() and vcos_event_flags_set()
-    VCOS_EVENT_FLAGS_T flags;
-    //The fullname of the component
-    OMX_STRING name;
-} component_t;
+//Maximum number of events waiting to be consumed
+#define COMPONENT_EVENTS_MAX 64
+//Maximum number of commands and buffers being timed at once
+#define COMPONENT_PENDING_MAX 32
+//Slots of the buffer ring, a power of 2 larger than the buffers of any port
+#define COMPONENT_RING_SIZE 16
+//Port definitions cached per component, the ones past it are always read
+//from the component
+#define COMPONENT_PORTS_MAX 4
+//Default time the waits give up after, the camera drivers take about 1 s to
+//load. 0 waits forever
+#define COMPONENT_TIMEOUT_MS 5000
 
-//Events used with vcos_event_flags_get() and vcos_event_flags_set()
+//Matches an event regardless of its data
+#define EVENT_DATA_ANY 0xFFFFFFFF
+
+//Events posted by the callbacks. The values are bits, so a wait can ask for
+//several kinds of events at once
 typedef enum
 {
     EVENT_ERROR                       = 0x1,
@@ -44,18 +52,139 @@ typedef enum
     EVENT_DYNAMIC_RESOURCES_AVAILABLE = 0x800,
     EVENT_FILL_BUFFER_DONE            = 0x1000,
     EVENT_EMPTY_BUFFER_DONE           = 0x2000,
+    //Not from OpenMAX, posted by the consumer of the buffer ring when a frame
+    //is complete. data1 is the frame, data2 is set on the last one
+    EVENT_FRAME_END                   = 0x4000,
 } component_event;
 
-            void            wake                        (component_t* component, VCOS_UNSIGNED event);
-WARN_UNUSED enum error_code wait                        (component_t* component, VCOS_UNSIGNED events, VCOS_UNSIGNED* retrieves_events);
+//An event with its payload, as received by the callbacks
+typedef struct
+{
+    component_event      event;
+    //Same as the OMX_EventHandler data. For the command completions data1 is
+    //the command and data2 the port or the state, for the parameter changes
+    //data2 is the index
+    OMX_U32               data1;
+    OMX_U32               data2;
+    //The buffer of EVENT_FILL_BUFFER_DONE and EVENT_EMPTY_BUFFER_DONE
+    OMX_BUFFERHEADERTYPE* buffer;
+} event_t;
+
+//A command or buffer sent to the component and not completed yet, the time
+//it took is recorded when the matching event arrives
+typedef struct
+{
+    component_event       event;
+    OMX_U32               key;
+    OMX_BUFFERHEADERTYPE* buffer;
+    uint64_t              start;
+} pending_t;
+
+//A filled buffer in the ring, with the time it arrived for the latency
+//records
+typedef struct
+{
+    OMX_BUFFERHEADERTYPE* buffer;
+    uint64_t              time;
+} ring_slot_t;
+
+//A port definition read from the component. The entry stays once the port
+//is read, invalid after a change, so the port is known not to be fresh
+typedef struct
+{
+    OMX_PARAM_PORTDEFINITIONTYPE def;
+    int                          valid;
+} port_cache_t;
+
+//Data of each component
+typedef struct
+{
+    //The handle is obtained with OMX_GetHandle() and is used on every function
+    //that needs to manipulate a component. It is released with OMX_FreeHandle()
+    OMX_HANDLETYPE handle;
+    //The fullname of the component
+    OMX_STRING name;
+    //Events not consumed yet, in the order they arrived. Every event is kept,
+    //two events of the same kind are never merged. Posted with post_event()
+    //and consumed with the wait functions
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    event_t         events[COMPONENT_EVENTS_MAX];
+    unsigned        events_head;
+    unsigned        events_count;
+    //Commands and buffers being timed, guarded by the same lock
+    pending_t       pending[COMPONENT_PENDING_MAX];
+    unsigned        pending_count;
+    //Milliseconds the waits give up after with TIMEOUT, 0 waits forever. Set
+    //to COMPONENT_TIMEOUT_MS by init_component()
+    unsigned        timeout_ms;
+    //eventfd written by post_event() after every event, so a poll() loop
+    //can use the non-blocking waits. -1 if none, see set_notify_fd()
+    int             notify_fd;
+    //Once enable_buffer_ring() is called the filled buffers skip the event
+    //queue and its lock: the callback pushes them here and a single consumer
+    //thread takes them with take_buffer(). The callback thread is the only
+    //producer, each index is written by one side only
+    int             ring_enabled;
+    int             ring_stopping;
+    ring_slot_t     ring[COMPONENT_RING_SIZE];
+    unsigned        ring_head;
+    unsigned        ring_tail;
+    sem_t           ring_ready;
+    //Port definitions, read with get_port_definition(). They are dropped when
+    //the component reports new port settings or one is set, guarded by the
+    //lock. The generation counts the drops, a definition read meanwhile is
+    //not kept
+    port_cache_t    ports[COMPONENT_PORTS_MAX];
+    unsigned        ports_count;
+    unsigned        ports_generation;
+} component_t;
+
+//A port of a component, for the commands sent to several ports at once
+typedef struct
+{
+    component_t* component;
+    OMX_U32      port;
+} component_port_t;
+
+            void            post_event                  (component_t* component, component_event event, OMX_U32 data1, OMX_U32 data2, OMX_BUFFERHEADERTYPE* buffer);
+WARN_UNUSED enum error_code wait                        (component_t* component, uint32_t events, event_t* retrieved);
+WARN_UNUSED enum error_code wait_for                    (component_t* component, uint32_t events, OMX_U32 data, event_t* retrieved);
+WARN_UNUSED enum error_code wait_buffer                 (component_t* component, OMX_BUFFERHEADERTYPE* buffer, OMX_BUFFERHEADERTYPE** retrieved);
+WARN_UNUSED enum error_code try_wait                    (component_t* component, uint32_t events, event_t* retrieved);
+WARN_UNUSED enum error_code try_wait_for                (component_t* component, uint32_t events, OMX_U32 data, event_t* retrieved);
+            void            set_notify_fd               (component_t* component, int fd);
+WARN_UNUSED enum error_code enable_buffer_ring          (component_t* component);
+            void            stop_buffer_ring            (component_t* component);
+            void            disable_buffer_ring         (component_t* component);
+WARN_UNUSED enum error_code take_buffer                 (component_t* component, OMX_BUFFERHEADERTYPE** buffer);
 WARN_UNUSED enum error_code init_component              (component_t* component);
 WARN_UNUSED enum error_code deinit_component            (component_t* component);
-WARN_UNUSED enum error_code load_camera_drivers         (component_t* component);
+WARN_UNUSED enum error_code load_camera_drivers         (component_t* component, OMX_U32 camera);
 WARN_UNUSED enum error_code change_state                (component_t* component, OMX_STATETYPE state);
 WARN_UNUSED enum error_code enable_port                 (component_t* component, OMX_U32 port);
 WARN_UNUSED enum error_code disable_port                (component_t* component, OMX_U32 port);
-WARN_UNUSED enum error_code port_enable_allocate_buffer (component_t* component, OMX_BUFFERHEADERTYPE** buffer, OMX_U32 port);
-WARN_UNUSED enum error_code port_disable_free_buffer    (component_t* component, OMX_BUFFERHEADERTYPE* buffer, OMX_U32 port);
+WARN_UNUSED enum error_code flush_port                  (component_t* component, OMX_U32 port);
+WARN_UNUSED enum error_code change_state_all            (component_t* const* components, unsigned count, OMX_STATETYPE state);
+WARN_UNUSED enum error_code enable_ports                (const component_port_t* ports, unsigned count);
+WARN_UNUSED enum error_code disable_ports               (const component_port_t* ports, unsigned count);
+WARN_UNUSED enum error_code fill_buffer                 (component_t* component, OMX_BUFFERHEADERTYPE* buffer);
+WARN_UNUSED enum error_code port_enable_allocate_buffer (component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port);
+WARN_UNUSED enum error_code port_enable_use_buffer      (component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port, OMX_U8* const* memory, OMX_U32 size);
+WARN_UNUSED enum error_code port_disable_free_buffer    (component_t* component, OMX_BUFFERHEADERTYPE** buffers, OMX_U32 count, OMX_U32 port);
+WARN_UNUSED enum error_code get_port_definition         (component_t* component, OMX_U32 port, OMX_PARAM_PORTDEFINITIONTYPE* def);
+WARN_UNUSED enum error_code set_port_definition         (component_t* component, OMX_PARAM_PORTDEFINITIONTYPE* def);
+            void            forget_port_definitions     (component_t* component);
+
+//The first definition read from each port of a newly loaded component is the
+//same on every open, for the same firmware and sensor. They are kept by
+//component name and port, and can be saved to a file so the next process
+//does not ask the components either. load_port_defaults() replaces the ones
+//known, save_port_defaults() only writes if new ones were read since
+WARN_UNUSED enum error_code load_port_defaults          (const char* path);
+WARN_UNUSED enum error_code save_port_defaults          (const char* path);
+//Port definitions asked to the components and taken from the caches so far
+            void            port_definition_counters    (uint64_t* read, uint64_t* cached);
 
 #endif
 
@@ -1,9 +1,166 @@
 #include "omx_config.h"
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include "omx.h"
 
 /*****************************************************************************/
 
+//The settings are sent again on every reconfiguration, but each OMX_SetConfig
+//is a round trip to the VideoCore. The last value set of every config is kept
+//per component and port, a config that has not changed is not sent
+#define SHADOW_MAX  128
+#define SHADOW_SIZE 128
+
+typedef struct
+{
+    OMX_HANDLETYPE handle;
+    OMX_INDEXTYPE  index;
+    OMX_U32        port;
+    OMX_U32        size;
+    uint8_t        data[SHADOW_SIZE];
+} shadow_t;
+
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static shadow_t        shadows[SHADOW_MAX];
+static unsigned        shadows_count = 0;
+static uint64_t        configs_sent = 0;
+static uint64_t        configs_skipped = 0;
+
+//Must be called with the lock held
+static shadow_t* shadow_find(OMX_HANDLETYPE hComponent, OMX_INDEXTYPE nIndex, OMX_U32 nPortIndex)
+{
+    unsigned i;
+    for(i=0; i<shadows_count; i++)
+    {
+        if(shadows[i].handle == hComponent && shadows[i].index == nIndex && shadows[i].port == nPortIndex)
+            return &shadows[i];
+    }
+
+    return NULL;
+}
+
+//Must be called with the lock held
+static void shadow_remove(shadow_t* shadow)
+{
+    *shadow = shadows[--shadows_count];
+}
+
+//Same as omx_set_config(), unless the config already has this value. The
+//port is the one the config applies to, OMX_ALL for every port or none
+static WARN_UNUSED
+enum error_code set_config_shadowed(
+        OMX_HANDLETYPE hComponent,
+        OMX_INDEXTYPE  nIndex,
+        OMX_U32        nPortIndex,
+        const void*    pConfig,
+        OMX_U32        nSize)
+{
+    enum error_code result;
+
+    pthread_mutex_lock(&shadow_lock);
+
+    shadow_t* shadow = shadow_find(hComponent, nIndex, nPortIndex);
+
+    if(shadow && shadow->size == nSize && memcmp(shadow->data, pConfig, nSize) == 0)
+    {
+        configs_skipped++;
+        pthread_mutex_unlock(&shadow_lock);
+        return OK;
+    }
+
+    configs_sent++;
+    pthread_mutex_unlock(&shadow_lock);
+
+    //The structure is not modified, OMX_SetConfig() just doesn't say so
+    result = omx_set_config(hComponent, nIndex, (OMX_PTR)pConfig);
+
+    pthread_mutex_lock(&shadow_lock);
+
+    //Found again, the table may have changed meanwhile
+    shadow = shadow_find(hComponent, nIndex, nPortIndex);
+
+    if(nPortIndex == OMX_ALL)
+    {
+        //The value of every port changes
+        unsigned i;
+        for(i=0; i<shadows_count; )
+        {
+            if(shadows[i].handle == hComponent && shadows[i].index == nIndex && shadows[i].port != OMX_ALL)
+                shadow_remove(&shadows[i]);
+            else
+                i++;
+        }
+
+        shadow = shadow_find(hComponent, nIndex, nPortIndex);
+    }
+    else
+    {
+        //The value of every port is not known anymore
+        shadow_t* all = shadow_find(hComponent, nIndex, OMX_ALL);
+
+        if(all)
+        {
+            shadow_remove(all);
+            shadow = shadow_find(hComponent, nIndex, nPortIndex);
+        }
+    }
+
+    if(result!=OK)
+    {
+        //The component may have applied part of it
+        if(shadow)
+            shadow_remove(shadow);
+    }
+    else if(nSize <= SHADOW_SIZE)
+    {
+        if(!shadow && shadows_count < SHADOW_MAX)
+            shadow = &shadows[shadows_count++];
+
+        if(shadow)
+        {
+            shadow->handle = hComponent;
+            shadow->index  = nIndex;
+            shadow->port   = nPortIndex;
+            shadow->size   = nSize;
+            memcpy(shadow->data, pConfig, nSize);
+        }
+    }
+
+    pthread_mutex_unlock(&shadow_lock);
+
+    return result;
+}
+
+void omx_config_forget(OMX_HANDLETYPE hComponent)
+{
+    pthread_mutex_lock(&shadow_lock);
+
+    unsigned i;
+    for(i=0; i<shadows_count; )
+    {
+        if(shadows[i].handle == hComponent)
+            shadow_remove(&shadows[i]);
+        else
+            i++;
+    }
+
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+void omx_config_counters(uint64_t* sent, uint64_t* skipped)
+{
+    pthread_mutex_lock(&shadow_lock);
+
+    *sent    = configs_sent;
+    *skipped = configs_skipped;
+
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+/*****************************************************************************/
+
 enum error_code
 omx_config_sharpness(
         OMX_IN OMX_HANDLETYPE hComponent,
@@ -15,7 +172,7 @@ omx_config_sharpness(
     sharpness_st.nPortIndex = nPortIndex;
     sharpness_st.nSharpness = nSharpness;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonSharpness, &sharpness_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonSharpness, nPortIndex, &sharpness_st, sizeof(sharpness_st));
 }
 
 /*****************************************************************************/
@@ -31,7 +188,7 @@ omx_config_contrast(
     contrast_st.nPortIndex = nPortIndex;
     contrast_st.nContrast  = nContrast;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonContrast, &contrast_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonContrast, nPortIndex, &contrast_st, sizeof(contrast_st));
 }
 
 /*****************************************************************************/
@@ -47,7 +204,7 @@ omx_config_saturation(
     saturation_st.nPortIndex  = nPortIndex;
     saturation_st.nSaturation = nSaturation;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonSaturation, &saturation_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonSaturation, nPortIndex, &saturation_st, sizeof(saturation_st));
 }
 
 /*****************************************************************************/
@@ -63,7 +220,7 @@ omx_config_brightness(
     brightness_st.nPortIndex  = nPortIndex;
     brightness_st.nBrightness = nBrightness;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonBrightness, &brightness_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonBrightness, nPortIndex, &brightness_st, sizeof(brightness_st));
 }
 
 /*****************************************************************************/
@@ -93,7 +250,7 @@ omx_config_exposure_value(
     exposure_value_st.nSensitivity      = nSensitivity;
     exposure_value_st.bAutoSensitivity  = bAutoSensitivity;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonExposureValue, &exposure_value_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonExposureValue, nPortIndex, &exposure_value_st, sizeof(exposure_value_st));
 }
 
 /*****************************************************************************/
@@ -109,7 +266,7 @@ omx_config_exposure(
     exposure_control_st.nPortIndex       = nPortIndex;
     exposure_control_st.eExposureControl = eExposureControl;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonExposure, &exposure_control_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonExposure, nPortIndex, &exposure_control_st, sizeof(exposure_control_st));
 }
 
 /*****************************************************************************/
@@ -125,7 +282,7 @@ omx_config_frame_stabilisation(
     frame_stabilisation_st.nPortIndex = nPortIndex;
     frame_stabilisation_st.bStab      = bStab;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonFrameStabilisation, &frame_stabilisation_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonFrameStabilisation, nPortIndex, &frame_stabilisation_st, sizeof(frame_stabilisation_st));
 }
 
 /*****************************************************************************/
@@ -141,7 +298,7 @@ omx_config_white_balance(
     white_balance_st.nPortIndex       = nPortIndex;
     white_balance_st.eWhiteBalControl = eWhiteBalControl;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonWhiteBalance, &white_balance_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonWhiteBalance, nPortIndex, &white_balance_st, sizeof(white_balance_st));
 }
 
 /*****************************************************************************/
@@ -157,7 +314,7 @@ omx_config_white_balance_gains(
         white_balance_gains_st.xGainR = xGainR;
         white_balance_gains_st.xGainB = xGainB;
 
-        return omx_set_config(hComponent, OMX_IndexConfigCustomAwbGains, &white_balance_gains_st);
+        return set_config_shadowed(hComponent, OMX_IndexConfigCustomAwbGains, OMX_ALL, &white_balance_gains_st, sizeof(white_balance_gains_st));
 }
 
 /*****************************************************************************/
@@ -173,7 +330,7 @@ omx_config_image_filter(
     image_filter_st.nPortIndex   = nPortIndex;
     image_filter_st.eImageFilter = eImageFilter;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonImageFilter, &image_filter_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonImageFilter, nPortIndex, &image_filter_st, sizeof(image_filter_st));
 }
 
 /*****************************************************************************/
@@ -189,7 +346,7 @@ omx_config_mirror(
     mirror_st.nPortIndex = nPortIndex;
     mirror_st.eMirror    = eMirror;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonMirror, &mirror_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonMirror, nPortIndex, &mirror_st, sizeof(mirror_st));
 }
 
 /*****************************************************************************/
@@ -205,7 +362,7 @@ omx_config_rotation(
     rotation_st.nPortIndex = nPortIndex;
     rotation_st.nRotation  = nRotation;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonRotate, &rotation_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonRotate, nPortIndex, &rotation_st, sizeof(rotation_st));
 }
 
 /*****************************************************************************/
@@ -225,7 +382,7 @@ omx_config_color_enhancement(
     color_enhancement_st.nCustomizedU      = nCustomizedU;
     color_enhancement_st.nCustomizedV      = nCustomizedV;
 
-    return omx_set_config(hComponent, OMX_IndexConfigCommonColorEnhancement, &color_enhancement_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigCommonColorEnhancement, nPortIndex, &color_enhancement_st, sizeof(color_enhancement_st));
 }
 
 /*****************************************************************************/
@@ -239,7 +396,7 @@ omx_config_denoise(
 
     denoise_st.bEnabled = bEnabled;
 
-    return omx_set_config(hComponent, OMX_IndexConfigStillColourDenoiseEnable, &denoise_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigStillColourDenoiseEnable, OMX_ALL, &denoise_st, sizeof(denoise_st));
 }
 
 /*****************************************************************************/
@@ -261,7 +418,7 @@ omx_config_input_crop_percentage(
     roi_st.xWidth     = xWidth;
     roi_st.xHeight    = xHeight;
 
-    return omx_set_config(hComponent, OMX_IndexConfigInputCropPercentages, &roi_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigInputCropPercentages, nPortIndex, &roi_st, sizeof(roi_st));
 }
 
 /*****************************************************************************/
@@ -275,7 +432,7 @@ omx_config_dynamic_range_expansion(
 
     drc_st.eMode = eMode;
 
-    return omx_set_config(hComponent, OMX_IndexConfigDynamicRangeExpansion, &drc_st);
+    return set_config_shadowed(hComponent, OMX_IndexConfigDynamicRangeExpansion, OMX_ALL, &drc_st, sizeof(drc_st));
 }
 
 /*****************************************************************************/
@@ -3,11 +3,25 @@
 
 /*****************************************************************************/
 
+#include <stdint.h>
 #include <IL/OMX_Broadcom.h>
 #include "error.h"
 
 /*****************************************************************************/
 
+//The settings below (sharpness to dynamic range expansion) are only sent if
+//they changed since the last time they were set on the component and port.
+//The others (capturing, single step, callbacks, metadata) are always sent
+
+//Forgets the settings of a component, before its handle is freed
+void omx_config_forget(OMX_HANDLETYPE hComponent);
+
+//Settings sent and not sent because they had not changed, of every component
+//since the start
+void omx_config_counters(uint64_t* sent, uint64_t* skipped);
+
+/*****************************************************************************/
+
 WARN_UNUSED enum error_code
 omx_config_sharpness(
         OMX_IN OMX_HANDLETYPE hComponent,
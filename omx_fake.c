@@ -0,0 +1,1442 @@
+/*
+   Software stand-in for the VideoCore libraries (openmaxil, bcm_host).
+
+   It emulates the four components used by omx_still.c (camera,
+   video_splitter, image_encode and null_sink) closely enough to drive the
+   capture stack off-device: commands complete asynchronously, callbacks are
+   delivered from a separate thread like the VCHIQ callback thread, and the
+   encoder produces synthetic baseline JPEG streams sliced into the output
+   buffers.
+
+   The sensor delivers a frame every FAKE_OMX_FRAME_US while the camera
+   captures. The splitter passes them all when its single step is 0, as
+   long as the encoder has room. Otherwise it passes one frame per step, and
+   each step after the first waits for the encoder to finish the previous
+   frame and for a frame exposed after that.
+
+   Every operation has a configurable latency, read from the environment on
+   OMX_Init():
+
+   FAKE_OMX_CALL_US      synchronous calls (Get/SetParameter, Get/SetConfig)
+   FAKE_OMX_COMMAND_US   state changes and port enable/disable completion
+   FAKE_OMX_DRIVERS_US   camera driver loading
+   FAKE_OMX_FRAME_US     exposure and readout of a frame
+   FAKE_OMX_SLICE_US     encoding of one output buffer
+   FAKE_OMX_SEED         seed of the synthetic entropy coded data
+   */
+
+#include <IL/OMX_Core.h>
+#include <IL/OMX_Component.h>
+#include <IL/OMX_Broadcom.h>
+#include <bcm_host.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "omx.h"
+
+#define FAKE_PORTS_MAX   8
+#define FAKE_BUFFERS_MAX 32
+
+#define FAKE_DEFAULT_CALL_US     100
+#define FAKE_DEFAULT_COMMAND_US  1000
+#define FAKE_DEFAULT_DRIVERS_US  10000
+#define FAKE_DEFAULT_FRAME_US    66666
+#define FAKE_DEFAULT_SLICE_US    500
+
+/*****************************************************************************/
+
+enum fake_kind
+{
+    FAKE_CAMERA,
+    FAKE_NULL_SINK,
+    FAKE_SPLITTER,
+    FAKE_ENCODER
+};
+
+struct fake_component;
+
+struct fake_port
+{
+    OMX_PARAM_PORTDEFINITIONTYPE def;
+
+    //Tunnel peer, if any
+    struct fake_component* peer;
+    OMX_U32                peer_port;
+
+    //Buffers allocated on the port and the ones queued by FillThisBuffer
+    OMX_BUFFERHEADERTYPE* buffers[FAKE_BUFFERS_MAX];
+    OMX_U32               buffer_count;
+    OMX_BUFFERHEADERTYPE* queue[FAKE_BUFFERS_MAX];
+    OMX_U32               queue_head;
+    OMX_U32               queue_count;
+
+    //A command waiting for the port to be populated/depopulated
+    bool enabling;
+    bool disabling;
+
+    OMX_U32  single_step;
+    OMX_BOOL capturing;
+    //Splitter set to single step 0, the frames go through at the frame rate
+    //while the camera captures. stepped once a frame of the single steps went
+    //through. streaming while the next frame of the sensor is scheduled, at
+    //stream_due
+    bool     free_running;
+    bool     stepped;
+    bool     streaming;
+    uint64_t stream_due;
+};
+
+//A frame waiting to be encoded or being drained to the output buffers
+struct fake_frame
+{
+    struct fake_frame* next;
+    uint8_t*           data;
+    size_t             size;
+    size_t             position;
+    bool               last;
+    uint64_t           timestamp;
+};
+
+struct fake_component
+{
+    //Must be the first member, the OMX handle points to it
+    OMX_COMPONENTTYPE base;
+
+    enum fake_kind   kind;
+    OMX_STRING       name;
+    OMX_STATETYPE    state;
+    OMX_CALLBACKTYPE callbacks;
+    OMX_PTR          app_data;
+
+    struct fake_port ports[FAKE_PORTS_MAX];
+    OMX_U32          port_count;
+    OMX_PORT_PARAM_TYPE domains[4];
+
+    OMX_BOOL callback_device_number;
+    OMX_U32  qfactor;
+    OMX_BOOL exif_disabled;
+    OMX_BOOL thumbnail;
+
+    //Encoder output stream
+    struct fake_frame* frames;
+    uint64_t           busy_until;
+};
+
+enum fake_job_type
+{
+    JOB_EVENT,
+    JOB_FILL_DONE,
+    JOB_CALL
+};
+
+struct fake_job
+{
+    struct fake_job*       next;
+    uint64_t               due;
+    enum fake_job_type     type;
+    struct fake_component* component;
+    OMX_EVENTTYPE          event;
+    OMX_U32                data1;
+    OMX_U32                data2;
+    OMX_BUFFERHEADERTYPE*  buffer;
+    void (*call)(struct fake_component* component, OMX_U32 data);
+};
+
+static struct
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    pthread_t        thread;
+    int              init_count;
+    bool             stop;
+    struct fake_job* jobs;
+    uint32_t         frame_counter;
+
+    uint64_t call_us;
+    uint64_t command_us;
+    uint64_t drivers_us;
+    uint64_t frame_us;
+    uint64_t slice_us;
+    uint32_t seed;
+} fake = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*****************************************************************************/
+
+static uint64_t fake_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void fake_sleep(uint64_t us)
+{
+    if(!us)
+        return;
+
+    struct timespec ts = { us/1000000, (us%1000000)*1000 };
+
+    while(nanosleep(&ts, &ts) != 0);
+}
+
+static uint64_t fake_env(const char* name, uint64_t value)
+{
+    const char* env = getenv(name);
+
+    return env ? strtoull(env, NULL, 0) : value;
+}
+
+static struct fake_port* fake_port(struct fake_component* component, OMX_U32 port)
+{
+    OMX_U32 i;
+    for(i=0; i<component->port_count; i++)
+        if(component->ports[i].def.nPortIndex == port)
+            return &component->ports[i];
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+//Jobs are kept sorted by due time, jobs with the same due time keep the order
+//they were scheduled in. Must be called with fake.lock held
+static struct fake_job* fake_schedule(struct fake_component* component, uint64_t due, enum fake_job_type type)
+{
+    struct fake_job* job = calloc(1, sizeof(*job));
+    if(!job)
+        abort();
+
+    job->component = component;
+    job->due       = due;
+    job->type      = type;
+
+    struct fake_job** it = &fake.jobs;
+    while(*it && (*it)->due <= due)
+        it = &(*it)->next;
+
+    job->next = *it;
+    *it = job;
+
+    pthread_cond_signal(&fake.cond);
+
+    return job;
+}
+
+static void fake_event(struct fake_component* component, uint64_t due, OMX_EVENTTYPE event, OMX_U32 data1, OMX_U32 data2)
+{
+    struct fake_job* job = fake_schedule(component, due, JOB_EVENT);
+
+    job->event = event;
+    job->data1 = data1;
+    job->data2 = data2;
+}
+
+static void fake_fill_done(struct fake_component* component, uint64_t due, OMX_BUFFERHEADERTYPE* buffer)
+{
+    fake_schedule(component, due, JOB_FILL_DONE)->buffer = buffer;
+}
+
+static void fake_call(struct fake_component* component, uint64_t due, void (*call)(struct fake_component*, OMX_U32), OMX_U32 data)
+{
+    struct fake_job* job = fake_schedule(component, due, JOB_CALL);
+
+    job->call  = call;
+    job->data1 = data;
+}
+
+static void fake_command_complete(struct fake_component* component, OMX_COMMANDTYPE command, OMX_U32 data)
+{
+    fake_event(component, fake_now() + fake.command_us, OMX_EventCmdComplete, command, data);
+}
+
+//The callback thread. Callbacks are invoked without the lock held, so the
+//application is free to call back into the component from them
+static void* fake_thread(void* arg)
+{
+    pthread_mutex_lock(&fake.lock);
+
+    while(!fake.stop)
+    {
+        if(!fake.jobs)
+        {
+            pthread_cond_wait(&fake.cond, &fake.lock);
+            continue;
+        }
+
+        uint64_t now = fake_now();
+
+        if(fake.jobs->due > now)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            uint64_t wait = fake.jobs->due - now;
+            ts.tv_sec  += wait/1000000;
+            ts.tv_nsec += (wait%1000000)*1000;
+            if(ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&fake.cond, &fake.lock, &ts);
+            continue;
+        }
+
+        struct fake_job* job = fake.jobs;
+        fake.jobs = job->next;
+
+        struct fake_component* component = job->component;
+
+        switch(job->type)
+        {
+            case JOB_CALL:
+                job->call(component, job->data1);
+                break;
+
+            case JOB_EVENT:
+                pthread_mutex_unlock(&fake.lock);
+                component->callbacks.EventHandler(component, component->app_data, job->event, job->data1, job->data2, NULL);
+                pthread_mutex_lock(&fake.lock);
+                break;
+
+            case JOB_FILL_DONE:
+                pthread_mutex_unlock(&fake.lock);
+                component->callbacks.FillBufferDone(component, component->app_data, job->buffer);
+                pthread_mutex_lock(&fake.lock);
+                break;
+        }
+
+        free(job);
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+//Deterministic xorshift generator for the synthetic entropy coded data
+static uint32_t fake_random(uint32_t* state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+static uint8_t* fake_put_marker(uint8_t* p, uint8_t marker, uint16_t length)
+{
+    *p++ = 0xFF;
+    *p++ = marker;
+
+    if(length)
+    {
+        *p++ = length >> 8;
+        *p++ = length & 0xFF;
+    }
+
+    return p;
+}
+
+//Writes a baseline JPEG skeleton with valid marker segments around a random
+//entropy coded segment. The segment payloads are not meaningful image data
+static uint8_t* fake_put_jpeg(uint8_t* p, OMX_U32 width, OMX_U32 height, size_t entropy, uint32_t* seed, const uint8_t* thumbnail, size_t thumbnail_size, bool exif)
+{
+    int i;
+
+    p = fake_put_marker(p, 0xD8, 0);
+
+    if(exif)
+    {
+        static const uint8_t tiff[] = { 'E', 'x', 'i', 'f', 0, 0, 'I', 'I', 0x2A, 0, 8, 0, 0, 0, 0, 0 };
+
+        p = fake_put_marker(p, 0xE1, 2 + sizeof(tiff) + thumbnail_size);
+        memcpy(p, tiff, sizeof(tiff)); p += sizeof(tiff);
+        memcpy(p, thumbnail, thumbnail_size); p += thumbnail_size;
+    }
+    else
+    {
+        static const uint8_t jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+
+        p = fake_put_marker(p, 0xE0, 2 + sizeof(jfif));
+        memcpy(p, jfif, sizeof(jfif)); p += sizeof(jfif);
+    }
+
+    p = fake_put_marker(p, 0xDB, 67);
+    *p++ = 0;
+    for(i=0; i<64; i++)
+        *p++ = 1 + i;
+
+    p = fake_put_marker(p, 0xC0, 17);
+    *p++ = 8;
+    *p++ = height >> 8; *p++ = height & 0xFF;
+    *p++ = width  >> 8; *p++ = width  & 0xFF;
+    *p++ = 3;
+    for(i=0; i<3; i++)
+    {
+        *p++ = i + 1;
+        *p++ = i ? 0x11 : 0x22;
+        *p++ = 0;
+    }
+
+    p = fake_put_marker(p, 0xC4, 2 + 17 + 2);
+    *p++ = 0;
+    for(i=0; i<16; i++)
+        *p++ = i==1 ? 2 : 0;
+    *p++ = 0;
+    *p++ = 1;
+
+    p = fake_put_marker(p, 0xDD, 4);
+    *p++ = 0;
+    *p++ = 64;
+
+    p = fake_put_marker(p, 0xDA, 12);
+    *p++ = 3;
+    for(i=0; i<3; i++)
+    {
+        *p++ = i + 1;
+        *p++ = 0;
+    }
+    *p++ = 0; *p++ = 63; *p++ = 0;
+
+    //Entropy coded data with byte stuffing and restart markers
+    size_t written = 0;
+    uint8_t restart = 0;
+    while(written < entropy)
+    {
+        uint8_t byte = fake_random(seed) >> 24;
+
+        *p++ = byte;
+        if(byte == 0xFF)
+            *p++ = 0x00;
+
+        if(++written % 4096 == 0 && written < entropy)
+        {
+            p = fake_put_marker(p, 0xD0 + restart, 0);
+            restart = (restart + 1) & 7;
+        }
+    }
+
+    return fake_put_marker(p, 0xD9, 0);
+}
+
+static struct fake_frame* fake_encode(struct fake_component* encoder, uint64_t timestamp)
+{
+    struct fake_port* port = fake_port(encoder, 340);
+
+    OMX_U32 width   = port->def.format.image.nFrameWidth;
+    OMX_U32 height  = port->def.format.image.nFrameHeight;
+    OMX_U32 quality = encoder->qfactor ? encoder->qfactor : 75;
+
+    size_t entropy = (size_t)width*height*quality/400 + 1;
+    uint32_t seed  = fake.seed + fake.frame_counter++;
+
+    //Worst case stuffing doubles the entropy coded data
+    size_t capacity = 2*entropy + 2*entropy/4096 + 4096;
+
+    uint8_t thumbnail[2048];
+    size_t thumbnail_size = 0;
+
+    if(encoder->thumbnail && !encoder->exif_disabled)
+        thumbnail_size = fake_put_jpeg(thumbnail, 64, 48, 256, &seed, NULL, 0, false) - thumbnail;
+
+    struct fake_frame* frame = calloc(1, sizeof(*frame));
+    if(!frame || !(frame->data = malloc(capacity + thumbnail_size)))
+        abort();
+
+    frame->size      = fake_put_jpeg(frame->data, width, height, entropy, &seed, thumbnail, thumbnail_size, !encoder->exif_disabled) - frame->data;
+    frame->timestamp = timestamp;
+
+    return frame;
+}
+
+//Moves encoded data into the buffers queued on the output port. Buffers are
+//returned in the order they were queued, one encoding slice apart
+static void fake_encoder_pump(struct fake_component* encoder)
+{
+    struct fake_port* port = fake_port(encoder, 341);
+
+    if(encoder->state != OMX_StateExecuting || !port->def.bEnabled)
+        return;
+
+    while(encoder->frames && port->queue_count)
+    {
+        struct fake_frame* frame = encoder->frames;
+
+        OMX_BUFFERHEADERTYPE* buffer = port->queue[port->queue_head];
+        port->queue_head = (port->queue_head + 1) % FAKE_BUFFERS_MAX;
+        port->queue_count--;
+
+        size_t length = frame->size - frame->position;
+        if(length > buffer->nAllocLen)
+            length = buffer->nAllocLen;
+
+        memcpy(buffer->pBuffer, frame->data + frame->position, length);
+        frame->position += length;
+
+        buffer->nOffset              = 0;
+        buffer->nFilledLen           = length;
+        buffer->nFlags               = 0;
+        buffer->nTimeStamp.nLowPart  = frame->timestamp & 0xFFFFFFFF;
+        buffer->nTimeStamp.nHighPart = frame->timestamp >> 32;
+
+        uint64_t now = fake_now();
+        encoder->busy_until = (encoder->busy_until > now ? encoder->busy_until : now) + fake.slice_us;
+
+        if(frame->position == frame->size)
+        {
+            buffer->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
+
+            if(frame->last)
+            {
+                buffer->nFlags |= OMX_BUFFERFLAG_EOS;
+
+                struct fake_port* input = fake_port(encoder, 340);
+                if(input->peer)
+                    fake_event(input->peer, encoder->busy_until, OMX_EventBufferFlag, input->peer_port, OMX_BUFFERFLAG_EOS);
+                fake_event(encoder, encoder->busy_until, OMX_EventBufferFlag, 341, OMX_BUFFERFLAG_EOS);
+            }
+
+            encoder->frames = frame->next;
+            free(frame->data);
+            free(frame);
+        }
+
+        fake_fill_done(encoder, encoder->busy_until, buffer);
+    }
+}
+
+//Returns every queued buffer empty, as a component does on flush, port
+//disable or when leaving the Executing state
+static void fake_return_buffers(struct fake_component* component, struct fake_port* port)
+{
+    while(port->queue_count)
+    {
+        OMX_BUFFERHEADERTYPE* buffer = port->queue[port->queue_head];
+        port->queue_head = (port->queue_head + 1) % FAKE_BUFFERS_MAX;
+        port->queue_count--;
+
+        buffer->nFilledLen = 0;
+        buffer->nFlags     = 0;
+
+        fake_fill_done(component, fake_now(), buffer);
+    }
+}
+
+static struct fake_component* fake_peer(struct fake_component* component, OMX_U32 port)
+{
+    struct fake_port* p = fake_port(component, port);
+
+    return p && p->def.bEnabled ? p->peer : NULL;
+}
+
+static void fake_frame_ready(struct fake_component* encoder, OMX_U32 last)
+{
+    struct fake_frame* frame = fake_encode(encoder, fake_now());
+    frame->last = last;
+
+    struct fake_frame** it = &encoder->frames;
+    while(*it)
+        it = &(*it)->next;
+    *it = frame;
+
+    fake_encoder_pump(encoder);
+}
+
+//Frames the encoder holds, encoded or waiting, before the free running
+//splitter drops the next ones
+#define FAKE_ENCODER_FRAMES_MAX 2
+
+static void fake_capture_next(struct fake_component* camera, uint64_t due);
+
+//A frame of the sensor is read out, the splitter passes it to the encoder
+//or not. Free running it passes every frame the encoder has room for. In
+//single step it waits for the encoder: after the first frame of the steps,
+//a frame goes through only once the encoder is done with the previous one,
+//and exposed after that. The frames stop when the camera stops capturing or
+//there are no steps left
+static void fake_capture_frame(struct fake_component* camera, OMX_U32 unused)
+{
+    (void)unused;
+
+    struct fake_component* splitter = fake_peer(camera, 71);
+    struct fake_component* encoder  = splitter ? fake_peer(splitter, 251) : NULL;
+
+    if(!splitter || !encoder)
+        return;
+
+    struct fake_port* output = fake_port(splitter, 251);
+    uint64_t due = output->stream_due;
+
+    output->streaming = false;
+
+    if(!fake_port(camera, 71)->capturing || camera->state != OMX_StateExecuting)
+        return;
+
+    if(output->free_running)
+    {
+        unsigned pending = 0;
+        struct fake_frame* frame;
+        for(frame=encoder->frames; frame; frame=frame->next)
+            pending++;
+
+        if(pending < FAKE_ENCODER_FRAMES_MAX)
+            fake_frame_ready(encoder, 0);
+    }
+    else if(output->single_step)
+    {
+        bool idle = !encoder->frames && encoder->busy_until + fake.frame_us <= due;
+
+        if(!output->stepped || idle)
+        {
+            output->single_step--;
+            output->stepped = true;
+
+            fake_frame_ready(encoder, output->single_step == 0);
+        }
+    }
+
+    //From the previous frame, the rate does not drift with the callbacks
+    if(output->free_running || output->single_step)
+        fake_capture_next(camera, due + fake.frame_us);
+}
+
+static void fake_capture_next(struct fake_component* camera, uint64_t due)
+{
+    struct fake_component* splitter = fake_peer(camera, 71);
+    struct fake_port* output = fake_port(splitter, 251);
+
+    if(output->streaming)
+        return;
+
+    output->streaming  = true;
+    output->stream_due = due;
+    fake_call(camera, due, fake_capture_frame, 0);
+}
+
+//Capture on camera port 71 passes through the splitter port 251 into the
+//encoder. The splitter single step count limits the number of frames, with
+//single step 0 they go through until the capture stops
+static void fake_capture_start(struct fake_component* camera)
+{
+    struct fake_component* splitter = fake_peer(camera, 71);
+    if(!splitter || splitter->kind != FAKE_SPLITTER)
+        return;
+
+    struct fake_component* encoder = fake_peer(splitter, 251);
+    if(!encoder || encoder->kind != FAKE_ENCODER)
+        return;
+
+    fake_capture_next(camera, fake_now() + fake.frame_us);
+}
+
+/*****************************************************************************/
+
+static void fake_check_populated(struct fake_component* component, struct fake_port* port)
+{
+    if(port->enabling && port->buffer_count == port->def.nBufferCountActual)
+    {
+        port->enabling = false;
+        port->def.bPopulated = OMX_TRUE;
+        fake_command_complete(component, OMX_CommandPortEnable, port->def.nPortIndex);
+    }
+
+    if(port->disabling && port->buffer_count == 0)
+    {
+        port->disabling = false;
+        port->def.bPopulated = OMX_FALSE;
+        fake_command_complete(component, OMX_CommandPortDisable, port->def.nPortIndex);
+    }
+}
+
+static void fake_port_command(struct fake_component* component, struct fake_port* port, bool enable)
+{
+    //Tunneled ports and ports of a Loaded component complete right away,
+    //others wait until the application (de)populates them
+    bool needs_buffers = !port->peer && component->state != OMX_StateLoaded;
+
+    if(enable)
+    {
+        port->def.bEnabled = OMX_TRUE;
+
+        if(needs_buffers)
+        {
+            port->enabling = true;
+            fake_check_populated(component, port);
+        }
+        else
+            fake_command_complete(component, OMX_CommandPortEnable, port->def.nPortIndex);
+    }
+    else
+    {
+        port->def.bEnabled = OMX_FALSE;
+        fake_return_buffers(component, port);
+
+        if(needs_buffers && port->buffer_count)
+            port->disabling = true;
+        else
+            fake_command_complete(component, OMX_CommandPortDisable, port->def.nPortIndex);
+    }
+}
+
+static OMX_ERRORTYPE fake_send_command(OMX_HANDLETYPE handle, OMX_COMMANDTYPE cmd, OMX_U32 param, OMX_PTR data)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+    OMX_U32 i;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    switch(cmd)
+    {
+        case OMX_CommandStateSet:
+            if(param == component->state)
+            {
+                fake_event(component, fake_now(), OMX_EventError, OMX_ErrorSameState, 0);
+                break;
+            }
+
+            if(component->state == OMX_StateExecuting)
+            {
+                struct fake_frame* frame;
+                while((frame = component->frames))
+                {
+                    component->frames = frame->next;
+                    free(frame->data);
+                    free(frame);
+                }
+
+                for(i=0; i<component->port_count; i++)
+                    fake_return_buffers(component, &component->ports[i]);
+            }
+
+            component->state = param;
+            fake_command_complete(component, OMX_CommandStateSet, param);
+            break;
+
+        case OMX_CommandPortEnable:
+        case OMX_CommandPortDisable:
+            for(i=0; i<component->port_count; i++)
+            {
+                struct fake_port* port = &component->ports[i];
+
+                if(param != OMX_ALL && param != port->def.nPortIndex)
+                    continue;
+
+                fake_port_command(component, port, cmd == OMX_CommandPortEnable);
+            }
+
+            if(param != OMX_ALL && !fake_port(component, param))
+                result = OMX_ErrorBadPortIndex;
+            break;
+
+        case OMX_CommandFlush:
+            for(i=0; i<component->port_count; i++)
+            {
+                if(param != OMX_ALL && param != component->ports[i].def.nPortIndex)
+                    continue;
+
+                fake_return_buffers(component, &component->ports[i]);
+                fake_command_complete(component, OMX_CommandFlush, component->ports[i].def.nPortIndex);
+            }
+            break;
+
+        default:
+            result = OMX_ErrorNotImplemented;
+            break;
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+/*****************************************************************************/
+
+static void fake_update_buffer_size(struct fake_port* port)
+{
+    if(port->def.eDomain == OMX_PortDomainVideo)
+        port->def.nBufferSize = port->def.format.video.nStride * port->def.format.video.nSliceHeight * 3 / 2;
+}
+
+static OMX_ERRORTYPE fake_get_parameter(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR data)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    switch(index)
+    {
+        case OMX_IndexParamAudioInit:
+        case OMX_IndexParamVideoInit:
+        case OMX_IndexParamImageInit:
+        case OMX_IndexParamOtherInit:
+            {
+                OMX_PORT_PARAM_TYPE* ports = data;
+                int domain = index == OMX_IndexParamAudioInit ? 0 :
+                             index == OMX_IndexParamVideoInit ? 1 :
+                             index == OMX_IndexParamImageInit ? 2 : 3;
+
+                ports->nPorts           = component->domains[domain].nPorts;
+                ports->nStartPortNumber = component->domains[domain].nStartPortNumber;
+            }
+            break;
+
+        case OMX_IndexParamPortDefinition:
+            {
+                OMX_PARAM_PORTDEFINITIONTYPE* def = data;
+                struct fake_port* port = fake_port(component, def->nPortIndex);
+
+                if(port)
+                    *def = port->def;
+                else
+                    result = OMX_ErrorBadPortIndex;
+            }
+            break;
+
+        case OMX_IndexParamPortMaxFrameSize:
+            {
+                OMX_FRAMESIZETYPE* size = data;
+                struct fake_port* port = fake_port(component, size->nPortIndex);
+
+                if(port)
+                {
+                    size->nWidth  = port->def.format.video.nFrameWidth;
+                    size->nHeight = port->def.format.video.nFrameHeight;
+                }
+                else
+                    result = OMX_ErrorBadPortIndex;
+            }
+            break;
+
+        default:
+            result = OMX_ErrorUnsupportedIndex;
+            break;
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+static OMX_ERRORTYPE fake_set_parameter(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR data)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    switch(index)
+    {
+        case OMX_IndexParamPortDefinition:
+            {
+                OMX_PARAM_PORTDEFINITIONTYPE* def = data;
+                struct fake_port* port = fake_port(component, def->nPortIndex);
+
+                if(!port)
+                {
+                    result = OMX_ErrorBadPortIndex;
+                    break;
+                }
+
+                if(port->def.bEnabled && component->state != OMX_StateLoaded)
+                {
+                    result = OMX_ErrorIncorrectStateOperation;
+                    break;
+                }
+
+                if(def->nBufferCountActual < port->def.nBufferCountMin || def->nBufferCountActual > FAKE_BUFFERS_MAX)
+                {
+                    result = OMX_ErrorBadParameter;
+                    break;
+                }
+
+                port->def.format             = def->format;
+                port->def.nBufferCountActual = def->nBufferCountActual;
+
+                if(def->nBufferSize > port->def.nBufferSize)
+                    port->def.nBufferSize = def->nBufferSize;
+
+                fake_update_buffer_size(port);
+            }
+            break;
+
+        case OMX_IndexParamQFactor:
+            {
+                OMX_IMAGE_PARAM_QFACTORTYPE* quality = data;
+                struct fake_port* port = fake_port(component, quality->nPortIndex);
+
+                //The quality can only be changed while the output port is
+                //disabled
+                if(!port || component->kind != FAKE_ENCODER)
+                    result = OMX_ErrorBadPortIndex;
+                else if(port->def.bEnabled && component->state != OMX_StateLoaded)
+                    result = OMX_ErrorIncorrectStateOperation;
+                else
+                    component->qfactor = quality->nQFactor;
+            }
+            break;
+
+        case OMX_IndexParamBrcmDisableEXIF:
+            component->exif_disabled = ((OMX_CONFIG_BOOLEANTYPE*)data)->bEnabled;
+            break;
+
+        case OMX_IndexParamBrcmThumbnail:
+            component->thumbnail = ((OMX_PARAM_BRCMTHUMBNAILTYPE*)data)->bEnable;
+            break;
+
+        case OMX_IndexParamCameraDeviceNumber:
+            if(component->callback_device_number)
+                fake_event(component, fake_now() + fake.drivers_us, OMX_EventParamOrConfigChanged, 0, OMX_IndexParamCameraDeviceNumber);
+            break;
+
+        default:
+            //Everything else is accepted and ignored
+            break;
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+static OMX_ERRORTYPE fake_get_config(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR data)
+{
+    fake_sleep(fake.call_us);
+
+    return OMX_ErrorUnsupportedIndex;
+}
+
+static OMX_ERRORTYPE fake_set_config(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR data)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    switch(index)
+    {
+        case OMX_IndexConfigRequestCallback:
+            {
+                OMX_CONFIG_REQUESTCALLBACKTYPE* request = data;
+
+                if(request->nIndex == OMX_IndexParamCameraDeviceNumber)
+                    component->callback_device_number = request->bEnable;
+            }
+            break;
+
+        case OMX_IndexConfigSingleStep:
+            {
+                OMX_PARAM_U32TYPE* step = data;
+                struct fake_port* port = fake_port(component, step->nPortIndex);
+
+                if(!port)
+                {
+                    result = OMX_ErrorBadPortIndex;
+                    break;
+                }
+
+                port->single_step  = step->nU32;
+                port->free_running = step->nU32 == 0;
+                port->stepped      = false;
+
+                //With the camera already capturing the splitter lets the
+                //frames through right away
+                struct fake_component* camera = fake_peer(component, 250);
+
+                if(component->kind == FAKE_SPLITTER && camera && fake_port(camera, 71)->capturing &&
+                        camera->state == OMX_StateExecuting)
+                    fake_capture_start(camera);
+            }
+            break;
+
+        case OMX_IndexConfigPortCapturing:
+            {
+                OMX_CONFIG_PORTBOOLEANTYPE* capturing = data;
+                struct fake_port* port = fake_port(component, capturing->nPortIndex);
+
+                if(!port)
+                {
+                    result = OMX_ErrorBadPortIndex;
+                    break;
+                }
+
+                if(component->kind == FAKE_CAMERA && capturing->bEnabled && !port->capturing)
+                {
+                    if(component->state == OMX_StateExecuting)
+                        fake_capture_start(component);
+                    else
+                        result = OMX_ErrorIncorrectStateOperation;
+                }
+
+                port->capturing = capturing->bEnabled;
+            }
+            break;
+
+        default:
+            //Everything else is accepted and ignored
+            break;
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+static OMX_ERRORTYPE fake_get_state(OMX_HANDLETYPE handle, OMX_STATETYPE* state)
+{
+    struct fake_component* component = handle;
+
+    pthread_mutex_lock(&fake.lock);
+    *state = component->state;
+    pthread_mutex_unlock(&fake.lock);
+
+    return OMX_ErrorNone;
+}
+
+/*****************************************************************************/
+
+static OMX_ERRORTYPE fake_add_buffer(struct fake_component* component, OMX_BUFFERHEADERTYPE** ppBuffer, OMX_U32 nPortIndex, OMX_PTR pAppPrivate, OMX_U32 nSizeBytes, OMX_U8* pBuffer)
+{
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    pthread_mutex_lock(&fake.lock);
+
+    struct fake_port* port = fake_port(component, nPortIndex);
+
+    if(!port || port->peer)
+        result = OMX_ErrorBadPortIndex;
+    else if(nSizeBytes < port->def.nBufferSize || port->buffer_count == FAKE_BUFFERS_MAX)
+        result = OMX_ErrorBadParameter;
+    else
+    {
+        OMX_BUFFERHEADERTYPE* buffer = calloc(1, sizeof(*buffer) + (pBuffer ? 0 : nSizeBytes));
+        if(!buffer)
+            result = OMX_ErrorInsufficientResources;
+        else
+        {
+            buffer->nSize              = sizeof(*buffer);
+            buffer->nVersion.nVersion  = OMX_VERSION;
+            buffer->pBuffer            = pBuffer ? pBuffer : (OMX_U8*)(buffer + 1);
+            buffer->nAllocLen          = nSizeBytes;
+            buffer->pAppPrivate        = pAppPrivate;
+            buffer->pOutputPortPrivate = port;
+            buffer->nOutputPortIndex   = nPortIndex;
+
+            port->buffers[port->buffer_count++] = buffer;
+            *ppBuffer = buffer;
+
+            fake_check_populated(component, port);
+        }
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+static OMX_ERRORTYPE fake_use_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE** ppBuffer, OMX_U32 nPortIndex, OMX_PTR pAppPrivate, OMX_U32 nSizeBytes, OMX_U8* pBuffer)
+{
+    fake_sleep(fake.call_us);
+
+    if(!pBuffer)
+        return OMX_ErrorBadParameter;
+
+    return fake_add_buffer(handle, ppBuffer, nPortIndex, pAppPrivate, nSizeBytes, pBuffer);
+}
+
+static OMX_ERRORTYPE fake_allocate_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE** ppBuffer, OMX_U32 nPortIndex, OMX_PTR pAppPrivate, OMX_U32 nSizeBytes)
+{
+    fake_sleep(fake.call_us);
+
+    return fake_add_buffer(handle, ppBuffer, nPortIndex, pAppPrivate, nSizeBytes, NULL);
+}
+
+static OMX_ERRORTYPE fake_free_buffer(OMX_HANDLETYPE handle, OMX_U32 nPortIndex, OMX_BUFFERHEADERTYPE* buffer)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorBadParameter;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    struct fake_port* port = fake_port(component, nPortIndex);
+
+    OMX_U32 i;
+    for(i=0; port && i<port->buffer_count; i++)
+    {
+        if(port->buffers[i] != buffer)
+            continue;
+
+        port->buffers[i] = port->buffers[--port->buffer_count];
+        free(buffer);
+
+        fake_check_populated(component, port);
+
+        result = OMX_ErrorNone;
+        break;
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+static OMX_ERRORTYPE fake_fill_this_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE* buffer)
+{
+    struct fake_component* component = handle;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    pthread_mutex_lock(&fake.lock);
+
+    struct fake_port* port = buffer ? buffer->pOutputPortPrivate : NULL;
+
+    if(!port || fake_port(component, buffer->nOutputPortIndex) != port)
+        result = OMX_ErrorBadParameter;
+    else if(component->state != OMX_StateExecuting && component->state != OMX_StateIdle)
+        result = OMX_ErrorIncorrectStateOperation;
+    else if(!port->def.bEnabled || port->queue_count == FAKE_BUFFERS_MAX)
+        result = OMX_ErrorIncorrectStateOperation;
+    else
+    {
+        port->queue[(port->queue_head + port->queue_count) % FAKE_BUFFERS_MAX] = buffer;
+        port->queue_count++;
+
+        if(component->kind == FAKE_ENCODER)
+            fake_encoder_pump(component);
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+/*****************************************************************************/
+
+static void fake_add_port(struct fake_component* component, OMX_U32 index, OMX_DIRTYPE dir, OMX_PORTDOMAINTYPE domain)
+{
+    struct fake_port* port = &component->ports[component->port_count++];
+    OMX_PARAM_PORTDEFINITIONTYPE* def = &port->def;
+
+    OMX_INIT_STRUCTURE(*def);
+
+    def->nPortIndex         = index;
+    def->eDir               = dir;
+    def->eDomain            = domain;
+    def->bEnabled           = OMX_TRUE;
+    def->nBufferCountMin    = 1;
+    def->nBufferCountActual = 1;
+    def->nBufferAlignment   = 16;
+
+    if(domain == OMX_PortDomainImage)
+    {
+        def->format.image.nFrameWidth  = 1920;
+        def->format.image.nFrameHeight = 1080;
+        def->format.image.nSliceHeight = 1088;
+        def->format.image.nStride      = 1920;
+
+        if(dir == OMX_DirOutput)
+        {
+            def->format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+            def->nBufferSize = 81920;
+        }
+        else
+        {
+            def->format.image.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+            def->nBufferSize = 1920*1088*3/2;
+        }
+    }
+    else
+    {
+        def->format.video.nFrameWidth  = 1920;
+        def->format.video.nFrameHeight = 1080;
+        def->format.video.nStride      = 1920;
+        def->format.video.nSliceHeight = 1088;
+        def->format.video.xFramerate   = 30 << 16;
+        def->format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+
+        fake_update_buffer_size(port);
+    }
+}
+
+static void fake_add_domain(struct fake_component* component, int domain, OMX_U32 start, OMX_U32 count, OMX_DIRTYPE first_dir, OMX_PORTDOMAINTYPE type)
+{
+    component->domains[domain].nStartPortNumber = start;
+    component->domains[domain].nPorts           = count;
+
+    OMX_U32 i;
+    for(i=0; i<count; i++)
+        fake_add_port(component, start + i, i ? OMX_DirOutput : first_dir, type);
+}
+
+OMX_ERRORTYPE OMX_GetHandle(OMX_HANDLETYPE* pHandle, OMX_STRING cComponentName, OMX_PTR pAppData, OMX_CALLBACKTYPE* pCallBacks)
+{
+    static const struct { const char* name; enum fake_kind kind; } names[] =
+    {
+        { "OMX.broadcom.camera",         FAKE_CAMERA    },
+        { "OMX.broadcom.null_sink",      FAKE_NULL_SINK },
+        { "OMX.broadcom.video_splitter", FAKE_SPLITTER  },
+        { "OMX.broadcom.image_encode",   FAKE_ENCODER   },
+    };
+
+    if(!pHandle || !cComponentName || !pCallBacks)
+        return OMX_ErrorBadParameter;
+
+    size_t i;
+    for(i=0; i<sizeof(names)/sizeof(names[0]); i++)
+        if(strcmp(names[i].name, cComponentName) == 0)
+            break;
+
+    if(i == sizeof(names)/sizeof(names[0]))
+        return OMX_ErrorComponentNotFound;
+
+    struct fake_component* component = calloc(1, sizeof(*component));
+    if(!component)
+        return OMX_ErrorInsufficientResources;
+
+    component->base.nSize              = sizeof(component->base);
+    component->base.nVersion.nVersion  = OMX_VERSION;
+    component->base.pComponentPrivate  = component;
+    component->base.SendCommand        = fake_send_command;
+    component->base.GetParameter       = fake_get_parameter;
+    component->base.SetParameter       = fake_set_parameter;
+    component->base.GetConfig          = fake_get_config;
+    component->base.SetConfig          = fake_set_config;
+    component->base.GetState           = fake_get_state;
+    component->base.UseBuffer          = fake_use_buffer;
+    component->base.AllocateBuffer     = fake_allocate_buffer;
+    component->base.FreeBuffer         = fake_free_buffer;
+    component->base.FillThisBuffer     = fake_fill_this_buffer;
+
+    component->kind      = names[i].kind;
+    component->name      = cComponentName;
+    component->state     = OMX_StateLoaded;
+    component->callbacks = *pCallBacks;
+    component->app_data  = pAppData;
+
+    switch(component->kind)
+    {
+        case FAKE_CAMERA:
+            fake_add_domain(component, 1, 70, 2, OMX_DirOutput, OMX_PortDomainVideo);
+            fake_add_domain(component, 2, 72, 1, OMX_DirOutput, OMX_PortDomainImage);
+            fake_add_domain(component, 3, 73, 1, OMX_DirInput,  OMX_PortDomainOther);
+            break;
+
+        case FAKE_NULL_SINK:
+            fake_add_domain(component, 1, 240, 1, OMX_DirInput, OMX_PortDomainVideo);
+            break;
+
+        case FAKE_SPLITTER:
+            fake_add_domain(component, 1, 250, 5, OMX_DirInput, OMX_PortDomainVideo);
+            break;
+
+        case FAKE_ENCODER:
+            fake_add_domain(component, 2, 340, 2, OMX_DirInput, OMX_PortDomainImage);
+            break;
+    }
+
+    *pHandle = component;
+
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_FreeHandle(OMX_HANDLETYPE hComponent)
+{
+    struct fake_component* component = hComponent;
+
+    if(!component)
+        return OMX_ErrorBadParameter;
+
+    pthread_mutex_lock(&fake.lock);
+
+    //Drop the pending callbacks of the component
+    struct fake_job** it = &fake.jobs;
+    while(*it)
+    {
+        struct fake_job* job = *it;
+
+        if(job->component == component)
+        {
+            *it = job->next;
+            free(job);
+        }
+        else
+            it = &job->next;
+    }
+
+    OMX_U32 i, j;
+    for(i=0; i<component->port_count; i++)
+    {
+        struct fake_port* port = &component->ports[i];
+
+        for(j=0; j<port->buffer_count; j++)
+            free(port->buffers[j]);
+
+        //Break the tunnel on the other side
+        if(port->peer)
+        {
+            struct fake_port* peer = fake_port(port->peer, port->peer_port);
+            if(peer)
+                peer->peer = NULL;
+        }
+    }
+
+    struct fake_frame* frame;
+    while((frame = component->frames))
+    {
+        component->frames = frame->next;
+        free(frame->data);
+        free(frame);
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    free(component);
+
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE OMX_SetupTunnel(OMX_HANDLETYPE hOutput, OMX_U32 nPortOutput, OMX_HANDLETYPE hInput, OMX_U32 nPortInput)
+{
+    struct fake_component* output = hOutput;
+    struct fake_component* input  = hInput;
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    fake_sleep(fake.call_us);
+
+    pthread_mutex_lock(&fake.lock);
+
+    struct fake_port* out = output ? fake_port(output, nPortOutput) : NULL;
+    struct fake_port* in  = input  ? fake_port(input,  nPortInput)  : NULL;
+
+    if(!out || !in || out->def.eDir != OMX_DirOutput || in->def.eDir != OMX_DirInput)
+        result = OMX_ErrorBadPortIndex;
+    else if((out->def.bEnabled && output->state != OMX_StateLoaded) || (in->def.bEnabled && input->state != OMX_StateLoaded))
+        result = OMX_ErrorIncorrectStateOperation;
+    else
+    {
+        out->peer = input;  out->peer_port = nPortInput;
+        in->peer  = output; in->peer_port  = nPortOutput;
+
+        //The input port takes the format of the output port. Image and video
+        //port formats share the geometry fields
+        in->def.format.video.nFrameWidth  = out->def.format.video.nFrameWidth;
+        in->def.format.video.nFrameHeight = out->def.format.video.nFrameHeight;
+        in->def.format.video.nStride      = out->def.format.video.nStride;
+        in->def.format.video.nSliceHeight = out->def.format.video.nSliceHeight;
+        if(in->def.eDomain == OMX_PortDomainImage)
+        {
+            in->def.format.image.nFrameWidth  = out->def.format.video.nFrameWidth;
+            in->def.format.image.nFrameHeight = out->def.format.video.nFrameHeight;
+            in->def.format.image.nStride      = out->def.format.video.nStride;
+            in->def.format.image.nSliceHeight = out->def.format.video.nSliceHeight;
+        }
+
+        //The splitter propagates the new input format to its outputs
+        if(input->kind == FAKE_SPLITTER)
+        {
+            OMX_U32 i;
+            for(i=0; i<input->port_count; i++)
+            {
+                if(input->ports[i].def.eDir != OMX_DirOutput)
+                    continue;
+
+                input->ports[i].def.format.video = in->def.format.video;
+                fake_update_buffer_size(&input->ports[i]);
+            }
+
+            fake_event(input, fake_now(), OMX_EventPortSettingsChanged, 251, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+/*****************************************************************************/
+
+OMX_ERRORTYPE OMX_Init(void)
+{
+    OMX_ERRORTYPE result = OMX_ErrorNone;
+
+    pthread_mutex_lock(&fake.lock);
+
+    if(fake.init_count++ == 0)
+    {
+        fake.call_us    = fake_env("FAKE_OMX_CALL_US",    FAKE_DEFAULT_CALL_US);
+        fake.command_us = fake_env("FAKE_OMX_COMMAND_US", FAKE_DEFAULT_COMMAND_US);
+        fake.drivers_us = fake_env("FAKE_OMX_DRIVERS_US", FAKE_DEFAULT_DRIVERS_US);
+        fake.frame_us   = fake_env("FAKE_OMX_FRAME_US",   FAKE_DEFAULT_FRAME_US);
+        fake.slice_us   = fake_env("FAKE_OMX_SLICE_US",   FAKE_DEFAULT_SLICE_US);
+        fake.seed       = fake_env("FAKE_OMX_SEED",       2463534242u);
+        fake.stop       = false;
+
+        if(pthread_create(&fake.thread, NULL, fake_thread, NULL) != 0)
+        {
+            fake.init_count = 0;
+            result = OMX_ErrorInsufficientResources;
+        }
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+
+    return result;
+}
+
+OMX_ERRORTYPE OMX_Deinit(void)
+{
+    pthread_mutex_lock(&fake.lock);
+
+    if(fake.init_count == 0 || --fake.init_count > 0)
+    {
+        pthread_mutex_unlock(&fake.lock);
+        return OMX_ErrorNone;
+    }
+
+    fake.stop = true;
+    pthread_cond_signal(&fake.cond);
+
+    pthread_mutex_unlock(&fake.lock);
+
+    pthread_join(fake.thread, NULL);
+
+    struct fake_job* job;
+    while((job = fake.jobs))
+    {
+        fake.jobs = job->next;
+        free(job);
+    }
+
+    return OMX_ErrorNone;
+}
+
+void bcm_host_init(void)
+{
+}
+
+void bcm_host_deinit(void)
+{
+}
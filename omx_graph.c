@@ -0,0 +1,295 @@
+#include "omx_graph.h"
+
+#include "logerr.h"
+#include "omx.h"
+
+//Checks the description and sorts the nodes so every node comes after the
+//nodes tunneled to it
+static WARN_UNUSED
+enum error_code sort_nodes(graph_t* graph)
+{
+    const graph_description_t* description = graph->description;
+
+    if(description->nodes_count > GRAPH_NODES_MAX ||
+       description->edges_count > GRAPH_EDGES_MAX ||
+       description->sinks_count > GRAPH_SINKS_MAX)
+    {
+        LOG_ERROR("graph: too many nodes, edges or sinks");
+        return ERROR;
+    }
+
+    unsigned inputs[GRAPH_NODES_MAX] = { 0 };
+
+    unsigned i;
+    for(i=0; i<description->edges_count; i++)
+    {
+        const graph_edge_t* edge = &description->edges[i];
+
+        if(edge->from >= description->nodes_count || edge->to >= description->nodes_count)
+        {
+            LOG_ERROR("graph: edge %d refers to an unknown node", i);
+            return ERROR;
+        }
+
+        inputs[edge->to]++;
+    }
+
+    for(i=0; i<description->sinks_count; i++)
+    {
+        const graph_sink_t* sink = &description->sinks[i];
+
+        if(sink->node >= description->nodes_count || sink->buffers < 1 || sink->buffers > GRAPH_BUFFERS_MAX)
+        {
+            LOG_ERROR("graph: sink %d refers to an unknown node or has %d buffers", i, sink->buffers);
+            return ERROR;
+        }
+    }
+
+    //Take the nodes without pending inputs, lowest index first so the order is
+    //the one of the description when there is a choice
+    unsigned sorted = 0;
+    int taken[GRAPH_NODES_MAX] = { 0 };
+
+    while(sorted < description->nodes_count)
+    {
+        unsigned node;
+        for(node=0; node<description->nodes_count; node++)
+        {
+            if(!taken[node] && inputs[node] == 0)
+                break;
+        }
+
+        if(node == description->nodes_count)
+        {
+            LOG_ERROR("graph: the tunnels make a cycle");
+            return ERROR;
+        }
+
+        taken[node] = 1;
+        graph->order[sorted++] = node;
+
+        for(i=0; i<description->edges_count; i++)
+        {
+            if(description->edges[i].from == node)
+                inputs[description->edges[i].to]--;
+        }
+    }
+
+    return OK;
+}
+
+//Both ends of every tunnel
+static unsigned tunnel_ports(graph_t* graph, component_port_t* ports)
+{
+    unsigned count = 0;
+
+    unsigned i;
+    for(i=0; i<graph->description->edges_count; i++)
+    {
+        const graph_edge_t* edge = &graph->description->edges[i];
+
+        ports[count].component = &graph->components[edge->from];
+        ports[count].port      = edge->from_port;
+        count++;
+
+        ports[count].component = &graph->components[edge->to];
+        ports[count].port      = edge->to_port;
+        count++;
+    }
+
+    return count;
+}
+
+static WARN_UNUSED
+enum error_code change_state_graph(graph_t* graph, OMX_STATETYPE state, int sinks_first)
+{
+    component_t* components[GRAPH_NODES_MAX];
+    unsigned count = graph->description->nodes_count;
+
+    unsigned i;
+    for(i=0; i<count; i++)
+    {
+        unsigned node = graph->order[sinks_first ? count - 1 - i : i];
+
+        components[i] = &graph->components[node];
+    }
+
+    return change_state_all(components, count, state);
+}
+
+enum error_code graph_open(graph_t* graph, const graph_description_t* description, const graph_hooks_t* hooks)
+{
+    enum error_code result;
+    unsigned i, j;
+
+    graph->description = description;
+
+    result = sort_nodes(graph); if(result!=OK) { return result; }
+
+    //Initialize components
+    for(i=0; i<description->nodes_count; i++)
+    {
+        graph->components[i].name = (OMX_STRING)description->nodes[i];
+
+        result = init_component(&graph->components[i]); if(result!=OK) { return result; }
+    }
+
+    if(hooks && hooks->configure)
+    {
+        for(i=0; i<description->nodes_count; i++)
+        {
+            result = hooks->configure(graph, graph->order[i], hooks->context); if(result!=OK) { return result; }
+        }
+    }
+
+    //Setup tunnels, the ones leaving each node in topological order
+    LOG_MESSAGE("configuring tunnels");
+
+    for(i=0; i<description->nodes_count; i++)
+    {
+        for(j=0; j<description->edges_count; j++)
+        {
+            const graph_edge_t* edge = &description->edges[j];
+
+            if(edge->from != graph->order[i])
+                continue;
+
+            result = omx_setup_tunnel(
+                    graph->components[edge->from].handle, edge->from_port,
+                    graph->components[edge->to  ].handle, edge->to_port); if(result!=OK) { return result; }
+
+            //The input port takes the format of the output port
+            forget_port_definitions(&graph->components[edge->to]);
+
+            if(hooks && hooks->tunneled)
+            {
+                result = hooks->tunneled(graph, j, hooks->context); if(result!=OK) { return result; }
+            }
+        }
+    }
+
+    //Change state to IDLE, all the components at once
+    result = change_state_graph(graph, OMX_StateIdle, 0); if(result!=OK) { return result; }
+
+    //Enable the tunnel ports, all of them at once
+    component_port_t ports[2*GRAPH_EDGES_MAX];
+    unsigned count = tunnel_ports(graph, ports);
+
+    result = enable_ports(ports, count); if(result!=OK) { return result; }
+
+    for(i=0; i<description->sinks_count; i++)
+    {
+        result = graph_sink_enable(graph, i); if(result!=OK) { return result; }
+    }
+
+    //Change state to EXECUTING, the consumers are requested first so they are
+    //ready when the producers start
+    result = change_state_graph(graph, OMX_StateExecuting, 1); if(result!=OK) { return result; }
+
+    return OK;
+}
+
+enum error_code graph_close(graph_t* graph)
+{
+    const graph_description_t* description = graph->description;
+    enum error_code result;
+    unsigned i;
+
+    //Change state to IDLE, the producers are requested first
+    result = change_state_graph(graph, OMX_StateIdle, 0); if(result!=OK) { return result; }
+
+    //Disable the tunnel ports, all of them at once
+    component_port_t ports[2*GRAPH_EDGES_MAX];
+    unsigned count = tunnel_ports(graph, ports);
+
+    result = disable_ports(ports, count); if(result!=OK) { return result; }
+
+    for(i=0; i<description->sinks_count; i++)
+    {
+        result = graph_sink_disable(graph, i); if(result!=OK) { return result; }
+    }
+
+    //Change state to LOADED, all the components at once
+    result = change_state_graph(graph, OMX_StateLoaded, 0); if(result!=OK) { return result; }
+
+    //Deinitialize components
+    for(i=0; i<description->nodes_count; i++)
+    {
+        result = deinit_component(&graph->components[i]); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+enum error_code graph_sink_enable(graph_t* graph, unsigned sink)
+{
+    const graph_sink_t* description = &graph->description->sinks[sink];
+    component_t* component = &graph->components[description->node];
+    enum error_code result;
+
+    //The number of buffers is set by the graph, the port must be able to use
+    //them
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
+
+    result = get_port_definition(component, description->port, &port_def); if(result!=OK) { return result; }
+
+    if(description->buffers < port_def.nBufferCountMin)
+    {
+        LOG_ERROR_COMPONENT(component, "port %d needs at least %d buffers, %d set", description->port, port_def.nBufferCountMin, description->buffers);
+        return ERROR;
+    }
+
+    if(port_def.nBufferCountActual != description->buffers)
+    {
+        port_def.nBufferCountActual = description->buffers;
+
+        result = set_port_definition(component, &port_def); if(result!=OK) { return result; }
+    }
+
+    if(!graph->memory_size[sink])
+        return port_enable_allocate_buffer(component, graph->buffers[sink], description->buffers, description->port);
+
+    if(graph->memory_size[sink] < port_def.nBufferSize)
+    {
+        LOG_ERROR_COMPONENT(component, "port %d needs buffers of %d bytes, %d given", description->port, port_def.nBufferSize, graph->memory_size[sink]);
+        return ERROR;
+    }
+
+    unsigned i;
+    for(i=0; i<description->buffers; i++)
+    {
+        if(port_def.nBufferAlignment && (uintptr_t)graph->memory[sink][i] % port_def.nBufferAlignment)
+        {
+            LOG_ERROR_COMPONENT(component, "port %d needs buffers aligned to %d bytes", description->port, port_def.nBufferAlignment);
+            return ERROR;
+        }
+    }
+
+    return port_enable_use_buffer(component, graph->buffers[sink], description->buffers, description->port, graph->memory[sink], graph->memory_size[sink]);
+}
+
+enum error_code graph_sink_disable(graph_t* graph, unsigned sink)
+{
+    const graph_sink_t* description = &graph->description->sinks[sink];
+
+    return port_disable_free_buffer(&graph->components[description->node], graph->buffers[sink], description->buffers, description->port);
+}
+
+void graph_sink_use_memory(graph_t* graph, unsigned sink, OMX_U8* const* memory, OMX_U32 size)
+{
+    unsigned i;
+    for(i=0; i<graph->description->sinks[sink].buffers; i++)
+        graph->memory[sink][i] = memory ? memory[i] : NULL;
+
+    graph->memory_size[sink] = memory ? size : 0;
+}
+
+component_t* graph_component(graph_t* graph, unsigned node)
+{
+    return &graph->components[node];
+}
+
+OMX_BUFFERHEADERTYPE** graph_sink_buffers(graph_t* graph, unsigned sink)
+{
+    return graph->buffers[sink];
+}
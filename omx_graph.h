@@ -0,0 +1,95 @@
+#ifndef  OMX_GRAPH_INC
+#define  OMX_GRAPH_INC
+
+#include <IL/OMX_Broadcom.h>
+
+#include "error.h"
+#include "omx_component.h"
+
+/*
+   A pipeline described as a graph: the nodes are components, the edges are
+   tunnels between their ports and the sinks are output ports whose buffers
+   are owned by the application.
+
+   graph_open() loads the components, sets up the tunnels and takes the whole
+   graph to EXECUTING, graph_close() undoes it. The components are handled in
+   topological order (sources first), the hooks let the user configure them
+   at the points the tunnels require.
+   */
+
+#define GRAPH_NODES_MAX   8
+#define GRAPH_EDGES_MAX   8
+#define GRAPH_SINKS_MAX   4
+#define GRAPH_BUFFERS_MAX 16
+
+//A tunnel from an output port of a node to an input port of another
+typedef struct
+{
+    unsigned from;
+    OMX_U32  from_port;
+    unsigned to;
+    OMX_U32  to_port;
+} graph_edge_t;
+
+//An output port that is not tunneled, the application fills its buffers
+typedef struct
+{
+    unsigned node;
+    OMX_U32  port;
+    unsigned buffers;
+} graph_sink_t;
+
+typedef struct
+{
+    //The component names, the nodes are referred by their index
+    const char*  nodes[GRAPH_NODES_MAX];
+    unsigned     nodes_count;
+    graph_edge_t edges[GRAPH_EDGES_MAX];
+    unsigned     edges_count;
+    graph_sink_t sinks[GRAPH_SINKS_MAX];
+    unsigned     sinks_count;
+} graph_description_t;
+
+struct graph;
+
+//Called by graph_open(), any of them can be NULL
+typedef struct
+{
+    //Once per node, in topological order, when all the components are loaded
+    //and before any tunnel is set up
+    enum error_code (*configure)(struct graph* graph, unsigned node, void* context);
+    //After each tunnel is set up. The tunnels leaving a node are set up after
+    //all the tunnels arriving to it, so the node can be configured here once
+    //its input is known
+    enum error_code (*tunneled)(struct graph* graph, unsigned edge, void* context);
+    void* context;
+} graph_hooks_t;
+
+typedef struct graph
+{
+    const graph_description_t* description;
+    component_t                components[GRAPH_NODES_MAX];
+    //Node indexes in topological order, sources first
+    unsigned                   order[GRAPH_NODES_MAX];
+    //Buffers of each sink, allocated while the sink is enabled
+    OMX_BUFFERHEADERTYPE*      buffers[GRAPH_SINKS_MAX][GRAPH_BUFFERS_MAX];
+    //Memory given by the application for the buffers of each sink, the
+    //component allocates it when the size is 0
+    OMX_U8*                    memory[GRAPH_SINKS_MAX][GRAPH_BUFFERS_MAX];
+    OMX_U32                    memory_size[GRAPH_SINKS_MAX];
+} graph_t;
+
+WARN_UNUSED enum error_code graph_open         (graph_t* graph, const graph_description_t* description, const graph_hooks_t* hooks);
+WARN_UNUSED enum error_code graph_close        (graph_t* graph);
+WARN_UNUSED enum error_code graph_sink_enable  (graph_t* graph, unsigned sink);
+WARN_UNUSED enum error_code graph_sink_disable (graph_t* graph, unsigned sink);
+
+//Memory for the buffers of the sink, one block of size bytes per buffer. It
+//is used from the next graph_sink_enable(), NULL goes back to the memory of
+//the component
+void graph_sink_use_memory(graph_t* graph, unsigned sink, OMX_U8* const* memory, OMX_U32 size);
+
+component_t*           graph_component   (graph_t* graph, unsigned node);
+OMX_BUFFERHEADERTYPE** graph_sink_buffers(graph_t* graph, unsigned sink);
+
+#endif
@@ -20,6 +20,21 @@ omx_parameter_camera_device_number(
 
 /*****************************************************************************/
 
+enum error_code
+omx_parameter_camera_custom_sensor_config(
+        OMX_IN OMX_HANDLETYPE hComponent,
+        OMX_IN OMX_U32        nU32)
+{
+    OMX_PARAM_U32TYPE sensor_st; OMX_INIT_STRUCTURE (sensor_st);
+
+    sensor_st.nPortIndex = OMX_ALL;
+    sensor_st.nU32       = nU32;    //Sensor mode, 0 lets the firmware choose
+
+    return omx_set_parameter(hComponent, OMX_IndexParamCameraCustomSensorConfig, &sensor_st);
+}
+
+/*****************************************************************************/
+
 enum error_code
 omx_parameter_qfactor(
         OMX_IN OMX_HANDLETYPE hComponent,
@@ -15,6 +15,13 @@ omx_parameter_camera_device_number(
 
 /*****************************************************************************/
 
+WARN_UNUSED enum error_code
+omx_parameter_camera_custom_sensor_config(
+        OMX_IN OMX_HANDLETYPE hComponent,
+        OMX_IN OMX_U32        nU32);
+
+/*****************************************************************************/
+
 WARN_UNUSED enum error_code
 omx_parameter_qfactor(
         OMX_IN OMX_HANDLETYPE hComponent,
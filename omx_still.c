@@ -1,6 +1,13 @@
 #include "omx_still.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <bcm_host.h>
 
 #include "logerr.h"
@@ -10,6 +17,9 @@
 #include "omx_config.h"
 #include "omx_parameter.h"
 #include "omx_component.h"
+#include "omx_graph.h"
+#include "latency.h"
+#include "jpeg_parser.h"
 
 #define JPEG_QUALITY                75        //    1 ..  100
 #define JPEG_EXIF_DISABLE           OMX_FALSE
@@ -18,10 +28,23 @@
 #define JPEG_THUMBNAIL_WIDTH        64        //    0 .. 1024
 #define JPEG_THUMBNAIL_HEIGHT       48        //    0 .. 1024
 #define JPEG_PREVIEW                OMX_FALSE
+//Output buffers kept queued on the encoder, so it does not stall while the
+//handler processes a slice
+#define JPEG_OUTPUT_BUFFERS         OMX_STILL_OUTPUT_BUFFERS
+
+#define CAMERA_PREVIEW_PORT         70
+#define CAMERA_VIDEO_PORT           71
+#define CAMERA_STILL_PORT           72
+#define NULL_SINK_INPUT_PORT        240
+#define SPLITTER_INPUT_PORT         250
+#define SPLITTER_OUTPUT_PORT        251
+#define ENCODER_INPUT_PORT          340
+#define ENCODER_OUTPUT_PORT         341
 
 //Some settings doesn't work well
-#define CAM_WIDTH                   2464      // 3280 // 2592
-#define CAM_HEIGHT                  3280      // 2464 // 1944
+//Frame of the sensor when no size is given, IMX219 (2592x1944 on the OV5647)
+#define CAM_SENSOR_WIDTH            3280
+#define CAM_SENSOR_HEIGHT           2464
 #define CAM_SHARPNESS               0         // -100 ..  100
 #define CAM_CONTRAST                0         // -100 ..  100
 #define CAM_BRIGHTNESS              50        //    0 ..  100
@@ -34,7 +57,6 @@
 #define CAM_EXPOSURE                OMX_ExposureControlOff
 #define CAM_EXPOSURE_COMPENSATION   0         //  -24 ..   24
 #define CAM_MIRROR                  OMX_MirrorNone
-#define CAM_ROTATION                90        // 0 90 180 270
 #define CAM_COLOR_ENABLE            OMX_FALSE
 #define CAM_COLOR_U                 128       //    0 ..  255
 #define CAM_COLOR_V                 128       //    0 ..  255
@@ -122,12 +144,185 @@
    OMX_DynRangeExpHigh
    */
 
-component_t camera;
-component_t null_sink;
-component_t splitter;
-component_t encoder;
+//Nodes of the pipeline graph
+enum
+{
+    NODE_CAMERA,
+    NODE_NULL_SINK,
+    NODE_SPLITTER,
+    NODE_ENCODER
+};
+
+//camera (video) -> splitter -> image_encode, camera (preview) -> null_sink.
+//The JPEG slices are read from the encoder output port
+static const graph_description_t still_graph =
+{
+    .nodes =
+    {
+        [NODE_CAMERA]    = "OMX.broadcom.camera",
+        [NODE_NULL_SINK] = "OMX.broadcom.null_sink",
+        [NODE_SPLITTER]  = "OMX.broadcom.video_splitter",
+        [NODE_ENCODER]   = "OMX.broadcom.image_encode"
+    },
+    .nodes_count = 4,
+    .edges =
+    {
+        { NODE_CAMERA,   CAMERA_VIDEO_PORT,    NODE_SPLITTER,  SPLITTER_INPUT_PORT  },
+        { NODE_SPLITTER, SPLITTER_OUTPUT_PORT, NODE_ENCODER,   ENCODER_INPUT_PORT   },
+        { NODE_CAMERA,   CAMERA_PREVIEW_PORT,  NODE_NULL_SINK, NULL_SINK_INPUT_PORT }
+    },
+    .edges_count = 3,
+    .sinks =
+    {
+        { NODE_ENCODER, ENCODER_OUTPUT_PORT, JPEG_OUTPUT_BUFFERS }
+    },
+    .sinks_count = 1
+};
+
+//The only sink of the graph
+#define JPEG_SINK 0
+
+//A polled session waiting in omx_still_wait() checks the timeouts this often
+#define POLL_INTERVAL_MS 100
+
+//Of the camera video port, the frames of a continuous burst come this often
+#define CAMERA_FRAMERATE 15
+#define FRAME_INTERVAL_US (1000000 / CAMERA_FRAMERATE)
 
-OMX_BUFFERHEADERTYPE* output_buffer;
+//Steps of the request being run by omx_still_process_events()
+typedef enum
+{
+    STEP_START,
+    STEP_FRAMES,
+    STEP_SPLITTER_FLAG,
+    STEP_ENCODER_FLAG
+} request_step;
+
+//A shot in progress, the consumer thread runs the handler of every buffer
+struct still_shot
+{
+    uint32_t              frames;
+    buffer_output_handler handler;
+    buffer_lend_handler   lend_handler;
+    void*                 context;
+    //Frames are split where the JPEG markers say, the encoder flags are
+    //only checked against them
+    jpeg_parser_t         parser;
+    uint32_t              frame;
+    //Continuous burst: the splitter streams and the frames past frames are
+    //not passed to the handler, frames is lowered to end by deadline (0 if
+    //none). ending once the consumer knows the next frame is the last one,
+    //stopping once the runner set the splitter back to single step for it
+    bool                  continuous;
+    uint64_t              deadline;
+    bool                  ending;
+    bool                  stopping;
+    //Timestamps of the first and the last frame passed to the handler, the
+    //frames of the sensor missing between them and the frames encoded after
+    //the end
+    uint64_t              first_timestamp;
+    uint64_t              last_timestamp;
+    uint32_t              dropped;
+    uint32_t              overrun;
+};
+
+//A shot queued in the session, with the settings it needs
+struct still_request
+{
+    bool                             has_config;
+    struct camera_shot_configuration config;
+    //Replaces the memory of the output buffers, see omx_still_use_memory()
+    bool                             use_memory;
+    uint8_t* const*                  memory;
+    size_t                           memory_size;
+    //0 only applies the settings
+    uint32_t                         frames;
+    //A continuous burst of frames (UINT32_MAX if no count) or duration_ms
+    bool                             continuous;
+    uint32_t                         duration_ms;
+    still_burst_report*              report;
+    buffer_output_handler            handler;
+    buffer_lend_handler              lend_handler;
+    shot_complete_handler            complete;
+    void*                            context;
+    //Nobody waits for it, released once complete
+    bool                             detached;
+    bool                             done;
+    enum error_code                  result;
+    still_request*                   next;
+};
+
+//Size of the frames on every port of the pipeline, see frame_geometry()
+typedef struct
+{
+    OMX_U32 width;
+    OMX_U32 height;
+    OMX_U32 stride;
+    OMX_U32 slice_height;
+    OMX_S32 rotation;
+    OMX_U32 sensor_mode;
+} frame_geometry_t;
+
+struct still_session
+{
+    graph_t graph;
+    //Runs the queued requests in order. Every request is dequeued when it
+    //starts, done is signalled on the same condition
+    pthread_t       runner;
+    bool            runner_running;
+    pthread_mutex_t requests_lock;
+    pthread_cond_t  requests_cond;
+    still_request*  requests_first;
+    still_request*  requests_last;
+    bool            stopping;
+    //eventfd written once per completed request
+    int             completion_fd;
+    //Opened with omx_still_open_polled(): there is no thread, the caller
+    //runs the requests with omx_still_process_events() when event_fd (set on
+    //every component) is readable
+    bool            polled;
+    int             event_fd;
+    still_request*  current;
+    request_step    step;
+    //The current step fails with TIMEOUT if nothing happens until then
+    uint64_t        deadline;
+    //The capture port of the camera stays enabled while there are shots
+    //queued, the splitter lets the frames of every shot through
+    bool            capturing;
+    //Takes the filled buffers from the encoder ring, runs the handler and
+    //queues them again. The shoot only wakes up at the end of every frame
+    pthread_t consumer;
+    bool      consumer_running;
+    //Held by the consumer while it processes a buffer, guards the shot
+    pthread_mutex_t shot_lock;
+    bool            shooting;
+    struct still_shot shot;
+    //Number of output buffers owned by the encoder. Buffers are released
+    //from the consumer threads, both are updated atomically
+    unsigned output_buffers_queued;
+    //Number of output buffers owned by the consumer
+    unsigned output_buffers_lent;
+    //What the consumer sees of each output buffer, same order as the sink
+    still_buffer lent[JPEG_OUTPUT_BUFFERS];
+    //Set while the matching lent slot is owned by the consumer, exchanged
+    //atomically on release so a slot is never requeued twice
+    bool lent_out[JPEG_OUTPUT_BUFFERS];
+    //Settings currently applied to the running pipeline
+    struct camera_shot_configuration current_config;
+    //Fixed by omx_still_open()
+    frame_geometry_t geometry;
+};
+
+//The VideoCore and OpenMAX IL libraries are initialized by the first open
+//session and released by the last one
+static pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned library_users = 0;
+
+//Process wide options, see omx_still_diagnostics() and
+//omx_still_port_cache(). Guarded by the library lock
+static bool  diagnostics = false;
+static char* port_cache_path = NULL;
+static bool  port_cache_loaded = false;
 
 static WARN_UNUSED
 int round_up(int value, int divisor)
@@ -135,53 +330,114 @@ int round_up(int value, int divisor)
     return (divisor + value - 1) & ~(divisor - 1);
 }
 
+//The only place the sizes of the ports come from
+static WARN_UNUSED
+enum error_code frame_geometry(struct camera_shot_configuration config, frame_geometry_t* geometry)
+{
+    if(config.rotation < 0 || config.rotation >= 360 || config.rotation % 90)
+    {
+        LOG_ERROR("rotation of %d degrees, it must be 0, 90, 180 or 270", config.rotation);
+        return ERROR;
+    }
+
+    if(config.sensorMode != CAMERA_SENSOR_MODE_AUTO &&
+       config.sensorMode != CAMERA_SENSOR_MODE_FULL &&
+       config.sensorMode != CAMERA_SENSOR_MODE_BINNED)
+    {
+        LOG_ERROR("unknown sensor mode %d", config.sensorMode);
+        return ERROR;
+    }
+
+    if(!config.width != !config.height)
+    {
+        LOG_ERROR("frame size of %dx%d, both or none must be given", config.width, config.height);
+        return ERROR;
+    }
+
+    geometry->rotation    = config.rotation;
+    geometry->sensor_mode = config.sensorMode;
+
+    if(config.width)
+    {
+        geometry->width  = config.width;
+        geometry->height = config.height;
+    }
+    else
+    {
+        int binned = config.sensorMode == CAMERA_SENSOR_MODE_BINNED;
+        int turned = config.rotation == 90 || config.rotation == 270;
+
+        OMX_U32 width  = binned ? CAM_SENSOR_WIDTH /2 : CAM_SENSOR_WIDTH;
+        OMX_U32 height = binned ? CAM_SENSOR_HEIGHT/2 : CAM_SENSOR_HEIGHT;
+
+        geometry->width  = turned ? height : width;
+        geometry->height = turned ? width  : height;
+    }
+
+    //Stride is byte-per-pixel*width, YUV has 1 byte per pixel, so the stride is
+    //the width (rounded up to the nearest multiple of 32). The planes start
+    //on a multiple of 16 lines.
+    //See mmal/util/mmal_util.c, mmal_encoding_width_to_stride()
+    geometry->stride       = round_up(geometry->width,  32);
+    geometry->slice_height = round_up(geometry->height, 16);
+
+    return OK;
+}
+
 static WARN_UNUSED
-enum error_code set_camera_sensor_framesize(void)
+enum error_code set_camera_sensor_framesize(component_t* camera, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
-    result = omx_parameter_port_max_frame_size(camera.handle, 70, round_up(CAM_WIDTH, 32), round_up(CAM_HEIGHT, 16)); if(result!=OK) { return result; }
-    result = omx_parameter_port_max_frame_size(camera.handle, 71, round_up(CAM_WIDTH, 32), round_up(CAM_HEIGHT, 16)); if(result!=OK) { return result; }
+    //0 lets the firmware choose, as if it was not set
+    if(geometry->sensor_mode)
+    {
+        result = omx_parameter_camera_custom_sensor_config(camera->handle, geometry->sensor_mode); if(result!=OK) { return result; }
+    }
+
+    result = omx_parameter_port_max_frame_size(camera->handle, CAMERA_PREVIEW_PORT, geometry->stride, geometry->slice_height); if(result!=OK) { return result; }
+    result = omx_parameter_port_max_frame_size(camera->handle, CAMERA_VIDEO_PORT,   geometry->stride, geometry->slice_height); if(result!=OK) { return result; }
+
+    //The port definitions follow the frame size, they are not the defaults
+    //anymore
+    forget_port_definitions(camera);
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code set_camera_videoport(void)
+enum error_code set_camera_videoport(component_t* camera, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
     //Configure camera port definition
-    LOG_MESSAGE_COMPONENT(&camera, "configuring still port definition");
+    LOG_MESSAGE_COMPONENT(camera, "configuring still port definition");
 
-    OMX_PARAM_PORTDEFINITIONTYPE port_def; OMX_INIT_STRUCTURE (port_def);
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
 
-    port_def.nPortIndex = 71;
+    result = get_port_definition(camera, CAMERA_VIDEO_PORT, &port_def); if(result!=OK) { return result; }
 
-    result = omx_get_parameter(camera.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
-
-    port_def.format.video.nFrameWidth        = CAM_WIDTH;
-    port_def.format.video.nFrameHeight       = CAM_HEIGHT;
+    port_def.format.video.nFrameWidth        = geometry->width;
+    port_def.format.video.nFrameHeight       = geometry->height;
     port_def.format.video.eCompressionFormat = OMX_IMAGE_CodingUnused;
     port_def.format.video.eColorFormat       = OMX_COLOR_FormatYUV420PackedPlanar;
-    //Stride is byte-per-pixel*width, YUV has 1 byte per pixel, so the stride is
-    //the width (rounded up to the nearest multiple of 16).
-    //See mmal/util/mmal_util.c, mmal_encoding_width_to_stride()
-    port_def.format.video.nStride            = round_up(CAM_WIDTH, 32);
-    port_def.format.video.nSliceHeight       = round_up(CAM_HEIGHT, 16);
-    port_def.format.video.xFramerate         = 15 << 16;
+    port_def.format.video.nStride            = geometry->stride;
+    port_def.format.video.nSliceHeight       = geometry->slice_height;
+    port_def.format.video.xFramerate         = CAMERA_FRAMERATE << 16;
+
+    result = set_port_definition(camera, &port_def); if(result!=OK) { return result; }
 
-    result = omx_set_parameter(camera.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
+    result = omx_config_rotation(camera->handle, CAMERA_VIDEO_PORT, geometry->rotation); if(result!=OK) { return result; }
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code set_camera_previewport(void)
+enum error_code set_camera_previewport(component_t* camera, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
-    LOG_MESSAGE_COMPONENT(&camera, "configuring preview port definition");
+    LOG_MESSAGE_COMPONENT(camera, "configuring preview port definition");
 
     //Configure preview port
     //In theory the fastest resolution and framerate are 1920x1080 @30fps because
@@ -191,42 +447,40 @@ enum error_code set_camera_previewport(void)
     //The difference between 1920x1080 @30fps and 640x480 @30fps is a speed boost
     //of ~4%, from ~1083ms to ~1039ms
 
-    OMX_PARAM_PORTDEFINITIONTYPE port_def; OMX_INIT_STRUCTURE (port_def);
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
 
-    port_def.nPortIndex = 70;
+    result = get_port_definition(camera, CAMERA_PREVIEW_PORT, &port_def); if(result!=OK) { return result; }
 
-    result = omx_get_parameter(camera.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
-
-    port_def.format.video.nFrameWidth = CAM_WIDTH;
-    port_def.format.video.nFrameHeight = CAM_HEIGHT;
+    port_def.format.video.nFrameWidth = geometry->width;
+    port_def.format.video.nFrameHeight = geometry->height;
     port_def.format.video.eCompressionFormat = OMX_IMAGE_CodingUnused;
     port_def.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
     //Setting the framerate to 0 unblocks the shutter speed from 66ms to 772ms
     //The higher the speed, the higher the capture time
     port_def.format.video.xFramerate = 0;
-    port_def.format.video.nStride = round_up(CAM_WIDTH, 32);
-    port_def.format.video.nSliceHeight = round_up(CAM_HEIGHT, 16);
+    port_def.format.video.nStride = geometry->stride;
+    port_def.format.video.nSliceHeight = geometry->slice_height;
 
-    result = omx_set_parameter(camera.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
+    result = set_port_definition(camera, &port_def); if(result!=OK) { return result; }
 
-    result = omx_config_rotation    (camera.handle,      70, CAM_ROTATION    ); if(result!=OK) { return result; }
+    result = omx_config_rotation    (camera->handle, CAMERA_PREVIEW_PORT, geometry->rotation); if(result!=OK) { return result; }
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code set_camera_settings(struct camera_shot_configuration config)
+enum error_code set_camera_settings(component_t* camera, struct camera_shot_configuration config)
 {
-    LOG_MESSAGE_COMPONENT(&camera, "configuring settings");
+    LOG_MESSAGE_COMPONENT(camera, "configuring settings");
 
     enum error_code result;
 
-    result = omx_config_sharpness (camera.handle, OMX_ALL, config.sharpness ); if(result!=OK) { return result; }
-    result = omx_config_contrast  (camera.handle, OMX_ALL, config.contrast  ); if(result!=OK) { return result; }
-    result = omx_config_saturation(camera.handle, OMX_ALL, config.saturation); if(result!=OK) { return result; }
-    result = omx_config_brightness(camera.handle, OMX_ALL, config.brightness); if(result!=OK) { return result; }
+    result = omx_config_sharpness (camera->handle, OMX_ALL, config.sharpness ); if(result!=OK) { return result; }
+    result = omx_config_contrast  (camera->handle, OMX_ALL, config.contrast  ); if(result!=OK) { return result; }
+    result = omx_config_saturation(camera->handle, OMX_ALL, config.saturation); if(result!=OK) { return result; }
+    result = omx_config_brightness(camera->handle, OMX_ALL, config.brightness); if(result!=OK) { return result; }
     result = omx_config_exposure_value(
-            camera.handle,
+            camera->handle,
             OMX_ALL,
             CAM_METERING,
             (CAM_EXPOSURE_COMPENSATION << 16)/6,
@@ -236,44 +490,43 @@ enum error_code set_camera_settings(struct camera_shot_configuration config)
             CAM_SHUTTER_SPEED_AUTO,
             config.iso,
             CAM_ISO_AUTO); if(result!=OK) { return result; }
-    result = omx_config_exposure           (camera.handle, OMX_ALL, CAM_EXPOSURE           ); if(result!=OK) { return result; }
-    result = omx_config_frame_stabilisation(camera.handle, OMX_ALL, CAM_FRAME_STABILIZATION); if(result!=OK) { return result; }
-    result = omx_config_white_balance      (camera.handle, OMX_ALL, config.whiteBalance    ); if(result!=OK) { return result; }
+    result = omx_config_exposure           (camera->handle, OMX_ALL, CAM_EXPOSURE           ); if(result!=OK) { return result; }
+    result = omx_config_frame_stabilisation(camera->handle, OMX_ALL, CAM_FRAME_STABILIZATION); if(result!=OK) { return result; }
+    result = omx_config_white_balance      (camera->handle, OMX_ALL, config.whiteBalance    ); if(result!=OK) { return result; }
 
     //White balance gains (if white balance is set to off)
     if(!config.whiteBalance)
     {
-        result = omx_config_white_balance_gains(camera.handle,
+        result = omx_config_white_balance_gains(camera->handle,
                 (config.redGain  << 16)/1000,
                 (config.blueGain << 16)/1000); if(result!=OK) { return result; }
     }
 
-    result = omx_config_image_filter(camera.handle, OMX_ALL, CAM_IMAGE_FILTER); if(result!=OK) { return result; }
-    result = omx_config_mirror      (camera.handle,      71, CAM_MIRROR      ); if(result!=OK) { return result; }
-    result = omx_config_rotation    (camera.handle,      71, CAM_ROTATION    ); if(result!=OK) { return result; }
-    result = omx_config_color_enhancement(camera.handle, OMX_ALL, CAM_COLOR_ENABLE, CAM_COLOR_U, CAM_COLOR_V); if(result!=OK) { return result; }
-    result = omx_config_denoise     (camera.handle,       CAM_NOISE_REDUCTION); if(result!=OK) { return result; }
-    result = omx_config_input_crop_percentage(camera.handle, OMX_ALL,
+    result = omx_config_image_filter(camera->handle, OMX_ALL, CAM_IMAGE_FILTER); if(result!=OK) { return result; }
+    result = omx_config_mirror      (camera->handle, CAMERA_VIDEO_PORT,   CAM_MIRROR      ); if(result!=OK) { return result; }
+    result = omx_config_color_enhancement(camera->handle, OMX_ALL, CAM_COLOR_ENABLE, CAM_COLOR_U, CAM_COLOR_V); if(result!=OK) { return result; }
+    result = omx_config_denoise     (camera->handle,       CAM_NOISE_REDUCTION); if(result!=OK) { return result; }
+    result = omx_config_input_crop_percentage(camera->handle, OMX_ALL,
             (CAM_ROI_LEFT   << 16)/100,
             (CAM_ROI_TOP    << 16)/100,
             (CAM_ROI_WIDTH  << 16)/100,
             (CAM_ROI_HEIGHT << 16)/100); if(result!=OK) { return result; }
-    result = omx_config_dynamic_range_expansion(camera.handle, config.drc); if(result!=OK) { return result; }
+    result = omx_config_dynamic_range_expansion(camera->handle, config.drc); if(result!=OK) { return result; }
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code set_jpeg_settings(struct camera_shot_configuration config)
+enum error_code set_jpeg_settings(component_t* encoder, struct camera_shot_configuration config)
 {
-    LOG_MESSAGE_COMPONENT(&encoder, "configuring settings");
+    LOG_MESSAGE_COMPONENT(encoder, "configuring settings");
 
     enum error_code result;
 
-    result = omx_parameter_qfactor         (encoder.handle, 341, config.quality   ); if(result!=OK) { return result; }
-    result = omx_parameter_brcm_exif       (encoder.handle,      JPEG_EXIF_DISABLE); if(result!=OK) { return result; }
-    result = omx_parameter_brcm_ijg_scaling(encoder.handle, 341, JPEG_IJG_ENABLE  ); if(result!=OK) { return result; }
-    result = omx_parameter_brcm_thumbnail  (encoder.handle,
+    result = omx_parameter_qfactor         (encoder->handle, ENCODER_OUTPUT_PORT, config.quality   ); if(result!=OK) { return result; }
+    result = omx_parameter_brcm_exif       (encoder->handle,      JPEG_EXIF_DISABLE); if(result!=OK) { return result; }
+    result = omx_parameter_brcm_ijg_scaling(encoder->handle, ENCODER_OUTPUT_PORT, JPEG_IJG_ENABLE  ); if(result!=OK) { return result; }
+    result = omx_parameter_brcm_thumbnail  (encoder->handle,
             JPEG_THUMBNAIL_ENABLE,
             JPEG_PREVIEW,
             JPEG_THUMBNAIL_WIDTH,
@@ -281,299 +534,1585 @@ enum error_code set_jpeg_settings(struct camera_shot_configuration config)
 
     //EXIF tags
     //See firmware/documentation/ilcomponents/image_decode.html for valid keys
-    result = omx_config_metadata_item(encoder.handle, OMX_MetadataScopePortLevel, 341, "IFD0.Make", "Raspberry Pi"); if(result!=OK) { return result; }
+    result = omx_config_metadata_item(encoder->handle, OMX_MetadataScopePortLevel, ENCODER_OUTPUT_PORT, "IFD0.Make", "Raspberry Pi"); if(result!=OK) { return result; }
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code init_camera(struct camera_shot_configuration config)
+enum error_code init_camera(component_t* camera, struct camera_shot_configuration config, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
-    result = load_camera_drivers(&camera);  if(result!=OK) { return result; }
-    result = set_camera_sensor_framesize(); if(result!=OK) { return result; }
-    result = set_camera_videoport();        if(result!=OK) { return result; }
-    result = set_camera_previewport();      if(result!=OK) { return result; }
-    result = set_camera_settings(config);   if(result!=OK) { return result; }
+    result = load_camera_drivers(camera, config.cameraNumber);   if(result!=OK) { return result; }
+    result = set_camera_sensor_framesize(camera, geometry);      if(result!=OK) { return result; }
+    result = set_camera_videoport(camera, geometry);             if(result!=OK) { return result; }
+    result = set_camera_previewport(camera, geometry);           if(result!=OK) { return result; }
+    result = set_camera_settings(camera, config);                if(result!=OK) { return result; }
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code init_splitter(void)
+enum error_code init_splitter(component_t* splitter, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
-    LOG_MESSAGE_COMPONENT(&splitter, "configuring splitter");
-
-    OMX_PARAM_PORTDEFINITIONTYPE port_def; OMX_INIT_STRUCTURE (port_def);
+    LOG_MESSAGE_COMPONENT(splitter, "configuring splitter");
 
-    port_def.nPortIndex = 251;
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
 
-    LOG_MESSAGE_COMPONENT(&splitter, "Getting port definitions");
+    LOG_MESSAGE_COMPONENT(splitter, "Getting port definitions");
 
-    result = omx_get_parameter(splitter.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
+    result = get_port_definition(splitter, SPLITTER_OUTPUT_PORT, &port_def); if(result!=OK) { return result; }
 
-    port_def.format.video.nFrameWidth        = CAM_WIDTH;
-    port_def.format.video.nFrameHeight       = CAM_HEIGHT;
+    port_def.format.video.nFrameWidth        = geometry->width;
+    port_def.format.video.nFrameHeight       = geometry->height;
     port_def.format.video.eCompressionFormat = OMX_VIDEO_CodingUnused;
     port_def.format.video.eColorFormat       = OMX_COLOR_FormatYUV420PackedPlanar;
-    //Stride is byte-per-pixel*width, YUV has 1 byte per pixel, so the stride is
-    //the width (rounded up to the nearest multiple of 16).
-    //See mmal/util/mmal_util.c, mmal_encoding_width_to_stride()
-    port_def.format.video.nStride            = round_up(CAM_WIDTH, 32);
-    port_def.format.video.nSliceHeight       = round_up(CAM_HEIGHT, 16);
+    port_def.format.video.nStride            = geometry->stride;
+    port_def.format.video.nSliceHeight       = geometry->slice_height;
 
-    LOG_MESSAGE_COMPONENT(&splitter, "Setting port definitions");
-    result = omx_set_parameter(splitter.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
+    LOG_MESSAGE_COMPONENT(splitter, "Setting port definitions");
+    result = set_port_definition(splitter, &port_def); if(result!=OK) { return result; }
 
-    LOG_MESSAGE_COMPONENT(&splitter, "Setting proprietary tunnels parameter");
-    result = omx_parameter_brcm_disable_proprietary_tunnels(splitter.handle, 251, OMX_FALSE); if(result!=OK) { return result; }
+    LOG_MESSAGE_COMPONENT(splitter, "Setting proprietary tunnels parameter");
+    result = omx_parameter_brcm_disable_proprietary_tunnels(splitter->handle, SPLITTER_OUTPUT_PORT, OMX_FALSE); if(result!=OK) { return result; }
 
-    LOG_MESSAGE_COMPONENT(&splitter, "configuring done");
+    LOG_MESSAGE_COMPONENT(splitter, "configuring done");
 
     return OK;
 }
 
 static WARN_UNUSED
-enum error_code init_encoder(struct camera_shot_configuration config)
+enum error_code init_encoder(component_t* encoder, struct camera_shot_configuration config, const frame_geometry_t* geometry)
 {
     enum error_code result;
 
-    LOG_MESSAGE_COMPONENT(&encoder, "configuring encoder port definition");
+    LOG_MESSAGE_COMPONENT(encoder, "configuring encoder port definition");
 
-    OMX_PARAM_PORTDEFINITIONTYPE port_def; OMX_INIT_STRUCTURE (port_def);
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
 
-    port_def.nPortIndex = 341;
+    result = get_port_definition(encoder, ENCODER_OUTPUT_PORT, &port_def); if(result!=OK) { return result; }
 
-    result = omx_get_parameter(encoder.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
-
-    port_def.format.image.nFrameWidth        = CAM_WIDTH;
-    port_def.format.image.nFrameHeight       = CAM_HEIGHT;
-    port_def.format.image.nSliceHeight       = round_up(CAM_HEIGHT, 16);
+    port_def.format.image.nFrameWidth        = geometry->width;
+    port_def.format.image.nFrameHeight       = geometry->height;
+    port_def.format.image.nSliceHeight       = geometry->slice_height;
     port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
     port_def.format.image.eColorFormat       = OMX_COLOR_FormatUnused;
 
-    result = omx_set_parameter(encoder.handle, OMX_IndexParamPortDefinition, &port_def); if(result!=OK) { return result; }
+    result = set_port_definition(encoder, &port_def); if(result!=OK) { return result; }
 
     //Configure JPEG settings
-    result = set_jpeg_settings(config); if(result!=OK) { return result; }
+    result = set_jpeg_settings(encoder, config); if(result!=OK) { return result; }
 
     return OK;
 }
 
-WARN_UNUSED enum error_code omx_still_open(struct camera_shot_configuration config)
+static WARN_UNUSED
+enum error_code library_acquire(void)
 {
-    enum error_code result;
+    enum error_code result = OK;
+
+    pthread_mutex_lock(&library_lock);
 
-       camera.name = "OMX.broadcom.camera";
-    null_sink.name = "OMX.broadcom.null_sink";
-     splitter.name = "OMX.broadcom.video_splitter";
-      encoder.name = "OMX.broadcom.image_encode";
+    if(library_users == 0)
+    {
+        //Initialize Broadcom's VideoCore APIs
+        bcm_host_init();
 
-    //Initialize Broadcom's VideoCore APIs
-    bcm_host_init();
+        //Initialize OpenMAX IL
+        result = omx_init();
+    }
 
-    //Initialize OpenMAX IL
-    result = omx_init(); if(result!=OK) { return result; }
+    if(result == OK)
+        library_users++;
 
-    //Initialize components
-    result = init_component(&camera);    if(result!=OK) { return result; }
-    result = init_component(&null_sink); if(result!=OK) { return result; }
-    result = init_component(&splitter);  if(result!=OK) { return result; }
-    result = init_component(&encoder);   if(result!=OK) { return result; }
+    pthread_mutex_unlock(&library_lock);
 
-    result = init_camera(config);    if(result!=OK) { return result; }
-    result = init_encoder(config);   if(result!=OK) { return result; }
+    return result;
+}
 
-    //Setup tunnels: camera (video) -> splitter -> image_encode, camera (preview) -> null_sink
-    LOG_MESSAGE("configuring tunnels");
+static WARN_UNUSED
+enum error_code library_release(void)
+{
+    enum error_code result = OK;
 
-    result = omx_setup_tunnel(  camera.handle,  71,  splitter.handle, 250); if(result!=OK) { return result; }
+    pthread_mutex_lock(&library_lock);
 
-    // Tunneling camera to splitter changed the splitter port settings, lets wait for them
-    result = wait(&splitter, EVENT_PORT_SETTINGS_CHANGED, 0); if(result!=OK) { return result; }
+    if(--library_users == 0)
+    {
+        //Deinitialize OpenMAX IL
+        result = omx_deinit();
 
-    // Splitter must be initialised after the tunnel configures the output ports
-    result = init_splitter();  if(result!=OK) { return result; }
+        //Deinitialize Broadcom's VideoCore APIs
+        bcm_host_deinit();
+    }
 
-    result = omx_setup_tunnel(splitter.handle, 251,   encoder.handle, 340); if(result!=OK) { return result; }
-    result = omx_setup_tunnel(  camera.handle,  70, null_sink.handle, 240); if(result!=OK) { return result; }
+    pthread_mutex_unlock(&library_lock);
 
-    //Change state to IDLE
-    result = change_state(&camera,    OMX_StateIdle); if(result!=OK) { return result; } result = wait(&camera,    EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&null_sink, OMX_StateIdle); if(result!=OK) { return result; } result = wait(&null_sink, EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&splitter,  OMX_StateIdle); if(result!=OK) { return result; } result = wait(&splitter,  EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&encoder,   OMX_StateIdle); if(result!=OK) { return result; } result = wait(&encoder,   EVENT_STATE_SET, 0); if(result!=OK) { return result; }
+    return result;
+}
 
-    //Enable the tunnel ports
+//Whether graph_open() got the handle of any component
+static bool components_loaded(const graph_t* graph)
+{
+    unsigned i;
+    for(i=0; i<still_graph.nodes_count; i++)
+    {
+        if(graph->components[i].handle)
+            return true;
+    }
 
-    // First enable both tunel ports
-    result = enable_port(&camera,     71); if(result!=OK) { return result; }
-    result = enable_port(&splitter,  250); if(result!=OK) { return result; }
+    return false;
+}
 
-    // Then wait now for the port enable event
-    result = wait(&camera,    EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
-    result = wait(&splitter,  EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
+static WARN_UNUSED
+enum error_code queue_output_buffers(still_session* session)
+{
+    enum error_code result;
 
-    // First enable both tunel ports
-    result = enable_port(&camera,     70); if(result!=OK) { return result; }
-    result = enable_port(&null_sink, 240); if(result!=OK) { return result; }
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+    OMX_BUFFERHEADERTYPE** output_buffers = graph_sink_buffers(&session->graph, JPEG_SINK);
 
-    // Then wait now for the port enable event
-    result = wait(&camera,    EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
-    result = wait(&null_sink, EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
+    //All the buffers are handed to the encoder, each one is queued again as
+    //soon as the handler is done with it
+    int i;
+    for(i=0; i<JPEG_OUTPUT_BUFFERS; i++)
+    {
+        result = fill_buffer(encoder, output_buffers[i]); if(result!=OK) { return result; }
+    }
 
-    // First enable both tunel ports
-    result = enable_port(&splitter,  251); if(result!=OK) { return result; }
-    result = enable_port(&encoder,   340); if(result!=OK) { return result; }
+    __atomic_store_n(&session->output_buffers_queued, JPEG_OUTPUT_BUFFERS, __ATOMIC_RELEASE);
 
-    // Then wait now for the port enable event
-    result = wait(&splitter,  EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
-    result = wait(&encoder,   EVENT_PORT_ENABLE, 0); if(result!=OK) { return result; }
+    return OK;
+}
 
-    result = port_enable_allocate_buffer(&encoder, &output_buffer, 341); if(result!=OK) { return result; }
+//Gives a buffer back to the encoder. Called from the consumer thread or from
+//the thread releasing a lent buffer
+static WARN_UNUSED
+enum error_code requeue_output_buffer(still_session* session, OMX_BUFFERHEADERTYPE* buffer)
+{
+    enum error_code result;
 
-    //Change state to EXECUTING
-    result = change_state(&camera,    OMX_StateExecuting); if(result!=OK) { return result; } result = wait(&camera,    EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&null_sink, OMX_StateExecuting); if(result!=OK) { return result; } result = wait(&null_sink, EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&splitter,  OMX_StateExecuting); if(result!=OK) { return result; } result = wait(&splitter,  EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&encoder,   OMX_StateExecuting); if(result!=OK) { return result; } result = wait(&encoder,   EVENT_STATE_SET, 0); if(result!=OK) { return result; }
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
 
-    result = dump_port_defs(   camera.handle,  70); if(result!=OK) { return result; }
-    result = dump_port_defs(   camera.handle,  71); if(result!=OK) { return result; }
-    result = dump_port_defs(null_sink.handle, 240); if(result!=OK) { return result; }
-    result = dump_port_defs( splitter.handle, 250); if(result!=OK) { return result; }
-    result = dump_port_defs( splitter.handle, 251); if(result!=OK) { return result; }
-    result = dump_port_defs(  encoder.handle, 340); if(result!=OK) { return result; }
-    result = dump_port_defs(  encoder.handle, 341); if(result!=OK) { return result; }
+    //Counted before, the encoder can return it before fill_buffer() does
+    __atomic_add_fetch(&session->output_buffers_queued, 1, __ATOMIC_ACQ_REL);
 
-    result = dump_port_frame_size(   camera.handle,  70); if(result!=OK) { return result; }
-    result = dump_port_frame_size(   camera.handle,  71); if(result!=OK) { return result; }
-    result = dump_port_frame_size(   camera.handle,  72); if(result!=OK) { return result; }
+    result = fill_buffer(encoder, buffer);
+    if(result!=OK)
+    {
+        __atomic_sub_fetch(&session->output_buffers_queued, 1, __ATOMIC_ACQ_REL);
+        return result;
+    }
 
     return OK;
 }
 
-WARN_UNUSED enum error_code omx_still_shoot(const uint32_t frames, const buffer_output_handler handler)
+//Position of the buffer in the sink
+static unsigned output_buffer_index(still_session* session, OMX_BUFFERHEADERTYPE* buffer)
+{
+    OMX_BUFFERHEADERTYPE** output_buffers = graph_sink_buffers(&session->graph, JPEG_SINK);
+
+    unsigned i;
+    for(i=0; i<JPEG_OUTPUT_BUFFERS; i++)
+    {
+        if(output_buffers[i] == buffer)
+            break;
+    }
+
+    return i;
+}
+
+static WARN_UNUSED
+enum error_code return_output_buffers(still_session* session)
 {
     enum error_code result;
+    OMX_BUFFERHEADERTYPE* buffer;
+
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
 
-    LOG_MESSAGE_COMPONENT(&splitter, "single step mode");
+    //The port can't be stopped while the consumer holds buffers
+    unsigned lent = __atomic_load_n(&session->output_buffers_lent, __ATOMIC_ACQUIRE);
+    if(lent)
+    {
+        LOG_ERROR_COMPONENT(encoder, "%d output buffers are still lent", lent);
+        return ERROR;
+    }
 
-    result = omx_config_singlestep(splitter.handle, 251, frames); if(result!=OK) { return result; }
+    LOG_MESSAGE_COMPONENT(encoder, "returning %d output buffers", session->output_buffers_queued);
 
-    //Enable camera capture port. This basically says that the port 72 will be
-    //used to get data from the camera. If you're capturing video, the port 71
-    //must be used
-    LOG_MESSAGE_COMPONENT(&camera, "enabling capture port");
-    result = omx_config_port_capturing(camera.handle, 71, OMX_TRUE); if(result!=OK) { return result; }
+    //Flushing the port makes the encoder return the queued buffers empty
+    result = flush_port(encoder, ENCODER_OUTPUT_PORT);               if(result!=OK) { return result; }
+    result = wait_for(encoder, EVENT_FLUSH, ENCODER_OUTPUT_PORT, 0); if(result!=OK) { return result; }
 
-    //Start consuming the buffers
-    VCOS_UNSIGNED end_flags = EVENT_BUFFER_FLAG | EVENT_FILL_BUFFER_DONE;
-    VCOS_UNSIGNED retrieves_events;
+    while(__atomic_load_n(&session->output_buffers_queued, __ATOMIC_ACQUIRE))
+    {
+        result = wait_buffer(encoder, NULL, &buffer); if(result!=OK) { return result; }
 
-    uint32_t frame = 0;
-    bool last_buffer_ends_jpeg = false;
-    bool this_buffer_stars_jpeg = false;
+        __atomic_sub_fetch(&session->output_buffers_queued, 1, __ATOMIC_ACQ_REL);
+    }
 
-    while(1)
+    return OK;
+}
+
+//Ends the shot, no handler is called after this. Must be called with the shot
+//lock held
+static void end_shot(still_session* session)
+{
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+    struct still_shot* shot = &session->shot;
+
+    if(!jpeg_parser_idle(&shot->parser))
+        LOG_ERROR_COMPONENT(encoder, "the stream ends inside frame %d", shot->frame);
+
+    if(shot->parser.errors)
+        LOG_ERROR_COMPONENT(encoder, "%llu bytes out of the JPEG structure", (unsigned long long)shot->parser.errors);
+
+    if(shot->frame != shot->frames && !shot->continuous)
+        LOG_ERROR_COMPONENT(encoder, "%d frames requested, %d received", shot->frames, shot->frame);
+
+    session->shooting = false;
+}
+
+//A frame of a continuous burst starts in the buffer, counts the frames lost
+//since the previous one. The burst ends one frame ahead: when the next frame
+//is the last one (the one after would start past the deadline), the
+//splitter goes back to single step for it and its end of stream ends the
+//shot, no frame is taken past the end. Must be called with the shot lock
+//held
+static void burst_frame_start(struct still_shot* shot, OMX_BUFFERHEADERTYPE* buffer)
+{
+    if(shot->frame >= shot->frames)
+        return;
+
+    if(shot->deadline && latency_now() + 2 * FRAME_INTERVAL_US > shot->deadline && shot->frame + 2 < shot->frames)
+        shot->frames = shot->frame + 2;
+
+    if(shot->frame + 2 == shot->frames)
+        shot->ending = true;
+
+    uint64_t timestamp = (uint64_t)buffer->nTimeStamp.nHighPart << 32 | buffer->nTimeStamp.nLowPart;
+
+    if(!shot->frame)
+    {
+        shot->first_timestamp = timestamp;
+    }
+    else if(timestamp - shot->last_timestamp > FRAME_INTERVAL_US * 3 / 2)
     {
-        //Get the buffer data (a slice of the image)
-        result = omx_fill_this_buffer(encoder.handle, output_buffer); if(result!=OK) { return result; }
-
-        //Wait until it's filled
-        result = wait(&encoder, EVENT_FILL_BUFFER_DONE, &retrieves_events); if(result!=OK) { return result; }
-
-        this_buffer_stars_jpeg =
-            output_buffer->nFilledLen>=10 &&
-            output_buffer->pBuffer[output_buffer->nOffset+0] == 0xFF &&
-            output_buffer->pBuffer[output_buffer->nOffset+1] == 0xD8 &&
-            output_buffer->pBuffer[output_buffer->nOffset+2] == 0xFF &&
-            output_buffer->pBuffer[output_buffer->nOffset+3] == 0xE1 &&
-            output_buffer->pBuffer[output_buffer->nOffset+6] == 'E' &&
-            output_buffer->pBuffer[output_buffer->nOffset+7] == 'x' &&
-            output_buffer->pBuffer[output_buffer->nOffset+8] == 'i' &&
-            output_buffer->pBuffer[output_buffer->nOffset+9] == 'f';
-
-        if(last_buffer_ends_jpeg && this_buffer_stars_jpeg)
-            frame++;
-
-        handler(frame, &output_buffer->pBuffer[output_buffer->nOffset], output_buffer->nFilledLen);
-
-        last_buffer_ends_jpeg =
-            output_buffer->nFilledLen>=2 &&
-            output_buffer->pBuffer[output_buffer->nOffset+output_buffer->nFilledLen-2] == 0xFF &&
-            output_buffer->pBuffer[output_buffer->nOffset+output_buffer->nFilledLen-1] == 0xD9;
-
-        //When it's the end of the stream, an OMX_EventBufferFlag is emitted in the
-        //camera and image_encode components. Then the FillBufferDone function is
-        //called in the image_encode
-        if(retrieves_events == end_flags)
+        //The splitter drops the frames the encoder has no room for
+        shot->dropped += (timestamp - shot->last_timestamp + FRAME_INTERVAL_US / 2) / FRAME_INTERVAL_US - 1;
+    }
+
+    shot->last_timestamp = timestamp;
+}
+
+//Either handler or lend_handler is called with the buffer, then it is queued
+//again or lent. Runs in the consumer thread with the shot lock held
+static void consume_buffer(still_session* session, OMX_BUFFERHEADERTYPE* buffer)
+{
+    enum error_code result;
+
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+    struct still_shot* shot = &session->shot;
+
+    __atomic_sub_fetch(&session->output_buffers_queued, 1, __ATOMIC_ACQ_REL);
+
+    const uint8_t* data   = &buffer->pBuffer[buffer->nOffset];
+    size_t         length = buffer->nFilledLen;
+    uint32_t       first_frame = shot->frame;
+    size_t         frame_end = 0;
+    size_t         position = 0;
+    int            ended = 0;
+    bool           ending = shot->ending;
+
+    //Everything is read from the buffer before it leaves, once lent it can
+    //be filled again at any time
+    while(position < length)
+    {
+        if(shot->continuous && jpeg_parser_idle(&shot->parser))
+            burst_frame_start(shot, buffer);
+
+        size_t consumed = jpeg_parser_parse(&shot->parser, &data[position], length - position, &ended);
+
+        //The frames after the end of a burst are only drained
+        if(shot->handler && (!shot->continuous || shot->frame < shot->frames))
+            shot->handler(shot->context, shot->frame, &data[position], consumed);
+
+        position += consumed;
+
+        if(ended)
         {
-            //Clear the EOS flags
-            result = wait(&splitter, EVENT_BUFFER_FLAG, 0); if(result!=OK) { return result; }
-            result = wait(&encoder,  EVENT_BUFFER_FLAG, 0); if(result!=OK) { return result; }
-            break;
+            LOG_DEBUG_COMPONENT(encoder, "frame %d, bytes %llu .. %llu", shot->frame,
+                    (unsigned long long)shot->parser.frame_start,
+                    (unsigned long long)shot->parser.position);
+
+            if(frame_end)
+                LOG_ERROR_COMPONENT(encoder, "frame %d ends in the buffer of the previous one", shot->frame);
+            else
+                frame_end = position;
+
+            shot->frame++;
         }
     }
 
-    LOG_MESSAGE("------------------------------------------------");
+    //The encoder marks the last buffer of every frame
+    if(buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME && !ended)
+    {
+        LOG_ERROR_COMPONENT(encoder, "frame %d has the end of frame flag without EOI", shot->frame);
 
-    //Disable camera capture port
-    LOG_MESSAGE_COMPONENT(&camera, "disabling capture port");
-    result = omx_config_port_capturing(camera.handle, 71, OMX_FALSE); if(result!=OK) { return result; }
+        jpeg_parser_end_frame(&shot->parser);
+
+        if(!frame_end)
+            frame_end = length;
+
+        shot->frame++;
+    }
+
+    //When it's the end of the stream, an OMX_EventBufferFlag is emitted in the
+    //camera and image_encode components. Then the FillBufferDone function is
+    //called in the image_encode with the EOS flag set on the buffer
+    bool end_of_stream = buffer->nFlags & OMX_BUFFERFLAG_EOS;
+
+    if(shot->lend_handler)
+    {
+        unsigned index = output_buffer_index(session, buffer);
+        still_buffer* lent = &session->lent[index];
+
+        lent->frame         = first_frame;
+        lent->data          = data;
+        lent->length        = length;
+        lent->frame_end     = frame_end;
+        lent->end_of_stream = end_of_stream;
+
+        __atomic_store_n(&session->lent_out[index], true, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&session->output_buffers_lent, 1, __ATOMIC_ACQ_REL);
+
+        shot->lend_handler(shot->context, lent);
+    }
+    else
+    {
+        //Queue the buffer again right away
+        result = requeue_output_buffer(session, buffer);
+        if(result!=OK)
+        {
+            //The shoot fails with the error
+            end_shot(session);
+            post_event(encoder, EVENT_ERROR, OMX_ErrorUndefined, 0, 0);
+            return;
+        }
+    }
+
+    //The shoot wakes up once per frame, not per buffer
+    uint32_t frame;
+    for(frame=first_frame; frame<shot->frame; frame++)
+    {
+        //Already past the splitter when the burst was ending
+        if(shot->continuous && frame >= shot->frames)
+            shot->overrun++;
+
+        post_event(encoder, EVENT_FRAME_END, frame, end_of_stream && frame+1 == shot->frame, 0);
+    }
+
+    //The runner sets the splitter back to single step right away, before
+    //the next frame of the sensor
+    if(shot->ending && !ending)
+        post_event(encoder, EVENT_FRAME_END, shot->frame, 0, 0);
+
+    if(end_of_stream)
+    {
+        //The stream can end without a complete frame
+        if(first_frame == shot->frame)
+            post_event(encoder, EVENT_FRAME_END, shot->frame, 1, 0);
+
+        end_shot(session);
+    }
+}
+
+static void* consume(void* arg)
+{
+    enum error_code result;
+    still_session* session = arg;
+    OMX_BUFFERHEADERTYPE* buffer;
+
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+
+    while(1)
+    {
+        result = take_buffer(encoder, &buffer);
+        if(result!=OK || !buffer)
+            break;
+
+        pthread_mutex_lock(&session->shot_lock);
+
+        if(session->shooting)
+            consume_buffer(session, buffer);
+        else
+            //Returned by a flush, return_output_buffers() waits for it
+            post_event(encoder, EVENT_FILL_BUFFER_DONE, 0, 0, buffer);
+
+        pthread_mutex_unlock(&session->shot_lock);
+    }
+
+    return NULL;
+}
+
+static WARN_UNUSED
+enum error_code start_consumer(still_session* session)
+{
+    enum error_code result;
+    int result_pthread;
+
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+
+    result = enable_buffer_ring(encoder); if(result!=OK) { return result; }
+
+    result_pthread = pthread_create(&session->consumer, NULL, consume, session);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR("pthread_create (%d)", result_pthread);
+        disable_buffer_ring(encoder);
+        return ERROR;
+    }
+
+    session->consumer_running = true;
 
     return OK;
 }
 
-WARN_UNUSED enum error_code omx_still_close(void)
+//Must be called with all the output buffers returned
+static void stop_consumer(still_session* session)
+{
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+
+    if(!session->consumer_running)
+        return;
+
+    stop_buffer_ring(encoder);
+    pthread_join(session->consumer, NULL);
+    disable_buffer_ring(encoder);
+
+    session->consumer_running = false;
+}
+
+//Graph hook, the components are configured as soon as they are loaded
+static WARN_UNUSED
+enum error_code configure_node(graph_t* graph, unsigned node, void* context)
+{
+    const still_session* session = context;
+
+    switch(node)
+    {
+        case NODE_CAMERA:  return init_camera (graph_component(graph, node), session->current_config, &session->geometry);
+        case NODE_ENCODER: return init_encoder(graph_component(graph, node), session->current_config, &session->geometry);
+        default:           return OK;
+    }
+}
+
+//Graph hook, the splitter output is configured once its input is tunneled
+static WARN_UNUSED
+enum error_code configure_tunnel(graph_t* graph, unsigned edge, void* context)
 {
     enum error_code result;
 
-    //Change state to IDLE
-    result = change_state(&camera,    OMX_StateIdle); if(result!=OK) { return result; } result = wait(&camera,    EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&null_sink, OMX_StateIdle); if(result!=OK) { return result; } result = wait(&null_sink, EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&splitter,  OMX_StateIdle); if(result!=OK) { return result; } result = wait(&splitter,  EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&encoder,   OMX_StateIdle); if(result!=OK) { return result; } result = wait(&encoder,   EVENT_STATE_SET, 0); if(result!=OK) { return result; }
+    if(graph->description->edges[edge].to != NODE_SPLITTER)
+        return OK;
+
+    component_t* splitter = graph_component(graph, NODE_SPLITTER);
+
+    // Tunneling camera to splitter changed the splitter port settings, lets wait for them
+    result = wait(splitter, EVENT_PORT_SETTINGS_CHANGED, 0); if(result!=OK) { return result; }
+
+    // Splitter must be initialised after the tunnel configures the output ports
+    return init_splitter(splitter, &((const still_session*)context)->geometry);
+}
+
+//The sensor, its mode and the size of the frames are fixed by
+//omx_still_open(), a new configuration must keep them
+static WARN_UNUSED
+enum error_code check_open_settings(still_session* session, struct camera_shot_configuration config)
+{
+    const struct camera_shot_configuration* current = &session->current_config;
 
-    //Disable the tunnel ports
-    result = disable_port(&camera,     71); if(result!=OK) { return result; }
-    result = disable_port(&splitter,  250); if(result!=OK) { return result; }
-    result = wait(&camera,    EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
-    result = wait(&splitter,  EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
+    if(config.cameraNumber != current->cameraNumber || config.sensorMode != current->sensorMode ||
+       config.width != current->width || config.height != current->height || config.rotation != current->rotation)
+    {
+        LOG_ERROR("camera %d, sensor mode %d, %ux%u rotated %d can only be changed by opening the session again (open with camera %d, sensor mode %d, %ux%u rotated %d)",
+                config.cameraNumber, config.sensorMode, config.width, config.height, config.rotation,
+                current->cameraNumber, current->sensorMode, current->width, current->height, current->rotation);
+        return ERROR;
+    }
 
-    result = disable_port(&camera,     70); if(result!=OK) { return result; }
-    result = disable_port(&null_sink, 240); if(result!=OK) { return result; }
-    result = wait(&camera,    EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
-    result = wait(&null_sink, EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
+    return OK;
+}
 
-    result = disable_port(&splitter,  251); if(result!=OK) { return result; }
-    result = disable_port(&encoder,   340); if(result!=OK) { return result; }
-    result = wait(&splitter,  EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
-    result = wait(&encoder,   EVENT_PORT_DISABLE, 0); if(result!=OK) { return result; }
+static WARN_UNUSED
+enum error_code reconfigure(still_session* session, struct camera_shot_configuration config)
+{
+    enum error_code result;
 
-    result = port_disable_free_buffer(&encoder, output_buffer, 341); if(result!=OK) { return result; }
+    component_t* camera  = graph_component(&session->graph, NODE_CAMERA);
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
 
-    //Change state to LOADED
-    result = change_state(&camera,    OMX_StateLoaded); if(result!=OK) { return result; } result = wait(&camera,    EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&null_sink, OMX_StateLoaded); if(result!=OK) { return result; } result = wait(&null_sink, EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&splitter,  OMX_StateLoaded); if(result!=OK) { return result; } result = wait(&splitter,  EVENT_STATE_SET, 0); if(result!=OK) { return result; }
-    result = change_state(&encoder,   OMX_StateLoaded); if(result!=OK) { return result; } result = wait(&encoder,   EVENT_STATE_SET, 0); if(result!=OK) { return result; }
+    //The pipeline stays in EXECUTING, only the settings are applied again
+    result = set_camera_settings(camera, config); if(result!=OK) { return result; }
 
-    //Deinitialize components
-    result = deinit_component(&camera   ); if(result!=OK) { return result; }
-    result = deinit_component(&null_sink); if(result!=OK) { return result; }
-    result = deinit_component(&splitter ); if(result!=OK) { return result; }
-    result = deinit_component(&encoder  ); if(result!=OK) { return result; }
+    //The quality factor is a parameter of the encoder output port, it can be
+    //changed only while the port is disabled
+    if(config.quality != session->current_config.quality)
+    {
+        LOG_MESSAGE_COMPONENT(encoder, "changing quality from %d to %d", session->current_config.quality, config.quality);
 
-    //Deinitialize OpenMAX IL
-    result = omx_deinit(); if(result!=OK) { return result; }
+        result = return_output_buffers(session);                                               if(result!=OK) { return result; }
+        result = graph_sink_disable(&session->graph, JPEG_SINK);                               if(result!=OK) { return result; }
+        result = omx_parameter_qfactor(encoder->handle, ENCODER_OUTPUT_PORT, config.quality);  if(result!=OK) { return result; }
+        result = graph_sink_enable(&session->graph, JPEG_SINK);                                if(result!=OK) { return result; }
+        result = queue_output_buffers(session);                                                if(result!=OK) { return result; }
+    }
 
-    //Deinitialize Broadcom's VideoCore APIs
-    bcm_host_deinit();
+    session->current_config = config;
 
     return OK;
 }
 
+//The handler and the context of a failed shot must not be used anymore
+static void abort_shot(still_session* session)
+{
+    pthread_mutex_lock(&session->shot_lock);
+    session->shooting = false;
+    pthread_mutex_unlock(&session->shot_lock);
+}
+
+//Either handler or lend_handler of the request is called with every buffer of
+//the shot, by consume_buffer()
+static WARN_UNUSED
+enum error_code start_shot(still_session* session, const still_request* request)
+{
+    enum error_code result;
+
+    component_t* camera   = graph_component(&session->graph, NODE_CAMERA);
+    component_t* splitter = graph_component(&session->graph, NODE_SPLITTER);
+    component_t* encoder  = graph_component(&session->graph, NODE_ENCODER);
+
+    //The consumer takes the buffers of this shot from now on
+    pthread_mutex_lock(&session->shot_lock);
+
+    memset(&session->shot, 0, sizeof(session->shot));
+
+    session->shot.frames       = request->frames;
+    session->shot.handler      = request->handler;
+    session->shot.lend_handler = request->lend_handler;
+    session->shot.context      = request->context;
+    session->shot.continuous   = request->continuous;
+    //Nothing to end, the only frame ends the stream
+    session->shot.stopping     = request->continuous && request->frames == 1;
+    jpeg_parser_init(&session->shot.parser);
+
+    if(request->duration_ms)
+        session->shot.deadline = latency_now() + request->duration_ms * 1000ULL;
+
+    session->shooting = true;
+
+    pthread_mutex_unlock(&session->shot_lock);
+
+    //Single step 0 lets the frames through as the camera takes them, a
+    //single frame is a single step
+    if(request->continuous && request->frames == 1)
+    {
+        LOG_MESSAGE_COMPONENT(splitter, "single step mode");
+        result = omx_config_singlestep(splitter->handle, SPLITTER_OUTPUT_PORT, 1);
+    }
+    else if(request->continuous)
+    {
+        LOG_MESSAGE_COMPONENT(splitter, "free running mode");
+        result = omx_config_singlestep(splitter->handle, SPLITTER_OUTPUT_PORT, 0);
+    }
+    else
+    {
+        LOG_MESSAGE_COMPONENT(splitter, "single step mode");
+        result = omx_config_singlestep(splitter->handle, SPLITTER_OUTPUT_PORT, request->frames);
+    }
+    if(result==OK && !session->capturing)
+    {
+        //Enable camera capture port. This basically says that the port 72 will be
+        //used to get data from the camera. If you're capturing video, the port 71
+        //must be used
+        LOG_MESSAGE_COMPONENT(camera, "enabling capture port");
+        result = omx_config_port_capturing(camera->handle, CAMERA_VIDEO_PORT, OMX_TRUE);
+
+        session->capturing = result==OK;
+    }
+
+    //No slice comes out while the sensor is exposing, long exposures must not
+    //make the waits time out
+    encoder->timeout_ms = COMPONENT_TIMEOUT_MS + session->current_config.shutterSpeed / 1000;
+
+    if(result!=OK)
+        abort_shot(session);
+
+    return result;
+}
+
+//Once the consumer knows the next frame of a continuous burst is its last
+//one, the splitter goes back to single step for that frame: its end of
+//stream ends the shot as for the other shots. The frames already past the
+//splitter by then are drained
+static WARN_UNUSED
+enum error_code burst_check(still_session* session)
+{
+    component_t* splitter = graph_component(&session->graph, NODE_SPLITTER);
+
+    pthread_mutex_lock(&session->shot_lock);
+
+    bool stop = session->shot.ending && !session->shot.stopping;
+    session->shot.stopping |= stop;
+
+    pthread_mutex_unlock(&session->shot_lock);
+
+    if(!stop)
+        return OK;
+
+    LOG_MESSAGE_COMPONENT(splitter, "ending the burst");
+
+    return omx_config_singlestep(splitter->handle, SPLITTER_OUTPUT_PORT, 1);
+}
+
+//What the continuous burst of the request achieved, once its shot is done
+static void burst_report(still_session* session, const still_request* request)
+{
+    const struct still_shot* shot = &session->shot;
+
+    if(!request->continuous)
+        return;
+
+    still_burst_report report =
+    {
+        .frames      = shot->frame < shot->frames ? shot->frame : shot->frames,
+        .dropped     = shot->dropped,
+        .overrun     = shot->overrun,
+        .duration_us = shot->last_timestamp - shot->first_timestamp,
+        .fps         = 0
+    };
+
+    if(report.frames > 1 && report.duration_us)
+        report.fps = (report.frames - 1) * 1000000.0 / report.duration_us;
+
+    LOG_MESSAGE("burst: %u frames in %llu us, %.2f fps, %u dropped, %u drained after the end",
+            report.frames, (unsigned long long)report.duration_us, report.fps, report.dropped, report.overrun);
+
+    if(request->report)
+        *request->report = report;
+}
+
+//Shoots from the runner thread, the buffers are consumed by the consumer
+//thread
+static WARN_UNUSED
+enum error_code shoot(still_session* session, const still_request* request)
+{
+    enum error_code result;
+    event_t event;
+
+    component_t* splitter = graph_component(&session->graph, NODE_SPLITTER);
+    component_t* encoder  = graph_component(&session->graph, NODE_ENCODER);
+
+    result = start_shot(session, request); if(result!=OK) { return result; }
+
+    //Wait for the frames
+    do
+    {
+        result = wait(encoder, EVENT_FRAME_END, &event);
+
+        if(result==OK)
+            result = burst_check(session);
+
+        if(result!=OK)
+        {
+            abort_shot(session);
+            return result;
+        }
+    }
+    while(!event.data2);
+
+    //Clear the EOS flags
+    result = wait_for(splitter, EVENT_BUFFER_FLAG, SPLITTER_OUTPUT_PORT, 0); if(result!=OK) { return result; }
+    result = wait_for(encoder,  EVENT_BUFFER_FLAG, ENCODER_OUTPUT_PORT,  0); if(result!=OK) { return result; }
+
+    burst_report(session, request);
+
+    LOG_MESSAGE("------------------------------------------------");
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code stop_capture(still_session* session)
+{
+    enum error_code result;
+
+    component_t* camera = graph_component(&session->graph, NODE_CAMERA);
+
+    if(!session->capturing)
+        return OK;
+
+    //Disable camera capture port
+    LOG_MESSAGE_COMPONENT(camera, "disabling capture port");
+    result = omx_config_port_capturing(camera->handle, CAMERA_VIDEO_PORT, OMX_FALSE); if(result!=OK) { return result; }
+
+    session->capturing = false;
+
+    return OK;
+}
+
+//The buffers are replaced while the port is disabled, same as a quality
+//change
+static WARN_UNUSED
+enum error_code use_memory(still_session* session, uint8_t* const* memory, size_t size)
+{
+    enum error_code result;
+
+    result = return_output_buffers(session);                  if(result!=OK) { return result; }
+    result = graph_sink_disable(&session->graph, JPEG_SINK);  if(result!=OK) { return result; }
+
+    graph_sink_use_memory(&session->graph, JPEG_SINK, memory, size);
+
+    result = graph_sink_enable(&session->graph, JPEG_SINK);   if(result!=OK) { return result; }
+    result = queue_output_buffers(session);                   if(result!=OK) { return result; }
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code configure_request(still_session* session, still_request* request)
+{
+    enum error_code result;
+
+    //The output port restarts, no frame may be coming meanwhile
+    if(request->use_memory)
+    {
+        result = stop_capture(session); if(result!=OK) { return result; }
+
+        return use_memory(session, request->memory, request->memory_size);
+    }
+
+    if(!request->has_config)
+        return OK;
+
+    result = check_open_settings(session, request->config); if(result!=OK) { return result; }
+
+    //A new quality restarts the encoder output port, no frame may be coming
+    //meanwhile
+    if(request->config.quality != session->current_config.quality)
+    {
+        result = stop_capture(session); if(result!=OK) { return result; }
+    }
+
+    return reconfigure(session, request->config);
+}
+
+static WARN_UNUSED
+enum error_code run_request(still_session* session, still_request* request)
+{
+    enum error_code result;
+
+    result = configure_request(session, request); if(result!=OK) { return result; }
+
+    if(request->frames)
+    {
+        result = shoot(session, request); if(result!=OK) { return result; }
+    }
+
+    return OK;
+}
+
+//Next request to run, NULL if the queue is empty
+static still_request* dequeue_request(still_session* session)
+{
+    pthread_mutex_lock(&session->requests_lock);
+
+    still_request* request = session->requests_first;
+
+    if(request)
+    {
+        session->requests_first = request->next;
+        if(!session->requests_first)
+            session->requests_last = NULL;
+    }
+
+    pthread_mutex_unlock(&session->requests_lock);
+
+    return request;
+}
+
+//Calls the completion handler and wakes up omx_still_wait()
+static void finish_request(still_session* session, still_request* request, enum error_code result)
+{
+    //The capture port is only disabled when there is nothing else to shoot,
+    //a shot queued later enables it again
+    pthread_mutex_lock(&session->requests_lock);
+    bool idle = !session->requests_first;
+    pthread_mutex_unlock(&session->requests_lock);
+
+    if(idle)
+    {
+        enum error_code result_stop = stop_capture(session);
+
+        if(result==OK)
+            result = result_stop;
+    }
+
+    if(request->complete)
+        request->complete(request->context, request, result);
+
+    pthread_mutex_lock(&session->requests_lock);
+
+    if(request->detached)
+    {
+        free(request);
+    }
+    else
+    {
+        request->result = result;
+        request->done   = true;
+    }
+
+    pthread_cond_broadcast(&session->requests_cond);
+    pthread_mutex_unlock(&session->requests_lock);
+
+    uint64_t one = 1;
+    if(write(session->completion_fd, &one, sizeof(one)) != sizeof(one))
+        LOG_ERRNO("write completion_fd");
+}
+
+static void* run(void* arg)
+{
+    enum error_code result;
+    still_session* session = arg;
+
+    pthread_mutex_lock(&session->requests_lock);
+
+    while(1)
+    {
+        still_request* request = session->requests_first;
+
+        if(!request)
+        {
+            //Every queued request runs before stopping
+            if(session->stopping)
+                break;
+
+            pthread_cond_wait(&session->requests_cond, &session->requests_lock);
+            continue;
+        }
+
+        session->requests_first = request->next;
+        if(!session->requests_first)
+            session->requests_last = NULL;
+
+        pthread_mutex_unlock(&session->requests_lock);
+
+        result = run_request(session, request);
+
+        finish_request(session, request, result);
+
+        pthread_mutex_lock(&session->requests_lock);
+    }
+
+    pthread_mutex_unlock(&session->requests_lock);
+
+    return NULL;
+}
+
+//Steps the current request of a polled session, the step is AGAIN until a
+//deadline passes
+static WARN_UNUSED
+enum error_code step_timeout(still_session* session, component_t* component)
+{
+    if(latency_now() < session->deadline)
+        return AGAIN;
+
+    LOG_ERROR_COMPONENT(component, "timeout after %d ms in step %d", component->timeout_ms, session->step);
+
+    return TIMEOUT;
+}
+
+//Runs the current request of a polled session as far as the queued events
+//allow. Returns AGAIN if it has to wait for more, the result of the request
+//otherwise
+static WARN_UNUSED
+enum error_code step_request(still_session* session, still_request* request)
+{
+    enum error_code result;
+    event_t event;
+
+    component_t* splitter = graph_component(&session->graph, NODE_SPLITTER);
+    component_t* encoder  = graph_component(&session->graph, NODE_ENCODER);
+
+    switch(session->step)
+    {
+        case STEP_START:
+            //A quality change still blocks until the output port is restarted
+            result = configure_request(session, request); if(result!=OK) { return result; }
+
+            if(!request->frames)
+                return OK;
+
+            result = start_shot(session, request); if(result!=OK) { return result; }
+
+            session->step     = STEP_FRAMES;
+            session->deadline = latency_now() + encoder->timeout_ms * 1000ULL;
+            //Fall through
+
+        case STEP_FRAMES:
+            //Same as the consumer thread, without the ring. Nothing else
+            //returns buffers while shooting
+            while(1)
+            {
+                result = try_wait(encoder, EVENT_FILL_BUFFER_DONE | EVENT_FRAME_END, &event);
+                if(result==AGAIN)
+                {
+                    result = step_timeout(session, encoder);
+                    if(result!=AGAIN)
+                        abort_shot(session);
+
+                    return result;
+                }
+
+                if(result!=OK)
+                {
+                    abort_shot(session);
+                    return result;
+                }
+
+                session->deadline = latency_now() + encoder->timeout_ms * 1000ULL;
+
+                if(event.event == EVENT_FILL_BUFFER_DONE)
+                {
+                    pthread_mutex_lock(&session->shot_lock);
+                    consume_buffer(session, event.buffer);
+                    pthread_mutex_unlock(&session->shot_lock);
+                }
+                else if(event.data2)
+                {
+                    break;
+                }
+                else
+                {
+                    result = burst_check(session);
+                    if(result!=OK)
+                    {
+                        abort_shot(session);
+                        return result;
+                    }
+                }
+            }
+
+            session->step = STEP_SPLITTER_FLAG;
+            //Fall through
+
+        //Clear the EOS flags
+        case STEP_SPLITTER_FLAG:
+            result = try_wait_for(splitter, EVENT_BUFFER_FLAG, SPLITTER_OUTPUT_PORT, 0);
+            if(result==AGAIN)
+                return step_timeout(session, splitter);
+            if(result!=OK)
+                return result;
+
+            session->step = STEP_ENCODER_FLAG;
+            //Fall through
+
+        case STEP_ENCODER_FLAG:
+            result = try_wait_for(encoder, EVENT_BUFFER_FLAG, ENCODER_OUTPUT_PORT, 0);
+            if(result==AGAIN)
+                return step_timeout(session, encoder);
+            if(result!=OK)
+                return result;
+
+            burst_report(session, request);
+
+            LOG_MESSAGE("------------------------------------------------");
+            return OK;
+    }
+
+    return ERROR;
+}
+
+//Blocks until an event is posted to a polled session or it is time to check
+//the timeouts
+static void poll_events(still_session* session)
+{
+    struct pollfd fd = { .fd = session->event_fd, .events = POLLIN };
+
+    if(poll(&fd, 1, POLL_INTERVAL_MS) < 0 && errno != EINTR)
+        LOG_ERRNO("poll event_fd");
+}
+
+static WARN_UNUSED
+enum error_code start_runner(still_session* session)
+{
+    int result_pthread;
+
+    session->completion_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(session->completion_fd < 0)
+    {
+        LOG_ERRNO("eventfd");
+        return ERROR;
+    }
+
+    result_pthread = pthread_mutex_init(&session->requests_lock, NULL);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR("pthread_mutex_init (%d)", result_pthread);
+        return ERROR;
+    }
+
+    result_pthread = pthread_cond_init(&session->requests_cond, NULL);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR("pthread_cond_init (%d)", result_pthread);
+        return ERROR;
+    }
+
+    if(session->polled)
+    {
+        //Every event of every component wakes up the caller
+        session->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if(session->event_fd < 0)
+        {
+            LOG_ERRNO("eventfd");
+            return ERROR;
+        }
+
+        unsigned i;
+        for(i=0; i<still_graph.nodes_count; i++)
+        {
+            set_notify_fd(graph_component(&session->graph, i), session->event_fd);
+        }
+
+        return OK;
+    }
+
+    result_pthread = pthread_create(&session->runner, NULL, run, session);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR("pthread_create (%d)", result_pthread);
+        return ERROR;
+    }
+
+    session->runner_running = true;
+
+    return OK;
+}
+
+//Runs the requests still queued and stops the runner
+static void stop_runner(still_session* session)
+{
+    if(session->polled)
+    {
+        while(session->current || session->requests_first)
+        {
+            if(omx_still_process_events(session) != OK)
+                break;
+
+            if(session->current || session->requests_first)
+                poll_events(session);
+        }
+
+        unsigned i;
+        for(i=0; i<still_graph.nodes_count; i++)
+        {
+            set_notify_fd(graph_component(&session->graph, i), -1);
+        }
+
+        close(session->event_fd);
+    }
+
+    if(session->runner_running)
+    {
+        pthread_mutex_lock(&session->requests_lock);
+        session->stopping = true;
+        pthread_cond_broadcast(&session->requests_cond);
+        pthread_mutex_unlock(&session->requests_lock);
+
+        pthread_join(session->runner, NULL);
+
+        session->runner_running = false;
+    }
+
+    pthread_cond_destroy(&session->requests_cond);
+    pthread_mutex_destroy(&session->requests_lock);
+    close(session->completion_fd);
+}
+
+static still_request* new_request(const struct camera_shot_configuration* config, const uint32_t frames,
+        const buffer_output_handler handler, const buffer_lend_handler lend_handler, const shot_complete_handler complete,
+        void* context, bool detached)
+{
+    still_request* request = calloc(1, sizeof(*request));
+    if(!request)
+    {
+        LOG_ERRNO("calloc still_request");
+        return NULL;
+    }
+
+    if(config)
+    {
+        request->has_config = true;
+        request->config     = *config;
+    }
+
+    request->frames       = frames;
+    request->handler      = handler;
+    request->lend_handler = lend_handler;
+    request->complete     = complete;
+    request->context      = context;
+    request->detached     = detached;
+
+    return request;
+}
+
+//The runner takes it from now on
+static void push_request(still_session* session, still_request* request)
+{
+    pthread_mutex_lock(&session->requests_lock);
+
+    if(session->requests_last)
+        session->requests_last->next = request;
+    else
+        session->requests_first = request;
+
+    session->requests_last = request;
+
+    pthread_cond_broadcast(&session->requests_cond);
+    pthread_mutex_unlock(&session->requests_lock);
+}
+
+static WARN_UNUSED
+enum error_code queue_request(still_session* session, const struct camera_shot_configuration* config, const uint32_t frames,
+        const buffer_output_handler handler, const buffer_lend_handler lend_handler, const shot_complete_handler complete,
+        void* context, still_request** queued)
+{
+    still_request* request = new_request(config, frames, handler, lend_handler, complete, context, !queued);
+    if(!request)
+        return ERROR;
+
+    push_request(session, request);
+
+    if(queued)
+        *queued = request;
+
+    return OK;
+}
+
+WARN_UNUSED enum error_code omx_still_wait(still_session* session, still_request* request)
+{
+    enum error_code result;
+
+    //Nobody else runs the requests of a polled session
+    while(session->polled && !request->done)
+    {
+        result = omx_still_process_events(session); if(result!=OK) { return result; }
+
+        if(!request->done)
+            poll_events(session);
+    }
+
+    pthread_mutex_lock(&session->requests_lock);
+
+    while(!request->done)
+        pthread_cond_wait(&session->requests_cond, &session->requests_lock);
+
+    pthread_mutex_unlock(&session->requests_lock);
+
+    result = request->result;
+
+    free(request);
+
+    return result;
+}
+
+WARN_UNUSED enum error_code omx_still_shoot_async(still_session* session, const struct camera_shot_configuration* config, const uint32_t frames,
+        const buffer_output_handler handler, const shot_complete_handler complete, void* context, still_request** request)
+{
+    return queue_request(session, config, frames, handler, NULL, complete, context, request);
+}
+
+int omx_still_completion_fd(still_session* session)
+{
+    return session->completion_fd;
+}
+
+int omx_still_event_fd(still_session* session)
+{
+    return session->polled ? session->event_fd : -1;
+}
+
+WARN_UNUSED enum error_code omx_still_process_events(still_session* session)
+{
+    enum error_code result;
+    uint64_t count;
+
+    if(!session->polled)
+    {
+        LOG_ERROR("omx_still_process_events() on a session with its own threads");
+        return ERROR;
+    }
+
+    //Cleared first, anything posted from now on makes it readable again
+    if(read(session->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG_ERRNO("read event_fd");
+
+    while(1)
+    {
+        still_request* request = session->current;
+
+        if(!request)
+        {
+            request = dequeue_request(session);
+            if(!request)
+                return OK;
+
+            session->current = request;
+            session->step    = STEP_START;
+        }
+
+        result = step_request(session, request);
+        if(result==AGAIN)
+            return OK;
+
+        session->current = NULL;
+
+        finish_request(session, request, result);
+    }
+}
+
+//The synchronous calls go through the queue too, so they run in order with
+//the asynchronous shots
+WARN_UNUSED enum error_code omx_still_reconfigure(still_session* session, struct camera_shot_configuration config)
+{
+    enum error_code result;
+    still_request* request;
+
+    result = queue_request(session, &config, 0, NULL, NULL, NULL, NULL, &request); if(result!=OK) { return result; }
+
+    return omx_still_wait(session, request);
+}
+
+WARN_UNUSED enum error_code omx_still_shoot(still_session* session, const uint32_t frames, const buffer_output_handler handler, void* context)
+{
+    enum error_code result;
+    still_request* request;
+
+    result = queue_request(session, NULL, frames, handler, NULL, NULL, context, &request); if(result!=OK) { return result; }
+
+    return omx_still_wait(session, request);
+}
+
+WARN_UNUSED enum error_code omx_still_burst(still_session* session, const uint32_t frames, const uint32_t duration_ms,
+        const buffer_output_handler handler, void* context, still_burst_report* report)
+{
+    if(!frames && !duration_ms)
+    {
+        LOG_ERROR("a burst needs a number of frames or a duration");
+        return ERROR;
+    }
+
+    still_request* request = new_request(NULL, frames ? frames : UINT32_MAX, handler, NULL, NULL, context, false);
+    if(!request)
+        return ERROR;
+
+    request->continuous  = true;
+    request->duration_ms = duration_ms;
+    request->report      = report;
+
+    push_request(session, request);
+
+    return omx_still_wait(session, request);
+}
+
+WARN_UNUSED enum error_code omx_still_shoot_lend(still_session* session, const uint32_t frames, const buffer_lend_handler handler, void* context)
+{
+    enum error_code result;
+    still_request* request;
+
+    result = queue_request(session, NULL, frames, NULL, handler, NULL, context, &request); if(result!=OK) { return result; }
+
+    return omx_still_wait(session, request);
+}
+
+//Logs what the components negotiated. They are asked directly, not through
+//the cache
+static WARN_UNUSED
+enum error_code dump_ports(still_session* session)
+{
+    enum error_code result;
+
+    component_t* camera    = graph_component(&session->graph, NODE_CAMERA);
+    component_t* null_sink = graph_component(&session->graph, NODE_NULL_SINK);
+    component_t* splitter  = graph_component(&session->graph, NODE_SPLITTER);
+    component_t* encoder   = graph_component(&session->graph, NODE_ENCODER);
+
+    result = dump_port_defs(   camera->handle, CAMERA_PREVIEW_PORT ); if(result!=OK) { return result; }
+    result = dump_port_defs(   camera->handle, CAMERA_VIDEO_PORT   ); if(result!=OK) { return result; }
+    result = dump_port_defs(null_sink->handle, NULL_SINK_INPUT_PORT); if(result!=OK) { return result; }
+    result = dump_port_defs( splitter->handle, SPLITTER_INPUT_PORT ); if(result!=OK) { return result; }
+    result = dump_port_defs( splitter->handle, SPLITTER_OUTPUT_PORT); if(result!=OK) { return result; }
+    result = dump_port_defs(  encoder->handle, ENCODER_INPUT_PORT  ); if(result!=OK) { return result; }
+    result = dump_port_defs(  encoder->handle, ENCODER_OUTPUT_PORT ); if(result!=OK) { return result; }
+
+    result = dump_port_frame_size(   camera->handle, CAMERA_PREVIEW_PORT); if(result!=OK) { return result; }
+    result = dump_port_frame_size(   camera->handle, CAMERA_VIDEO_PORT  ); if(result!=OK) { return result; }
+    result = dump_port_frame_size(   camera->handle, CAMERA_STILL_PORT  ); if(result!=OK) { return result; }
+
+    return OK;
+}
+
+//The port cache only saves round trips, the open goes on without it when
+//the file cannot be read or written
+
+static void port_cache_load(void)
+{
+    pthread_mutex_lock(&library_lock);
+
+    if(port_cache_path && !port_cache_loaded)
+    {
+        if(load_port_defaults(port_cache_path) != OK)
+            LOG_ERROR("%s: port definitions not loaded", port_cache_path);
+
+        port_cache_loaded = true;
+    }
+
+    pthread_mutex_unlock(&library_lock);
+}
+
+static void port_cache_save(void)
+{
+    pthread_mutex_lock(&library_lock);
+
+    if(port_cache_path && save_port_defaults(port_cache_path) != OK)
+        LOG_ERROR("%s: port definitions not saved", port_cache_path);
+
+    pthread_mutex_unlock(&library_lock);
+}
+
+void omx_still_diagnostics(int enabled)
+{
+    pthread_mutex_lock(&library_lock);
+    diagnostics = enabled;
+    pthread_mutex_unlock(&library_lock);
+}
+
+WARN_UNUSED enum error_code omx_still_port_cache(const char* path)
+{
+    char* copy = NULL;
+
+    if(path)
+    {
+        copy = strdup(path);
+        if(!copy)
+        {
+            LOG_ERRNO("strdup");
+            return ERROR;
+        }
+    }
+
+    pthread_mutex_lock(&library_lock);
+
+    free(port_cache_path);
+    port_cache_path   = copy;
+    port_cache_loaded = false;
+
+    pthread_mutex_unlock(&library_lock);
+
+    return OK;
+}
+
+static WARN_UNUSED
+enum error_code open_session(struct camera_shot_configuration config, bool polled, still_session** opened)
+{
+    enum error_code result;
+
+    *opened = NULL;
+
+    still_session* session = calloc(1, sizeof(*session));
+    if(!session)
+    {
+        LOG_ERRNO("calloc still_session");
+        return ERROR;
+    }
+
+    //The hooks configure the components from them
+    session->current_config = config;
+
+    result = frame_geometry(config, &session->geometry);
+    if(result!=OK)
+    {
+        free(session);
+        return result;
+    }
+
+    const graph_hooks_t hooks =
+    {
+        .configure = configure_node,
+        .tunneled  = configure_tunnel,
+        .context   = session
+    };
+
+    result = library_acquire();
+    if(result!=OK)
+    {
+        free(session);
+        return result;
+    }
+
+    port_cache_load();
+
+    //Load, configure and tunnel the components, then take them to EXECUTING.
+    //On failure the session is not released, the components may still call
+    //back into it. Neither is the library, OMX_Deinit() can't run under
+    //loaded components: after a failure past the first component, here or
+    //below, the session and the library reference are leaked
+    result = graph_open(&session->graph, &still_graph, &hooks);
+    if(result!=OK)
+    {
+        //Nothing can call back before the first component is loaded
+        if(!components_loaded(&session->graph))
+        {
+            free(session);
+
+            if(library_release()!=OK)
+                LOG_ERROR("library release after a failed open");
+        }
+
+        return result;
+    }
+
+    session->polled = polled;
+
+    int result_pthread = pthread_mutex_init(&session->shot_lock, NULL);
+    if(result_pthread!=0)
+    {
+        LOG_ERROR("pthread_mutex_init (%d)", result_pthread);
+        return ERROR;
+    }
+
+    //A polled session takes the buffers from the event queue
+    if(!polled)
+    {
+        result = start_consumer(session); if(result!=OK) { return result; }
+    }
+
+    result = queue_output_buffers(session); if(result!=OK) { return result; }
+    result = start_runner(session);         if(result!=OK) { return result; }
+
+    pthread_mutex_lock(&library_lock);
+    bool dump = diagnostics;
+    pthread_mutex_unlock(&library_lock);
+
+    if(dump)
+    {
+        result = dump_ports(session); if(result!=OK) { return result; }
+    }
+
+    port_cache_save();
+
+    *opened = session;
+
+    return OK;
+}
+
+WARN_UNUSED enum error_code omx_still_open(struct camera_shot_configuration config, still_session** opened)
+{
+    return open_session(config, false, opened);
+}
+
+WARN_UNUSED enum error_code omx_still_open_polled(struct camera_shot_configuration config, still_session** opened)
+{
+    return open_session(config, true, opened);
+}
+
+WARN_UNUSED enum error_code omx_still_release(still_session* session, still_buffer* buffer)
+{
+    unsigned index = buffer - session->lent;
+
+    if(index >= JPEG_OUTPUT_BUFFERS)
+    {
+        LOG_ERROR("release of a buffer not lent by the session");
+        return ERROR;
+    }
+
+    //Released twice or never lent, the encoder already owns it
+    if(!__atomic_exchange_n(&session->lent_out[index], false, __ATOMIC_ACQ_REL))
+    {
+        LOG_ERROR("release of output buffer %u which is not lent", index);
+        return ERROR;
+    }
+
+    __atomic_sub_fetch(&session->output_buffers_lent, 1, __ATOMIC_ACQ_REL);
+
+    return requeue_output_buffer(session, graph_sink_buffers(&session->graph, JPEG_SINK)[index]);
+}
+
+WARN_UNUSED enum error_code omx_still_output_buffer_size(still_session* session, size_t* size)
+{
+    enum error_code result;
+
+    component_t* encoder = graph_component(&session->graph, NODE_ENCODER);
+
+    OMX_PARAM_PORTDEFINITIONTYPE port_def;
+
+    result = get_port_definition(encoder, ENCODER_OUTPUT_PORT, &port_def); if(result!=OK) { return result; }
+
+    *size = port_def.nBufferSize;
+
+    return OK;
+}
+
+//Runs in order with the queued shots, as omx_still_reconfigure() does
+WARN_UNUSED enum error_code omx_still_use_memory(still_session* session, uint8_t* const* memory, size_t size)
+{
+    still_request* request = new_request(NULL, 0, NULL, NULL, NULL, NULL, false);
+    if(!request)
+        return ERROR;
+
+    request->use_memory  = true;
+    request->memory      = memory;
+    request->memory_size = size;
+
+    push_request(session, request);
+
+    return omx_still_wait(session, request);
+}
+
+WARN_UNUSED enum error_code omx_still_close(still_session* session)
+{
+    enum error_code result;
+
+    //The queued shots are done first
+    stop_runner(session);
+
+    //Get the output buffers back before stopping the encoder
+    result = return_output_buffers(session); if(result!=OK) { return result; }
+
+    stop_consumer(session);
+
+    pthread_mutex_destroy(&session->shot_lock);
+
+    //Take the components back to LOADED and release them
+    result = graph_close(&session->graph); if(result!=OK) { return result; }
+
+    free(session);
+
+    //How long every command and buffer took, of all the sessions
+    latency_dump();
+
+    uint64_t sent, skipped;
+    omx_config_counters(&sent, &skipped);
+    LOG_MESSAGE("settings sent: %llu, skipped as unchanged: %llu", (unsigned long long)sent, (unsigned long long)skipped);
+
+    uint64_t read, cached;
+    port_definition_counters(&read, &cached);
+    LOG_MESSAGE("port definitions read: %llu, cached: %llu", (unsigned long long)read, (unsigned long long)cached);
+
+    return library_release();
+}
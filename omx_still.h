@@ -20,14 +20,156 @@ struct camera_shot_configuration {
     int8_t  saturation;
     int8_t  drc;
     int8_t  whiteBalance;
+    //Sensor used by the session, 0 .. 1 (Compute Module). Fixed by
+    //omx_still_open()
+    int8_t  cameraNumber;
+    //How the sensor is read, enum camera_sensor_mode. Fixed by
+    //omx_still_open()
+    int8_t  sensorMode;
+    //Size of the frames, after the rotation. 0x0 is the size of the sensor
+    //mode (3280x2464 full, 1640x1232 binned), rotated. Fixed by
+    //omx_still_open()
+    uint16_t width;
+    uint16_t height;
+    //Clockwise, 0, 90, 180 or 270 degrees. Fixed by omx_still_open()
+    int16_t  rotation;
+};
+
+//Sensor readout, the values of the camera custom sensor config. The frames
+//of the binned mode are read and encoded several times faster
+enum camera_sensor_mode {
+    //The firmware chooses from the size of the frames
+    CAMERA_SENSOR_MODE_AUTO   = 0,
+    //Every pixel, the full field of view
+    CAMERA_SENSOR_MODE_FULL   = 2,
+    //2x2 binned, the full field of view at half the width and height
+    CAMERA_SENSOR_MODE_BINNED = 4
 };
 
 /******************************************************************************/
 
-typedef void (*buffer_output_handler)(const uint32_t frame, const uint8_t * const buffer, const size_t length);
+//A capture pipeline, with its own components, buffers and settings. Several
+//sessions can be open in the same process
+typedef struct still_session still_session;
+
+//Encoder output buffers of a session
+#define OMX_STILL_OUTPUT_BUFFERS 4
+
+//The context is the pointer given to omx_still_shoot(). The buffer is only
+//valid during the call. A buffer with the end of a frame and the start of the
+//next one is passed in two calls. The handlers are called from a thread of
+//the session while omx_still_shoot() waits for the frames
+typedef void (*buffer_output_handler)(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length);
+
+//A filled encoder output buffer lent to the consumer by
+//omx_still_shoot_lend(), the encoder gets it back with omx_still_release()
+typedef struct
+{
+    //Frame of the first byte
+    uint32_t       frame;
+    const uint8_t* data;
+    size_t         length;
+    //Bytes up to the end of the frame (its EOI included), the rest is the
+    //start of the next frame. 0 when the frame goes on in the next buffer
+    size_t         frame_end;
+    //Last buffer of the shot
+    int            end_of_stream;
+} still_buffer;
+
+//The context is the pointer given to omx_still_shoot_lend()
+typedef void (*buffer_lend_handler)(void* context, still_buffer* buffer);
+
+//A shot queued with omx_still_shoot_async()
+typedef struct still_request still_request;
+
+//Called once the shot of the request is done, with its result. The context
+//is the pointer given to omx_still_shoot_async()
+typedef void (*shot_complete_handler)(void* context, still_request* request, enum error_code result);
+
+//Process wide options, read by the next opens. With diagnostics the
+//definition of every port and the frame sizes of the camera are logged once
+//the session is open, ten more round trips to the VideoCore. Off by default
+void omx_still_diagnostics(int enabled);
+//File the port definitions of the newly loaded components are kept in, the
+//next opens (of this process or another one) take them from it instead of
+//asking the components. The file is only valid for the firmware it was
+//written with, it must be removed on an update. NULL (the default) always
+//asks the components
+WARN_UNUSED enum error_code omx_still_port_cache(const char* path);
+
+WARN_UNUSED enum error_code omx_still_open(struct camera_shot_configuration config, still_session** session);
+WARN_UNUSED enum error_code omx_still_close(still_session* session);
+//Applies the settings to the open pipeline. Fails if the sensor, its mode,
+//the size or the rotation differ from the ones of the open
+WARN_UNUSED enum error_code omx_still_reconfigure(still_session* session, struct camera_shot_configuration config);
+WARN_UNUSED enum error_code omx_still_shoot(still_session* session, const uint32_t frames, const buffer_output_handler handler, void* context);
+
+//What a continuous burst achieved
+typedef struct
+{
+    //Passed to the handler
+    uint32_t frames;
+    //Taken by the sensor between them but lost, the splitter drops the frames
+    //the encoder has no room for. Counted from the timestamps
+    uint32_t dropped;
+    //Encoded after the end of the burst, not passed to the handler
+    uint32_t overrun;
+    //From the first to the last frame passed, by their timestamps
+    uint64_t duration_us;
+    double   fps;
+} still_burst_report;
+
+//Same as omx_still_shoot() with the splitter streaming instead of stepping:
+//the frames come at the frame rate of the sensor (15 fps), the encoding of a
+//frame overlaps the readout of the next one. Ends after frames frames or with
+//the last frame started within duration_ms, 0 is no limit (not both). The
+//end is set one frame ahead, a frame already on its way when it could not
+//be is drained, not passed to the handler. report may be NULL
+WARN_UNUSED enum error_code omx_still_burst(still_session* session, const uint32_t frames, const uint32_t duration_ms,
+        const buffer_output_handler handler, void* context, still_burst_report* report);
+
+//Same as omx_still_shoot() without copies: each buffer stays with the
+//consumer until it is released, from any thread. The encoder stops when all
+//the buffers are lent, they must be released before the waits time out
+WARN_UNUSED enum error_code omx_still_shoot_lend(still_session* session, const uint32_t frames, const buffer_lend_handler handler, void* context);
+WARN_UNUSED enum error_code omx_still_release(still_session* session, still_buffer* buffer);
+
+//Same as omx_still_open() without threads of its own: the queued requests
+//only run from omx_still_process_events() and omx_still_wait(), and the
+//handlers are called from them. Open, close and a quality change still
+//block
+WARN_UNUSED enum error_code omx_still_open_polled(struct camera_shot_configuration config, still_session** session);
+//eventfd of a polled session (-1 otherwise), readable when any component
+//posts an event or returns a buffer
+int omx_still_event_fd(still_session* session);
+//Never blocks, runs the requests of a polled session as far as the events
+//received allow. To be called when the event fd is readable, and at least
+//every few hundred milliseconds while a request is pending to detect the
+//timeouts
+WARN_UNUSED enum error_code omx_still_process_events(still_session* session);
+
+//Queues a shot and returns right away. The shots run one after the other in
+//a thread of the session, the capture port stays enabled between them. If
+//config is not NULL it is applied first, as omx_still_reconfigure() does.
+//handler (may be NULL) is called with the buffers and complete (may be NULL)
+//when the shot is done, both from the thread of the session. With request
+//NULL the request is released on its own, otherwise it must be given to
+//omx_still_wait()
+WARN_UNUSED enum error_code omx_still_shoot_async(still_session* session, const struct camera_shot_configuration* config, const uint32_t frames,
+        const buffer_output_handler handler, const shot_complete_handler complete, void* context, still_request** request);
+//Blocks until the shot of the request is done, returns its result and
+//releases the request
+WARN_UNUSED enum error_code omx_still_wait(still_session* session, still_request* request);
+//eventfd counting the requests completed, readable when one is done, to
+//wait with poll() or epoll instead of omx_still_wait()
+int omx_still_completion_fd(still_session* session);
 
-WARN_UNUSED enum error_code omx_still_open(struct camera_shot_configuration config);
-WARN_UNUSED enum error_code omx_still_close(void);
-WARN_UNUSED enum error_code omx_still_shoot(const uint32_t frames, const buffer_output_handler handler);
+//Size of every output buffer, at least
+WARN_UNUSED enum error_code omx_still_output_buffer_size(still_session* session, size_t* size);
+//Makes the encoder write into the given memory, OMX_STILL_OUTPUT_BUFFERS
+//blocks of size bytes, aligned to 16 bytes. NULL goes back to the memory of
+//the encoder. No buffer can be lent meanwhile. Queued as a request, it
+//waits for the shots queued before it
+WARN_UNUSED enum error_code omx_still_use_memory(still_session* session, uint8_t* const* memory, size_t size);
 
 #endif
@@ -0,0 +1,292 @@
+#include "pretrigger.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "logerr.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//Oldest frame of the ring, NULL if empty. Must be called with the lock held
+static frame_t* ring_pop(pretrigger_t* pretrigger)
+{
+    if(!pretrigger->ring_count)
+        return NULL;
+
+    frame_t* frame = pretrigger->ring[pretrigger->ring_head];
+
+    pretrigger->ring_head = (pretrigger->ring_head + 1) % PRETRIGGER_FRAMES_MAX;
+    pretrigger->ring_count--;
+
+    return frame;
+}
+
+//The frame being received needs memory, the oldest frame of the ring goes
+static int reclaim(void* context)
+{
+    pretrigger_t* pretrigger = context;
+
+    pthread_mutex_lock(&pretrigger->lock);
+
+    frame_t* frame = ring_pop(pretrigger);
+
+    if(frame)
+        pretrigger->recycled++;
+
+    pthread_mutex_unlock(&pretrigger->lock);
+
+    if(!frame)
+        return 0;
+
+    frame_release(pretrigger->pool, frame);
+
+    return 1;
+}
+
+//Keeps the complete frames of the sink or hands them to the output
+static void take_frames(pretrigger_t* pretrigger)
+{
+    //The ring, the frame taken and what was taken before the trigger
+    frame_t* out[PRETRIGGER_FRAMES_MAX + 1];
+    bool     out_pre[PRETRIGGER_FRAMES_MAX + 1];
+    frame_t* frame;
+
+    while((frame = frame_sink_take(&pretrigger->sink)))
+    {
+        frame_t* recycle = NULL;
+        unsigned count = 0;
+
+        pthread_mutex_lock(&pretrigger->lock);
+
+        pretrigger->frames++;
+
+        if(pretrigger->trigger)
+        {
+            frame_t* held;
+
+            while((held = ring_pop(pretrigger)))
+            {
+                out_pre[count] = true;
+                out[count++]   = held;
+            }
+        }
+
+        bool pre = frame->timestamp < pretrigger->trigger;
+
+        if(frame->truncated)
+        {
+            pretrigger->dropped++;
+            recycle = frame;
+        }
+        else if(pretrigger->trigger && (pre || pretrigger->remaining))
+        {
+            out_pre[count] = pre;
+            out[count++]   = frame;
+
+            if(!pre && --pretrigger->remaining == 0)
+                pretrigger->trigger = 0;
+        }
+        else
+        {
+            //Started after the post frames, the ring fills again
+            pretrigger->trigger = 0;
+
+            if(pretrigger->ring_count == pretrigger->pre)
+            {
+                recycle = pretrigger->pre ? ring_pop(pretrigger) : frame;
+                pretrigger->recycled++;
+            }
+
+            if(pretrigger->pre)
+            {
+                pretrigger->ring[(pretrigger->ring_head + pretrigger->ring_count) % PRETRIGGER_FRAMES_MAX] = frame;
+                pretrigger->ring_count++;
+            }
+        }
+
+        pretrigger->output_frames += count;
+
+        pthread_mutex_unlock(&pretrigger->lock);
+
+        if(recycle)
+            frame_release(pretrigger->pool, recycle);
+
+        unsigned i;
+        for(i=0; i<count; i++)
+            pretrigger->output(pretrigger->context, out[i], out_pre[i]);
+    }
+}
+
+static void receive(void* context, const uint32_t frame, const uint8_t * const buffer, const size_t length)
+{
+    pretrigger_t* pretrigger = context;
+
+    frame_sink_receive(&pretrigger->sink, frame, buffer, length);
+
+    take_frames(pretrigger);
+}
+
+static WARN_UNUSED
+enum error_code queue_shot(pretrigger_t* pretrigger);
+
+static void complete(void* context, still_request* request, enum error_code result)
+{
+    pretrigger_t* pretrigger = context;
+
+    //The truncated frames are counted with the others
+    if(frame_sink_finish(&pretrigger->sink)!=OK)
+        LOG_MESSAGE("pretrigger: frames lost for lack of memory");
+
+    take_frames(pretrigger);
+
+    pthread_mutex_lock(&pretrigger->lock);
+
+    if(result!=OK)
+    {
+        pretrigger->result  = result;
+        pretrigger->running = false;
+    }
+
+    //The next one, the other queued shot runs meanwhile
+    if(pretrigger->running && queue_shot(pretrigger)!=OK)
+    {
+        pretrigger->result  = ERROR;
+        pretrigger->running = false;
+    }
+
+    pretrigger->shots--;
+
+    pthread_cond_broadcast(&pretrigger->stopped);
+    pthread_mutex_unlock(&pretrigger->lock);
+}
+
+//Must be called with the lock held
+static WARN_UNUSED
+enum error_code queue_shot(pretrigger_t* pretrigger)
+{
+    enum error_code result;
+
+    result = omx_still_shoot_async(pretrigger->session, NULL, pretrigger->shot_frames, receive, complete, pretrigger, NULL); if(result!=OK) { return result; }
+
+    pretrigger->shots++;
+
+    return OK;
+}
+
+enum error_code pretrigger_start(pretrigger_t* pretrigger, still_session* session, frame_pool_t* pool, uint32_t shot_frames,
+        unsigned pre, unsigned post, pretrigger_output output, void* context)
+{
+    enum error_code result;
+
+    if(pre > PRETRIGGER_FRAMES_MAX || !shot_frames)
+    {
+        LOG_ERROR("pretrigger: %u frames before the trigger (at most %d), %u per shot", pre, PRETRIGGER_FRAMES_MAX, shot_frames);
+        return ERROR;
+    }
+
+    memset(pretrigger, 0, sizeof(*pretrigger));
+
+    pretrigger->session     = session;
+    pretrigger->pool        = pool;
+    pretrigger->shot_frames = shot_frames;
+    pretrigger->pre         = pre;
+    pretrigger->post        = post;
+    pretrigger->output      = output;
+    pretrigger->context     = context;
+    pretrigger->running     = true;
+    pretrigger->result      = OK;
+
+    result = frame_pool_fill(pool); if(result!=OK) { return result; }
+
+    frame_sink_init(&pretrigger->sink, pool);
+    frame_sink_reclaim(&pretrigger->sink, reclaim, pretrigger);
+
+    pthread_mutex_init(&pretrigger->lock, NULL);
+    pthread_cond_init(&pretrigger->stopped, NULL);
+
+    pthread_mutex_lock(&pretrigger->lock);
+
+    unsigned i;
+    for(i=0; i<PRETRIGGER_SHOTS && result==OK; i++)
+        result = queue_shot(pretrigger);
+
+    if(result!=OK)
+        pretrigger->running = false;
+
+    pthread_mutex_unlock(&pretrigger->lock);
+
+    //The queued ones run anyway
+    if(result!=OK && pretrigger_stop(pretrigger)!=OK)
+        return ERROR;
+
+    return result;
+}
+
+enum error_code pretrigger_stop(pretrigger_t* pretrigger)
+{
+    pthread_mutex_lock(&pretrigger->lock);
+
+    pretrigger->running = false;
+
+    while(pretrigger->shots)
+        pthread_cond_wait(&pretrigger->stopped, &pretrigger->lock);
+
+    //A trigger still waiting for a complete frame gets the ring now, else
+    //the frames before the event would be lost
+    frame_t* out[PRETRIGGER_FRAMES_MAX];
+    unsigned count = 0;
+    frame_t* frame;
+
+    while((frame = ring_pop(pretrigger)))
+    {
+        if(pretrigger->trigger)
+            out[count++] = frame;
+        else
+            frame_release(pretrigger->pool, frame);
+    }
+
+    pretrigger->trigger = 0;
+    pretrigger->output_frames += count;
+
+    enum error_code result = pretrigger->result;
+
+    pthread_mutex_unlock(&pretrigger->lock);
+
+    unsigned i;
+    for(i=0; i<count; i++)
+        pretrigger->output(pretrigger->context, out[i], true);
+
+    frame_sink_deinit(&pretrigger->sink);
+
+    LOG_MESSAGE("pretrigger: %llu frames, %llu triggers, %llu frames to the output, %llu recycled, %llu dropped",
+            (unsigned long long)pretrigger->frames,
+            (unsigned long long)pretrigger->triggers,
+            (unsigned long long)pretrigger->output_frames,
+            (unsigned long long)pretrigger->recycled,
+            (unsigned long long)pretrigger->dropped);
+
+    pthread_cond_destroy(&pretrigger->stopped);
+    pthread_mutex_destroy(&pretrigger->lock);
+
+    return result;
+}
+
+void pretrigger_trigger(pretrigger_t* pretrigger)
+{
+    pthread_mutex_lock(&pretrigger->lock);
+
+    //A trigger during the post frames extends them
+    if(!pretrigger->trigger)
+        pretrigger->trigger = now_ns();
+
+    pretrigger->remaining = pretrigger->post;
+    pretrigger->triggers++;
+
+    pthread_mutex_unlock(&pretrigger->lock);
+}
@@ -0,0 +1,92 @@
+#ifndef  PRETRIGGER_INC
+#define  PRETRIGGER_INC
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "frame_sink.h"
+#include "omx_still.h"
+
+/*
+   Captures without end and keeps the last frames, to save the seconds before
+   an event.
+
+   The session shoots continuously: PRETRIGGER_SHOTS shots are always queued
+   with omx_still_shoot_async(), so the capture port stays enabled and a new
+   shot starts as soon as the previous one is done. The frames are received
+   in a pool filled up front and kept in a ring of the last pre frames, the
+   oldest one goes back to the pool when a new one is complete or when the
+   frame being received needs its memory. Nothing is allocated once running.
+
+   A trigger hands the frames of the ring, taken before it, to the output
+   then the next post frames as they are complete. A trigger during the post
+   frames extends them. Until the output releases them the frames hold
+   memory of the pool, the ring gets smaller meanwhile: the pool must be
+   large enough for the ring, the post frames and the frames the output is
+   still writing.
+   */
+
+//Most frames kept before the trigger
+#define PRETRIGGER_FRAMES_MAX 64
+//Shots queued at once
+#define PRETRIGGER_SHOTS      2
+
+//Called with every frame given to the output, from the thread of the
+//session, in order. The output releases the frame. pre is whether it was
+//taken before the trigger
+typedef void (*pretrigger_output)(void* context, frame_t* frame, bool pre);
+
+typedef struct
+{
+    still_session*    session;
+    frame_pool_t*     pool;
+    frame_sink_t      sink;
+    //Frames per shot, a frame is complete when the next one starts or at the
+    //end of its shot
+    uint32_t          shot_frames;
+    unsigned          pre;
+    unsigned          post;
+    pretrigger_output output;
+    void*             context;
+    //Guards everything below, the ring is shared with the reclaim of the
+    //sink and with pretrigger_trigger()
+    pthread_mutex_t   lock;
+    pthread_cond_t    stopped;
+    //Oldest first
+    frame_t*          ring[PRETRIGGER_FRAMES_MAX];
+    unsigned          ring_head;
+    unsigned          ring_count;
+    //CLOCK_REALTIME of the pending trigger in nanoseconds, 0 if none
+    uint64_t          trigger;
+    //Frames after the trigger still to hand to the output
+    unsigned          remaining;
+    bool              running;
+    //Shots queued and not complete
+    unsigned          shots;
+    enum error_code   result;
+    //Totals since the start: frames complete, given back from the ring
+    //without being used, lost for lack of memory, given to the output, and
+    //the triggers
+    uint64_t          frames;
+    uint64_t          recycled;
+    uint64_t          dropped;
+    uint64_t          output_frames;
+    uint64_t          triggers;
+} pretrigger_t;
+
+//Starts shooting on the session, already open. The pool is filled up to its
+//cap. Keeps the last pre frames (at most PRETRIGGER_FRAMES_MAX)
+WARN_UNUSED enum error_code pretrigger_start(pretrigger_t* pretrigger, still_session* session, frame_pool_t* pool, uint32_t shot_frames,
+        unsigned pre, unsigned post, pretrigger_output output, void* context);
+//Stops queuing shots and waits for the queued ones. The frames of the ring
+//go to the output if a trigger is pending, else they are released. The post
+//frames not complete yet are lost. Fails if a shot failed
+WARN_UNUSED enum error_code pretrigger_stop(pretrigger_t* pretrigger);
+
+//From any thread. The frames of the ring go to the output with the next
+//complete frame, the frames started from now on are the post ones
+void pretrigger_trigger(pretrigger_t* pretrigger);
+
+#endif